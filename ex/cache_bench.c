@@ -0,0 +1,182 @@
+/*
+ * Answer cache engine against a naive cache of reply lists.
+ *
+ * Both hold N names with two A records each. The naive one is a chained
+ * hash of nodes, each with its own name string and an ev_ares_a_reply
+ * list with a host string per record, the way replies come out of the
+ * parsers. Reports ns per lookup over random hits and heap bytes per entry.
+ *
+ * What the engine saves is memory: each entry is one allocation with the
+ * records packed in wire format, against six here. Lookups come out on
+ * par, within noise of each other: once the entries outgrow the CPU caches,
+ * both take a miss on the index and one on the entry's few lines per hit.
+ * The naive lists are allocated back to back here, so they do not pay for
+ * the heap fragmentation they would get in a long running process either.
+ *
+ *   cache_bench [entries] [lookups]
+ */
+
+#include "libevares.c"
+
+#include <stdio.h>
+#include <malloc.h>
+#include <time.h>
+
+struct naive_node {
+	struct naive_node      *next;
+	char                   *name;
+	int                     type;
+	ev_tstamp               expires;
+	struct ev_ares_a_reply *a;
+};
+
+struct naive_cache {
+	struct naive_node **buckets;
+	unsigned int        mask;
+};
+
+static size_t heap_used(void) {
+#ifdef __GLIBC__
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void naive_put(struct naive_cache *c, const char *name, int type, struct ev_ares_a_reply *a, ev_tstamp expires) {
+	unsigned int h = ev_ares_cache_hash(name, type);
+	struct naive_node *n = malloc(sizeof(struct naive_node));
+	n->name    = strdup(name);
+	n->type    = type;
+	n->expires = expires;
+	n->a       = a;
+	n->next    = c->buckets[ h & c->mask ];
+	c->buckets[ h & c->mask ] = n;
+}
+
+static struct naive_node * naive_get(struct naive_cache *c, const char *name, int type) {
+	struct naive_node *n = c->buckets[ ev_ares_cache_hash(name, type) & c->mask ];
+	for (; n; n = n->next) if (n->type == type && !strcasecmp(n->name, name)) return n;
+	return NULL;
+}
+
+static void naive_free(struct naive_cache *c) {
+	struct naive_node *n, *next;
+	unsigned int i;
+	for (i = 0; i <= c->mask; i++) {
+		for (n = c->buckets[i]; n; n = next) {
+			next = n->next;
+			ev_ares_free_a_reply(n->a);
+			free(n->name);
+			free(n);
+		}
+	}
+	free(c->buckets);
+}
+
+int main(int argc, char **argv) {
+	int entries = argc > 1 ? atoi(argv[1]) : 1000000;
+	int lookups = argc > 2 ? atoi(argv[2]) : 5000000;
+	unsigned char rdata[4];
+	unsigned char ptr[2] = { 0xc0, HFIXEDSZ };  // compressed pointer to the question name
+	unsigned char f[RRFIXEDSZ];
+	char **names, name[64];
+	unsigned int *order, x = 2463534242u;
+	struct ev_ares_cache *cache;
+	struct naive_cache naive;
+	struct ev_ares_a_reply *a, *r;
+	ev_ares_wbuf wb = { NULL, 0, 0 };
+	ev_ares_stats stats = { 0 };
+	size_t base, used_cache, used_naive;
+	double t, ns_cache, ns_naive;
+	long found = 0;
+	int i, j;
+
+	names = malloc(entries * sizeof(char *));
+	order = malloc(lookups * sizeof(unsigned int));
+	for (i = 0; i < entries; i++) {
+		snprintf(name, sizeof(name), "host%d.example.com", i);
+		names[i] = strdup(name);
+	}
+	for (i = 0; i < lookups; i++) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		order[i] = x % entries;
+	}
+
+	base = heap_used();
+	cache = ev_ares_cache_new(entries, EV_ARES_CACHE_LRU, &stats);
+	for (i = 0; i < entries; i++) {
+		wb.len = 0;
+		ev_ares_wbuf_header(&wb, names[i], T_A, 2);
+		for (j = 0; j < 2; j++) {
+			rdata[0] = 10; rdata[1] = i >> 16; rdata[2] = i >> 8; rdata[3] = j;
+			DNS_RR_SET_TYPE(f, T_A);
+			DNS_RR_SET_CLASS(f, C_IN);
+			DNS_RR_SET_TTL(f, 300);
+			DNS_RR_SET_LEN(f, 4);
+			ev_ares_wbuf_put(&wb, ptr, 2);
+			ev_ares_wbuf_put(&wb, f, RRFIXEDSZ);
+			ev_ares_wbuf_put(&wb, rdata, 4);
+		}
+		ev_ares_cache_put(cache, names[i], T_A, wb.buf, wb.len, 300, 0);
+	}
+	used_cache = heap_used() - base;
+	free(wb.buf);
+
+	base = heap_used();
+	naive.mask = 15;
+	while (naive.mask < (unsigned int) entries) naive.mask = naive.mask << 1 | 1;
+	naive.buckets = calloc(naive.mask + 1, sizeof(struct naive_node *));
+	for (i = 0; i < entries; i++) {
+		a = NULL;
+		for (j = 1; j >= 0; j--) {
+			r = malloc(sizeof(struct ev_ares_a_reply));
+			r->host = strdup(names[i]);
+			r->ip.s_addr = htonl(10u << 24 | (i & 0xffff) << 8 | j);
+			r->ttl  = 300;
+			r->next = a;
+			a = r;
+		}
+		naive_put(&naive, names[i], T_A, a, 300);
+	}
+	used_naive = heap_used() - base;
+
+	// a hit reads every address and TTL
+	t = now_ns();
+	for (i = 0; i < lookups; i++) {
+		struct ev_ares_cache_entry *e = ev_ares_cache_get(cache, names[ order[i] ], T_A, 1);
+		const unsigned char *p = ev_ares_entry_data(e) + e->len;
+		for (j = 0; j < 2; j++) {
+			p -= 4;
+			found += p[3] + DNS_RR_TTL(p - RRFIXEDSZ);
+			p -= RRFIXEDSZ + 2;
+		}
+	}
+	ns_cache = (now_ns() - t) / lookups;
+
+	t = now_ns();
+	for (i = 0; i < lookups; i++) {
+		struct naive_node *n = naive_get(&naive, names[ order[i] ], T_A);
+		for (r = n->a; r; r = r->next) found += (ntohl(r->ip.s_addr) & 0xff) + r->ttl;
+	}
+	ns_naive = (now_ns() - t) / lookups;
+
+	printf("%d entries, %d lookups (checksum %ld)\n", entries, lookups, found);
+	printf("%-12s %8s %12s\n", "engine", "ns/get", "bytes/entry");
+	printf("%-12s %8.1f %12.1f\n", "cache", ns_cache, (double) used_cache / entries);
+	printf("%-12s %8.1f %12.1f\n", "naive", ns_naive, (double) used_naive / entries);
+
+	ev_ares_cache_free(cache);
+	naive_free(&naive);
+	for (i = 0; i < entries; i++) free(names[i]);
+	free(names);
+	free(order);
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Replays a name trace through the answer cache under each eviction policy.
+ *
+ * The trace is a file with one name per line, for instance the names column
+ * of a query log; a name that misses is stored as if just resolved. Without
+ * a file a synthetic trace is used: hot service names with a Zipf-like
+ * popularity, interleaved with a crawler scan of names seen only once.
+ *
+ *   cache_policy_bench [cache size] [trace file]
+ */
+
+#include "libevares.c"
+
+#include <stdio.h>
+#include <math.h>
+
+#define HOT      50000
+#define ACCESSES 4000000
+
+static const char *policies[] = { "lru", "tinylfu" };
+
+static char ** synthetic_trace(int *count) {
+	char **trace = malloc(ACCESSES * sizeof(char *)), name[64];
+	double *cdf = malloc(HOT * sizeof(double)), sum = 0, u;
+	unsigned int x = 88172645u;
+	int i, lo, hi, mid, scan = 0;
+
+	for (i = 0; i < HOT; i++) cdf[i] = sum += 1 / pow(i + 1, 0.9);
+	for (i = 0; i < ACCESSES; i++) {
+		x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+		// half of the traffic is the scan, in bursts of 1000
+		if ((i / 1000) & 1) {
+			snprintf(name, sizeof(name), "page%d.crawl.example.net", scan++);
+		}
+		else {
+			u = (double) x / 4294967296.0 * sum;
+			for (lo = 0, hi = HOT - 1; lo < hi; ) {
+				mid = (lo + hi) / 2;
+				if (cdf[mid] < u) lo = mid + 1;
+				else hi = mid;
+			}
+			snprintf(name, sizeof(name), "svc%d.example.com", lo);
+		}
+		trace[i] = strdup(name);
+	}
+	free(cdf);
+	*count = ACCESSES;
+	return trace;
+}
+
+static char ** file_trace(const char *path, int *count) {
+	FILE *f = fopen(path, "r");
+	char **trace = NULL, line[1024];
+	int n = 0, size = 0;
+	size_t len;
+
+	if (!f) return NULL;
+	while (fgets(line, sizeof(line), f)) {
+		len = strcspn(line, " \t\r\n");
+		if (!len) continue;
+		line[len] = 0;
+		if (n == size) trace = realloc(trace, (size = size ? size * 2 : 65536) * sizeof(char *));
+		trace[n++] = strdup(line);
+	}
+	fclose(f);
+	*count = n;
+	return trace;
+}
+
+int main(int argc, char **argv) {
+	int size = argc > 1 ? atoi(argv[1]) : 10000;
+	unsigned char data[64] = { 0 };
+	struct ev_ares_cache *cache;
+	ev_ares_stats stats;
+	char **trace;
+	long hits;
+	int count, i, policy;
+
+	trace = argc > 2 ? file_trace(argv[2], &count) : synthetic_trace(&count);
+	if (!trace || !count) {
+		fprintf(stderr, "no trace in %s\n", argv[2]);
+		return 1;
+	}
+
+	printf("%d accesses, cache of %d\n", count, size);
+	printf("%-8s %8s %10s %10s %10s %10s %10s\n", "policy", "hit%", "window", "probation", "protected", "admitted", "rejected");
+	for (policy = EV_ARES_CACHE_LRU; policy <= EV_ARES_CACHE_TINYLFU; policy++) {
+		memset(&stats, 0, sizeof(stats));
+		if (!(cache = ev_ares_cache_new(size, policy, &stats))) return 1;
+		for (i = 0, hits = 0; i < count; i++) {
+			if (ev_ares_cache_get(cache, trace[i], T_A, 0)) hits++;
+			else ev_ares_cache_put(cache, trace[i], T_A, data, sizeof(data), 3600, 0);
+		}
+		printf("%-8s %8.2f %10lu %10lu %10lu %10lu %10lu\n", policies[policy], 100.0 * hits / count,
+			stats.cache_window_hits, stats.cache_probation_hits, stats.cache_protected_hits,
+			stats.cache_admitted, stats.cache_rejected);
+		ev_ares_cache_free(cache);
+	}
+
+	for (i = 0; i < count; i++) free(trace[i]);
+	free(trace);
+	return 0;
+}
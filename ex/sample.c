@@ -3,6 +3,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+static void print_addrs(struct ev_ares_addr *addr) {
+	char ips[INET6_ADDRSTRLEN];
+	for (; addr != NULL; addr = addr->next) {
+		inet_ntop(addr->family, &addr->addr, ips, sizeof(ips));
+		printf(":   glue %s; ttl=%d\n", ips, addr->ttl);
+	}
+}
+
 static void callback_soa(ev_ares_result_soa * res) {
 	printf("Result for SOA '%s': %s\n",res->query, res->error);
 	if (res->status != ARES_SUCCESS) return;
@@ -18,6 +26,7 @@ static void callback_ns(ev_ares_result_ns * res) {
 	struct ev_ares_ns_reply* r = res->ns;
 	for (; r != NULL; r = r->next) {
 		printf(": %s; ttl=%d\n",r->host,r->ttl);
+		print_addrs(r->addrs);
 	}
 }
 
@@ -52,6 +61,7 @@ static void callback_mx(ev_ares_result_mx * res) {
 	int i;
 	for (; r != NULL; r = r->next) {
 		printf(": host = %s; prio = %d; ttl = %d\n", r->host, r->priority, r->ttl);
+		print_addrs(r->addrs);
 	}
 	return;
 }
@@ -63,6 +73,7 @@ static void callback_srv(ev_ares_result_srv * res) {
 	int i;
 	for (; srv != NULL; srv = srv->next) {
 		printf(": %s:%d (prio=%d; weight=%d; ttl=%d)\n", srv->host, srv->port, srv->priority, srv->weight, srv->ttl);
+		print_addrs(srv->addrs);
 	}
 	return;
 }
@@ -96,6 +107,43 @@ static void callback_naptr(ev_ares_result_naptr * res) {
 	}
 }
 
+static void callback_naptr_chain(ev_ares_result_naptr_chain * res) {
+	printf("Result for NAPTR chain '%s': %s\n",res->query, res->error);
+	if (res->status != ARES_SUCCESS) return;
+	char ips[INET6_ADDRSTRLEN];
+	int i;
+	for (i = 0; i < res->count; i++) {
+		struct ev_ares_naptr_target *t = &res->targets[i];
+		if (t->addr.ss_family == AF_INET)
+			inet_ntop(AF_INET, &((struct sockaddr_in *) &t->addr)->sin_addr, ips, sizeof(ips));
+		else
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &t->addr)->sin6_addr, ips, sizeof(ips));
+		printf(": %s %s port=%d order=%d pref=%d ttl=%d\n", t->service, ips,
+			ntohs(((struct sockaddr_in *) &t->addr)->sin_port), t->order, t->preference, t->ttl);
+	}
+}
+
+static void callback_https(ev_ares_result_https * res) {
+	printf("Result for HTTPS '%s': %s\n",res->query, res->error);
+	if (res->status != ARES_SUCCESS) return;
+	struct ev_ares_svcb_reply* r = res->https;
+	char **alpn;
+	for (; r != NULL; r = r->next) {
+		printf(": %d %s port=%d alpn=", r->priority, r->host, r->port);
+		for (alpn = r->alpn; alpn && *alpn; alpn++) printf("%s%s", *alpn, alpn[1] ? "," : "");
+		printf("\n");
+		print_addrs(r->addrs);
+	}
+}
+
+static void callback_raw(ev_ares_result_raw * res) {
+	printf("Result for raw '%s': %s\n",res->query, res->error);
+	int i;
+	for (i = 0; i < res->count; i++) {
+		printf(": %s type=%d ttl=%d rdlen=%d\n", res->rrs[i].name, res->rrs[i].type, res->rrs[i].ttl, res->rrs[i].rdlen);
+	}
+}
+
 static void callback_hba(ev_ares_result_hba * res) {
 	printf("Result for hostbyaddr '%s': %s\n",res->query, res->error);
 	if (res->status != ARES_SUCCESS) return;
@@ -148,16 +196,25 @@ int main (int argc, char *argv[]) {
 	
 	ev_ares_srv(loop,&resolver,jabber,0,callback_srv);
 	ev_ares_txt(loop,&resolver,hostname,0,callback_txt);
+	ev_ares_https(loop,&resolver,hostname,0,callback_https);
+	// CAA (class IN, type 257), which has no typed call
+	ev_ares_query_raw(loop,&resolver,hostname,1,257,0,0,callback_raw);
 	
 	ev_ares_gethostbyaddr(loop,&resolver,"8.8.8.8", 0, callback_hba);
 	ev_ares_gethostbyaddr(loop,&resolver,"2a00:1450:4010:c04::66", 0,callback_hba);
 	
+	// Same, from a binary address, without the text round trip
+	struct in_addr google = { htonl(0x08080808) };
+	ev_ares_ptr_addr(loop,&resolver,AF_INET,&google,0,callback_ptr);
+	
 	// Raw PTR queries
 	ev_ares_ptr(loop,&resolver,"8.8.8.8.in-addr.arpa", 0,callback_ptr);
 	ev_ares_ptr(loop,&resolver,"a.8.0.0.0.0.0.0.0.0.0.0.0.0.0.0.4.0.c.0.0.1.0.4.0.5.4.1.0.0.a.2.ip6.arpa", 0,callback_ptr);
 	
 	//This is the only NAPTR example i found ;)
 	ev_ares_naptr(loop,&resolver,"0.2.0.1.1.6.5.1.0.3.1.loligo.com.",0,callback_naptr);
+	// Same, followed through SRV and A/AAAA down to transport addresses
+	ev_ares_resolve_naptr(loop,&resolver,"0.2.0.1.1.6.5.1.0.3.1.loligo.com.",AF_UNSPEC,0,callback_naptr_chain);
 	
 	// Run loop
 	ev_run (loop, 0);
@@ -0,0 +1,197 @@
+/*
+ * Load test of the stub server, all on loopback.
+ *
+ * Runs on one loop: an upstream that answers every A query with one
+ * address, the stub server forwarding to it, and a client keeping a window
+ * of UDP queries outstanding for names drawn uniformly from a fixed set.
+ * With -t the client targets a server started elsewhere (stub_server)
+ * instead, and the two others are not run.
+ *
+ *   stub_bench [-n queries] [-k names] [-w window] [-t addr:port]
+ */
+
+#include "evares.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/nameser.h>
+
+#define UPSTREAM_PORT 15353
+#define STUB_PORT     15354
+#define MAX_WINDOW    4096
+
+static struct {
+	int       fd;
+	long      sent, received, lost, upstream;
+	long      total;
+	int       names, window;
+	ev_tstamp start;
+	ev_tstamp when[MAX_WINDOW];   // by query ID; 0 - free
+	double   *latency;
+	unsigned int x;
+} bench;
+
+static ev_io client_io, upstream_io;
+
+static int udp_socket(int port, int bound) {
+	struct sockaddr_in sin;
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port   = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || (bound ? bind(fd, (struct sockaddr *) &sin, sizeof(sin)) : connect(fd, (struct sockaddr *) &sin, sizeof(sin)))) {
+		perror("socket");
+		exit(1);
+	}
+	return fd;
+}
+
+// Echoes the question with one A record pointing back at it
+static void upstream_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	static const unsigned char rr[] = { 0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 10, 0, 0, 1 };
+	unsigned char buf[600];
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	ssize_t n;
+	while ((n = recvfrom(w->fd, buf, 512, 0, (struct sockaddr *) &peer, &peerlen)) >= 12) {
+		bench.upstream++;
+		buf[2] |= 0x80;            // QR
+		buf[3] = 0x80;             // RA, NOERROR
+		buf[7] = 1;                // ANCOUNT
+		buf[10] = buf[11] = 0;     // ARCOUNT
+		memcpy(buf + n, rr, sizeof(rr));
+		sendto(w->fd, buf, n + sizeof(rr), 0, (struct sockaddr *) &peer, peerlen);
+		peerlen = sizeof(peer);
+	}
+}
+
+static void send_query(struct ev_loop *loop, int id) {
+	unsigned char q[HFIXEDSZ + 64 + QFIXEDSZ], *p;
+	char label[16];
+	int len;
+
+	bench.x ^= bench.x << 13; bench.x ^= bench.x >> 17; bench.x ^= bench.x << 5;
+	memset(q, 0, HFIXEDSZ);
+	q[0] = id >> 8;
+	q[1] = id;
+	q[2] = 0x01;                   // RD
+	q[5] = 1;                      // QDCOUNT
+	p = q + HFIXEDSZ;
+	len = snprintf(label, sizeof(label), "h%u", bench.x % bench.names);
+	*p++ = len;
+	memcpy(p, label, len);
+	p += len;
+	memcpy(p, "\5bench\4test\0\0\1\0\1", 16);
+	p += 16;
+	if (send(bench.fd, q, p - q, 0) < 0) return;
+	bench.when[id] = ev_time();
+	bench.sent++;
+}
+
+static void client_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	unsigned char buf[4096];
+	ssize_t n;
+	int id;
+	while ((n = recv(w->fd, buf, sizeof(buf), 0)) >= 12) {
+		id = buf[0] << 8 | buf[1];
+		if (id >= bench.window || !bench.when[id]) continue;
+		bench.latency[ bench.received++ ] = ev_time() - bench.when[id];
+		bench.when[id] = 0;
+		if (bench.sent < bench.total) send_query(loop, id);
+		else
+		if (bench.received + bench.lost >= bench.total) ev_break(loop, EVBREAK_ALL);
+	}
+}
+
+// Queries a second old are given up and replaced
+static void sweep_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	ev_tstamp now = ev_time();
+	int id;
+	for (id = 0; id < bench.window; id++) {
+		if (!bench.when[id] || now - bench.when[id] < 1.0) continue;
+		bench.when[id] = 0;
+		bench.lost++;
+		if (bench.sent < bench.total) send_query(loop, id);
+	}
+	if (bench.received + bench.lost >= bench.total) ev_break(loop, EVBREAK_ALL);
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+	struct ev_loop *loop = EV_DEFAULT;
+	ev_ares resolver;
+	ev_ares_options opts = { 0 };
+	ev_ares_server *server = NULL;
+	ev_timer sweep;
+	char target[64] = "";
+	char *colon;
+	double elapsed;
+	int opt, id, port = STUB_PORT;
+
+	bench.total  = 200000;
+	bench.names  = 1000;
+	bench.window = 64;
+	bench.x      = 2463534242u;
+	while ((opt = getopt(argc, argv, "n:k:w:t:")) != -1) {
+		switch (opt) {
+		case 'n': bench.total  = atol(optarg); break;
+		case 'k': bench.names  = atoi(optarg); break;
+		case 'w': bench.window = atoi(optarg); break;
+		case 't': snprintf(target, sizeof(target), "%s", optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n queries] [-k names] [-w window] [-t addr:port]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (bench.window < 1 || bench.window > MAX_WINDOW || bench.names < 1 || bench.total < 1) return 2;
+	bench.latency = malloc(bench.total * sizeof(double));
+
+	if (!*target) {
+		ev_io_init(&upstream_io, upstream_cb, udp_socket(UPSTREAM_PORT, 1), EV_READ);
+		ev_io_start(loop, &upstream_io);
+		opts.cache_size = bench.names * 2;
+		ares_library_init(ARES_LIB_INIT_ALL);
+		ev_ares_init_options(&resolver, 1.0, &opts);
+		ares_set_servers_ports_csv(resolver.ares.channel, "127.0.0.1:15353");
+		if (!(server = ev_ares_server_start(loop, &resolver, "127.0.0.1", STUB_PORT))) {
+			perror("stub server");
+			return 1;
+		}
+	}
+	else
+	if ((colon = strrchr(target, ':'))) {
+		port = atoi(colon + 1);
+	}
+	bench.fd = udp_socket(port, 0);
+	ev_io_init(&client_io, client_cb, bench.fd, EV_READ);
+	ev_io_start(loop, &client_io);
+	ev_timer_init(&sweep, sweep_cb, 0.25, 0.25);
+	ev_timer_start(loop, &sweep);
+
+	bench.start = ev_time();
+	for (id = 0; id < bench.window && bench.sent < bench.total; id++) send_query(loop, id);
+	ev_run(loop, 0);
+	elapsed = ev_time() - bench.start;
+
+	qsort(bench.latency, bench.received, sizeof(double), cmp_double);
+	printf("%ld queries, %d names, window %d: %.0f q/s, lost %ld\n", bench.total, bench.names, bench.window, bench.received / elapsed, bench.lost);
+	if (bench.received) {
+		printf("latency us: p50 %.1f, p99 %.1f, max %.1f\n", 1e6 * bench.latency[ bench.received / 2 ],
+			1e6 * bench.latency[ bench.received * 99 / 100 ], 1e6 * bench.latency[ bench.received - 1 ]);
+	}
+	if (server) {
+		printf("upstream queries %ld; cache hits %lu, misses %lu, coalesced %lu\n", bench.upstream,
+			resolver.stats.cache_hits, resolver.stats.cache_misses, resolver.stats.coalesced);
+		ev_ares_server_stop(server);
+		ev_ares_clean(&resolver);
+	}
+	free(bench.latency);
+	return 0;
+}
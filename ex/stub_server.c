@@ -0,0 +1,83 @@
+/*
+ * Node-local caching DNS forwarder.
+ *
+ *   stub_server [-a addr] [-p port] [-u servers] [-c cache entries] [-m shm name]
+ *
+ * Listens on addr:port (127.0.0.1:53) over UDP and TCP. Upstream servers
+ * are the system's unless -u gives a c-ares list ("10.0.0.1,[::1]:5353").
+ * SIGUSR1 prints the counters, SIGINT and SIGTERM stop.
+ */
+
+#include "evares.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static ev_ares resolver;
+static ev_ares_server *server;
+
+static void print_stats(void) {
+	ev_ares_stats *s = &resolver.stats;
+	fprintf(stderr, "queries %lu (tcp %lu), truncated %lu, failed %lu; cache hits %lu, misses %lu, coalesced %lu; memory %zu\n",
+		s->serve_queries, s->serve_tcp, s->serve_truncated, s->serve_failed,
+		s->cache_hits, s->cache_misses, s->coalesced, ev_ares_mem_used(&resolver));
+}
+
+static void usr1_cb(struct ev_loop *loop, ev_signal *w, int revents) {
+	print_stats();
+}
+
+static void stop_cb(struct ev_loop *loop, ev_signal *w, int revents) {
+	ev_break(loop, EVBREAK_ALL);
+}
+
+int main(int argc, char **argv) {
+	struct ev_loop *loop = EV_DEFAULT;
+	ev_ares_options opts = { 0 };
+	ev_signal usr1, sigint, sigterm;
+	const char *addr = "127.0.0.1", *servers = NULL;
+	int port = 53, opt, status;
+
+	opts.cache_size   = 100000;
+	opts.cache_policy = EV_ARES_CACHE_TINYLFU;
+	while ((opt = getopt(argc, argv, "a:p:u:c:m:")) != -1) {
+		switch (opt) {
+		case 'a': addr = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'u': servers = optarg; break;
+		case 'c': opts.cache_size = atoi(optarg); break;
+		case 'm': opts.shm_cache = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-a addr] [-p port] [-u servers] [-c cache entries] [-m shm name]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	ares_library_init(ARES_LIB_INIT_ALL);
+	if ((status = ev_ares_init_options(&resolver, 2.0, &opts)) != ARES_SUCCESS) {
+		fprintf(stderr, "resolver: %s\n", ares_strerror(status));
+		return 1;
+	}
+	if (servers && (status = ares_set_servers_ports_csv(resolver.ares.channel, servers)) != ARES_SUCCESS) {
+		fprintf(stderr, "-u %s: %s\n", servers, ares_strerror(status));
+		return 1;
+	}
+	if (!(server = ev_ares_server_start(loop, &resolver, addr, port))) {
+		perror("listen");
+		return 1;
+	}
+
+	ev_signal_init(&usr1, usr1_cb, SIGUSR1);
+	ev_signal_init(&sigint, stop_cb, SIGINT);
+	ev_signal_init(&sigterm, stop_cb, SIGTERM);
+	ev_signal_start(loop, &usr1);
+	ev_signal_start(loop, &sigint);
+	ev_signal_start(loop, &sigterm);
+	ev_run(loop, 0);
+
+	print_stats();
+	ev_ares_server_stop(server);
+	ev_ares_clean(&resolver);
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * A/AAAA answers as connect-ready sockaddrs.
+ *
+ * The reply is decoded straight into one block holding the sockaddr_storage
+ * array and the TTL array behind it, with no reply list in between.
+ * Records are taken along the CNAME chain from the question name, as
+ * ev_ares_parse_a_reply() does. For AF_UNSPEC the IPv6 addresses go first,
+ * unless sort policies say otherwise.
+ */
+
+typedef struct {
+	ev_ares_result_addrs res;
+	int             family;
+	unsigned short  port;
+	int             pending;
+	int             status;     // last failed lookup
+	struct sockaddr_storage *part[2];  // AAAA, A
+	int             count[2];
+} ev_ares_addrs_ctx;
+
+static int ev_ares_addrs_parse(const unsigned char *abuf, int alen, int type, unsigned short port, struct sockaddr_storage **out, int *count) {
+	const unsigned char *aptr, *end = abuf + alen;
+	unsigned int ancount, i;
+	int status = ARES_SUCCESS, n = 0, rr_type, rr_len, want, nlen, same;
+	// the chain is followed in folded wire form, no name is ever spelled out
+	unsigned char name[EV_ARES_WIRE_BUF];
+	struct sockaddr_storage *addrs = NULL;
+	int *ttls;
+	long len;
+
+	*out = NULL;
+	*count = 0;
+	if (alen < HFIXEDSZ || DNS_HEADER_QDCOUNT(abuf) != 1) return ARES_EBADRESP;
+	if (!(ancount = DNS_HEADER_ANCOUNT(abuf))) return ARES_ENODATA;
+	want = type == T_A ? sizeof(struct in_addr) : sizeof(struct ares_in6_addr);
+
+	aptr = abuf + HFIXEDSZ;
+	if ((len = ev_ares_wire_canon(aptr, abuf, alen, name, &nlen)) < 0) return ARES_EBADNAME;
+	aptr += len + QFIXEDSZ;
+	if (aptr > end) return ARES_EBADRESP;
+	// sized for every record; the tail stays unused when some are CNAMEs
+	if (!(addrs = malloc(ancount * (sizeof(struct sockaddr_storage) + sizeof(int))))) return ARES_ENOMEM;
+	ttls = (int *) (addrs + ancount);
+
+	for (i = 0; i < ancount; i++) {
+		if ((len = ev_ares_wire_match(aptr, abuf, alen, name, nlen, &same)) < 0) {
+			status = ARES_EBADNAME;
+			break;
+		}
+		aptr += len;
+		if (aptr + RRFIXEDSZ > end || aptr + RRFIXEDSZ + DNS_RR_LEN(aptr) > end) {
+			status = ARES_EBADRESP;
+			break;
+		}
+		rr_type = DNS_RR_TYPE(aptr);
+		rr_len  = DNS_RR_LEN(aptr);
+		if (DNS_RR_CLASS(aptr) == C_IN && same) {
+			if (rr_type == type && rr_len == want) {
+				ev_ares_sockaddr(&addrs[n], type == T_A ? AF_INET : AF_INET6, aptr + RRFIXEDSZ, port);
+				ttls[n++] = DNS_RR_TTL(aptr);
+			}
+			else
+			if (rr_type == T_CNAME) {
+				if (ev_ares_wire_canon(aptr + RRFIXEDSZ, abuf, alen, name, &nlen) < 0) {
+					status = ARES_EBADNAME;
+					break;
+				}
+			}
+		}
+		aptr += RRFIXEDSZ + rr_len;
+	}
+
+	if (status == ARES_SUCCESS && !n) status = ARES_ENODATA;
+	if (status != ARES_SUCCESS) {
+		free(addrs);
+		return status;
+	}
+	// keep the TTLs right behind the used part of the array
+	if (n < (int) ancount) memmove(addrs + n, ttls, n * sizeof(int));
+	*out = addrs;
+	*count = n;
+	return ARES_SUCCESS;
+}
+
+static void ev_ares_addrs_finish(ev_ares_addrs_ctx *ctx) {
+	ev_ares_result_addrs *res = &ctx->res;
+	int n = ctx->count[0] + ctx->count[1], i;
+
+	if (n && ctx->count[0] && ctx->count[1]) {
+		if ((res->addrs = malloc(n * (sizeof(struct sockaddr_storage) + sizeof(int))))) {
+			res->ttls = (int *) (res->addrs + n);
+			for (i = 0; i < 2; i++) {
+				memcpy(res->addrs + res->count, ctx->part[i], ctx->count[i] * sizeof(struct sockaddr_storage));
+				memcpy(res->ttls + res->count, ctx->part[i] + ctx->count[i], ctx->count[i] * sizeof(int));
+				res->count += ctx->count[i];
+			}
+		}
+		else {
+			ctx->status = ARES_ENOMEM;
+		}
+		free(ctx->part[0]);
+		free(ctx->part[1]);
+	}
+	else
+	if (n) {
+		i = ctx->count[0] ? 0 : 1;
+		res->addrs = ctx->part[i];
+		res->ttls  = (int *) (res->addrs + n);
+		res->count = n;
+	}
+	res->status = res->count ? ARES_SUCCESS : ctx->status;
+	res->error  = ares_strerror(res->status);
+	ev_ares_sort_addrs(res->resolver, res->addrs, res->ttls, res->count);
+
+	res->callback(res);
+
+	free(res->addrs);
+	free(ctx);
+}
+
+static void ev_ares_addrs_cb(ev_ares_addrs_ctx *ctx, int i, int status, int timeouts, unsigned char *abuf, int alen) {
+	if (timeouts > ctx->res.timeouts) ctx->res.timeouts = timeouts;
+	if (status == ARES_SUCCESS) {
+		status = ev_ares_addrs_parse(abuf, alen, i ? T_A : T_AAAA, ctx->port, &ctx->part[i], &ctx->count[i]);
+	}
+	if (status != ARES_SUCCESS) ctx->status = status;
+	if (--ctx->pending == 0) ev_ares_addrs_finish(ctx);
+}
+
+static void ev_ares_addrs_aaaa_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
+	ev_ares_addrs_cb((ev_ares_addrs_ctx *) arg, 0, status, timeouts, abuf, alen);
+}
+
+static void ev_ares_addrs_a_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
+	ev_ares_addrs_cb((ev_ares_addrs_ctx *) arg, 1, status, timeouts, abuf, alen);
+}
+
+void ev_ares_resolve_addrs (struct ev_loop * loop, ev_ares * resolver, char * name, int family, unsigned short port, void * any, ev_ares_callback_addrs callback) {
+	resolver->loop = loop;
+	ev_ares_addrs_ctx *ctx = calloc(1, sizeof(ev_ares_addrs_ctx));
+	ev_ares_result_addrs *res;
+
+	if (!ctx) {
+		ev_ares_result_addrs nomem = { resolver, name, ARES_ENOMEM, ares_strerror(ARES_ENOMEM), 0, any, (ev_ares_callback_v) callback };
+		callback(&nomem);
+		return;
+	}
+	res = &ctx->res;
+	res->any      = any;
+	res->resolver = resolver;
+	res->query    = name;
+	res->callback = (ev_ares_callback_v) callback;
+	ctx->family   = family;
+	ctx->port     = port;
+	ctx->status   = ARES_ENODATA;
+
+	// either lookup may fail before it returns
+	ctx->pending = 1;
+	if (family != AF_INET) {
+		ctx->pending++;
+		ev_ares_lookup(resolver, name, C_IN, T_AAAA, 0, ev_ares_addrs_aaaa_cb, ctx);
+	}
+	if (family != AF_INET6) {
+		ctx->pending++;
+		ev_ares_lookup(resolver, name, C_IN, T_A, 0, ev_ares_addrs_a_cb, ctx);
+	}
+	if (--ctx->pending == 0) ev_ares_addrs_finish(ctx);
+}
@@ -0,0 +1,191 @@
+/*
+ * Queries submitted from threads that do not run the resolver's loop.
+ *
+ * ev_ares_submit() pushes a caller-owned job onto a lock-free stack and
+ * wakes the loop through an ev_async watcher, only when the stack was empty
+ * before, so a burst of submissions costs one wakeup. The loop takes the
+ * whole stack with one exchange, puts it back in submission order and runs
+ * every job as a lookup of its own: cache first, then the channel, with
+ * identical jobs in flight coalesced under a private flag. Taking all at
+ * once means the stack is never popped one by one, and so has no ABA.
+ *
+ * A finished job gets a private copy of the reply and goes either to its
+ * callback, on the loop's thread, or onto its completion queue: the same
+ * kind of stack, emptied by the thread owning it and signalled through an
+ * eventfd when it turns non-empty.
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define EV_ARES_Q_ASYNC 0x20000  // flight key only: the waiters are ev_ares_submit() jobs
+
+struct ev_ares_async {
+	ev_async       wake;
+	struct ev_loop *loop;        // resolver->loop is rewritten by every call on the loop's thread
+	ev_ares       *resolver;
+	ev_ares_job   *head;         // pushed by any thread, taken by the loop
+};
+
+struct ev_ares_cq {
+	ev_ares_job   *head;         // pushed by loops, taken by the owner
+	ev_ares_job   *ready;        // taken, in completion order; the owner's alone
+	int            fd;           // eventfd, readable once head turned non-empty
+};
+
+// Returns 1 when the stack was empty
+static inline int ev_ares_job_push(ev_ares_job **head, ev_ares_job *job) {
+	ev_ares_job *top = __atomic_load_n(head, __ATOMIC_RELAXED);
+	do {
+		job->next = top;
+	} while (!__atomic_compare_exchange_n(head, &top, job, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return top == NULL;
+}
+
+// The whole stack, oldest first
+static inline ev_ares_job * ev_ares_job_take(ev_ares_job **head) {
+	ev_ares_job *job = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE), *list = NULL, *next;
+	for (; job; job = next) {
+		next = job->next;
+		job->next = list;
+		list = job;
+	}
+	return list;
+}
+
+static void ev_ares_job_done(ev_ares_job *job, int status, int timeouts, const unsigned char *abuf, int alen) {
+	uint64_t one = 1;
+	job->next     = NULL;
+	job->abuf     = NULL;
+	job->alen     = 0;
+	job->timeouts = timeouts;
+	if (abuf && alen > 0) {
+		if ((job->abuf = malloc(alen))) {
+			memcpy(job->abuf, abuf, alen);
+			job->alen = alen;
+		}
+		else {
+			status = ARES_ENOMEM;
+		}
+	}
+	job->status = status;
+	job->error  = ares_strerror(status);
+	if (!job->cq) {
+		job->callback(job);
+	}
+	else
+	if (ev_ares_job_push(&job->cq->head, job)) {
+		// a full counter (2^64 - 2 wakeups unread) is readable all the same
+		if (write(job->cq->fd, &one, sizeof(one)) < 0) {}
+	}
+}
+
+static void ev_ares_async_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
+	struct ev_ares_flight *f = (struct ev_ares_flight *) arg;
+	int i;
+	ev_ares_flight_land(f);
+	for (i = 0; i < f->count; i++) {
+		ev_ares_job_done(f->waiters[i], status, timeouts, abuf, alen);
+	}
+	ev_ares_flight_free(f);
+}
+
+static void ev_ares_async_drain(struct ev_loop *loop, ev_async *w, int revents) {
+	struct ev_ares_async *async = (struct ev_ares_async *) w;
+	ev_ares *resolver = async->resolver;
+	ev_ares_job *job, *next;
+	struct ev_ares_flight *f;
+
+	resolver->stats.async_wakeups++;
+	for (job = ev_ares_job_take(&async->head); job; job = next) {
+		next = job->next;
+		resolver->stats.async_jobs++;
+		switch (ev_ares_flight_join(resolver, job->name, job->type, job->flags | EV_ARES_Q_ASYNC, job, &f)) {
+		case 0:
+			ev_ares_lookup(resolver, job->name, C_IN, job->type, job->flags, ev_ares_async_cb, f);
+			break;
+		case -1:
+			ev_ares_job_done(job, ARES_ENOMEM, 0, NULL, 0);
+			break;
+		}
+	}
+}
+
+int ev_ares_async_start(struct ev_loop * loop, ev_ares * resolver) {
+	struct ev_ares_async *async;
+	if (resolver->async) return ARES_SUCCESS;
+	if (!(async = calloc(1, sizeof(struct ev_ares_async)))) return ARES_ENOMEM;
+	resolver->loop  = loop;
+	async->loop     = loop;
+	async->resolver = resolver;
+	ev_async_init(&async->wake, ev_ares_async_drain);
+	ev_async_start(loop, &async->wake);
+	resolver->async = async;
+	return ARES_SUCCESS;
+}
+
+void ev_ares_submit(ev_ares * resolver, ev_ares_job *job) {
+	struct ev_ares_async *async = resolver->async;
+	if (ev_ares_job_push(&async->head, job)) ev_async_send(async->loop, &async->wake);
+}
+
+// Jobs never run fail with ARES_EDESTRUCTION; the others are failed by their channel
+static void ev_ares_async_cleanup(ev_ares *resolver) {
+	struct ev_ares_async *async = resolver->async;
+	ev_ares_job *job, *next;
+	if (!async) return;
+	ev_async_stop(async->loop, &async->wake);
+	for (job = ev_ares_job_take(&async->head); job; job = next) {
+		next = job->next;
+		ev_ares_job_done(job, ARES_EDESTRUCTION, 0, NULL, 0);
+	}
+	free(async);
+	resolver->async = NULL;
+}
+
+ev_ares_cq * ev_ares_cq_new(void) {
+	ev_ares_cq *cq;
+	int fd;
+	if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) return NULL;
+	if (!(cq = calloc(1, sizeof(ev_ares_cq)))) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+	cq->fd = fd;
+	return cq;
+}
+
+int ev_ares_cq_fd(ev_ares_cq *cq) {
+	return cq->fd;
+}
+
+ev_ares_job * ev_ares_cq_pop(ev_ares_cq *cq, double timeout) {
+	ev_tstamp deadline = timeout > 0 ? ev_time() + timeout : 0;
+	struct pollfd pfd = { .fd = cq->fd, .events = POLLIN };
+	ev_ares_job *job;
+	uint64_t count;
+	int ms;
+
+	for (;;) {
+		if ((job = cq->ready)) {
+			cq->ready = job->next;
+			job->next = NULL;
+			return job;
+		}
+		if ((cq->ready = ev_ares_job_take(&cq->head))) continue;
+		if (timeout == 0) return NULL;
+		// the counter may be left over from jobs already taken: wait, clear, look again
+		ms = timeout < 0 ? -1 : (int) ((deadline - ev_time()) * 1000 + 0.999);
+		if (timeout > 0 && ms <= 0) return NULL;
+		if (poll(&pfd, 1, ms) < 0 && errno != EINTR) return NULL;
+		if (read(cq->fd, &count, sizeof(count)) < 0) {}
+		if (timeout > 0 && ev_time() >= deadline && !__atomic_load_n(&cq->head, __ATOMIC_ACQUIRE)) return NULL;
+	}
+}
+
+void ev_ares_cq_free(ev_ares_cq *cq) {
+	if (!cq) return;
+	close(cq->fd);
+	free(cq);
+}
@@ -0,0 +1,463 @@
+/*
+ * Answer cache.
+ *
+ * Entries hold DNS messages in wire format, keyed by (name, type), and are
+ * served through the same parsers as fresh answers, with TTLs aged by the
+ * time spent in the cache. Hits are delivered from the hits timer on the
+ * next loop iteration, so no lookup calls back before it returns. The
+ * table itself is in ev_ares_cache_table.c.
+ *
+ * A/AAAA answers that went through CNAMEs are split up: every CNAME is
+ * cached as its own link (owner -> target, with its own TTL) and the
+ * terminal records are cached under the terminal name. A lookup for any
+ * alias walks the links and rebuilds the full answer from them. If only
+ * the terminal records have expired, only the terminal name is queried.
+ *
+ * Names that went through the search list also leave the FQDN that
+ * answered (EV_ARES_T_SEARCH), so the next miss for them asks that FQDN
+ * directly instead of walking the search domains again.
+ */
+
+#define EV_ARES_CACHE_HOPS 8
+#define EV_ARES_T_SEARCH   0     // pseudo type: name -> FQDN the search list resolved it to
+#define EV_ARES_SEARCH_HOLD 300  // seconds a learned FQDN is used before searching again
+
+/* Wire helpers */
+
+typedef struct {
+	unsigned char *buf;
+	int            len;
+	int            size;
+} ev_ares_wbuf;
+
+static int ev_ares_wbuf_put(ev_ares_wbuf *wb, const void *data, int len) {
+	if (wb->len + len > wb->size) {
+		int size = wb->size ? wb->size : 512;
+		unsigned char *buf;
+		while (size < wb->len + len) size <<= 1;
+		if (!(buf = realloc(wb->buf, size))) return -1;
+		wb->buf  = buf;
+		wb->size = size;
+	}
+	memcpy(wb->buf + wb->len, data, len);
+	wb->len += len;
+	return 0;
+}
+
+static int ev_ares_wbuf_name(ev_ares_wbuf *wb, const char *name) {
+	unsigned char label;
+	const char *dot;
+	while (*name) {
+		if (!(dot = strchr(name, '.'))) dot = name + strlen(name);
+		if (dot - name > 63) return -1;
+		label = dot - name;
+		if (label && (ev_ares_wbuf_put(wb, &label, 1) || ev_ares_wbuf_put(wb, name, label))) return -1;
+		name = *dot ? dot + 1 : dot;
+	}
+	label = 0;
+	return ev_ares_wbuf_put(wb, &label, 1);
+}
+
+static int ev_ares_wbuf_rr(ev_ares_wbuf *wb, const char *name, int type, int ttl, const void *rdata, int rdlen) {
+	unsigned char f[RRFIXEDSZ];
+	DNS_RR_SET_TYPE(f, type);
+	DNS_RR_SET_CLASS(f, C_IN);
+	DNS_RR_SET_TTL(f, ttl < 0 ? 0 : ttl);
+	DNS_RR_SET_LEN(f, rdlen);
+	return ev_ares_wbuf_name(wb, name) || ev_ares_wbuf_put(wb, f, RRFIXEDSZ) || ev_ares_wbuf_put(wb, rdata, rdlen);
+}
+
+static int ev_ares_wbuf_header(ev_ares_wbuf *wb, const char *qname, int type, int ancount) {
+	unsigned char h[HFIXEDSZ], q[QFIXEDSZ];
+	memset(h, 0, sizeof(h));
+	DNS_HEADER_SET_QR(h, 1);
+	DNS_HEADER_SET_RD(h, 1);
+	DNS_HEADER_SET_RA(h, 1);
+	DNS_HEADER_SET_QDCOUNT(h, 1);
+	DNS_HEADER_SET_ANCOUNT(h, ancount);
+	DNS_QUESTION_SET_TYPE(q, type);
+	DNS_QUESTION_SET_CLASS(q, C_IN);
+	return ev_ares_wbuf_put(wb, h, HFIXEDSZ) || ev_ares_wbuf_name(wb, qname) || ev_ares_wbuf_put(wb, q, QFIXEDSZ);
+}
+
+// Skips a possibly compressed name; NULL if it runs past the end
+static const unsigned char * ev_ares_wire_skip(const unsigned char *p, const unsigned char *end) {
+	while (p < end) {
+		if (!*p) return p + 1;
+		if ((*p & INDIR_MASK) == INDIR_MASK) return p + 2 <= end ? p + 2 : NULL;
+		p += *p + 1;
+	}
+	return NULL;
+}
+
+// Lowers every TTL in the message by elapsed seconds
+static void ev_ares_wire_age(unsigned char *abuf, int alen, int elapsed) {
+	unsigned char *end = abuf + alen, *p;
+	unsigned int i, n;
+	int ttl;
+	if (alen < HFIXEDSZ || elapsed <= 0) return;
+	n = DNS_HEADER_ANCOUNT(abuf) + DNS_HEADER_NSCOUNT(abuf) + DNS_HEADER_ARCOUNT(abuf);
+	p = abuf + HFIXEDSZ;
+	for (i = 0; i < DNS_HEADER_QDCOUNT(abuf); i++) {
+		if (!(p = (unsigned char *) ev_ares_wire_skip(p, end)) || (p += QFIXEDSZ) > end) return;
+	}
+	for (i = 0; i < n; i++) {
+		if (!(p = (unsigned char *) ev_ares_wire_skip(p, end)) || p + RRFIXEDSZ > end) return;
+		if (DNS_RR_TYPE(p) != T_OPT) {
+			ttl = DNS_RR_TTL(p) - elapsed;
+			DNS_RR_SET_TTL(p, ttl < 0 ? 0 : ttl);
+		}
+		p += RRFIXEDSZ + DNS_RR_LEN(p);
+	}
+}
+
+// "name" -> "name."; the result is owned by the caller
+static char * ev_ares_cache_fqdn(const char *name) {
+	size_t len = strlen(name);
+	char *fqdn = malloc(len + 2);
+	if (!fqdn) return NULL;
+	memcpy(fqdn, name, len);
+	if (!len || name[len - 1] != '.') fqdn[len++] = '.';
+	fqdn[len] = 0;
+	return fqdn;
+}
+
+/*
+ * Stores a successful answer for key (the name as the caller asked it).
+ */
+static void ev_ares_cache_store(ev_ares *resolver, const char *key, int type, const unsigned char *abuf, int alen) {
+	struct ev_ares_cache *cache = resolver->cache;
+	ev_tstamp now = ev_now(resolver->loop);
+	const unsigned char *aptr, *end = abuf + alen;
+	char *qname = NULL, *rr_name = NULL, *rr_data = NULL, *fqdn = NULL, *terminal = NULL;
+	unsigned int ancount, i;
+	int rr_type, rr_class, rr_ttl, rr_len, min_ttl = INT_MAX, link_ttl = INT_MAX, found = 0, cnames = 0;
+	long len;
+	ev_ares_wbuf wb = { NULL, 0, 0 };
+
+	if (alen < HFIXEDSZ || DNS_HEADER_QDCOUNT(abuf) != 1 || !(ancount = DNS_HEADER_ANCOUNT(abuf))) return;
+	aptr = abuf + HFIXEDSZ;
+	if (ares_expand_name(aptr, abuf, alen, &qname, &len) != ARES_SUCCESS) return;
+	aptr += len + QFIXEDSZ;
+
+	// pass 1: CNAME links and the TTL of the records asked for
+	for (i = 0; i < ancount && aptr < end; i++) {
+		if (ares_expand_name(aptr, abuf, alen, &rr_name, &len) != ARES_SUCCESS) goto out;
+		aptr += len;
+		if (aptr + RRFIXEDSZ > end) goto out;
+		rr_type  = DNS_RR_TYPE(aptr);
+		rr_class = DNS_RR_CLASS(aptr);
+		rr_ttl   = DNS_RR_TTL(aptr);
+		rr_len   = DNS_RR_LEN(aptr);
+		aptr += RRFIXEDSZ;
+		if (aptr + rr_len > end) goto out;
+		if (rr_class == C_IN && rr_type == T_CNAME && (type == T_A || type == T_AAAA)) {
+			if (ares_expand_name(aptr, abuf, alen, &rr_data, &len) != ARES_SUCCESS) goto out;
+			free(fqdn);
+			fqdn = ev_ares_cache_fqdn(rr_name);
+			free(terminal);
+			terminal = ev_ares_cache_fqdn(rr_data);
+			if (fqdn && terminal) ev_ares_cache_put(cache, fqdn, T_CNAME, terminal, strlen(terminal) + 1, rr_ttl, now);
+			if (rr_ttl < link_ttl) link_ttl = rr_ttl;
+			free(rr_data);
+			rr_data = NULL;
+			cnames++;
+		}
+		else
+		if (rr_class == C_IN && rr_type == type) {
+			if (rr_ttl < min_ttl) min_ttl = rr_ttl;
+			found++;
+		}
+		free(rr_name);
+		rr_name = NULL;
+		aptr += rr_len;
+	}
+
+	if (!cnames) {
+		if (found) ev_ares_cache_put(cache, key, type, abuf, alen, min_ttl, now);
+		goto out;
+	}
+
+	// the caller's name (maybe a relative one) leads to the first owner
+	free(fqdn);
+	if ((fqdn = ev_ares_cache_fqdn(qname)) && strcasecmp(fqdn, key) != 0) {
+		ev_ares_cache_put(cache, key, T_CNAME, fqdn, strlen(fqdn) + 1, link_ttl, now);
+	}
+	if (!found || !terminal) goto out;
+
+	// pass 2: the terminal records as an answer of their own
+	aptr = abuf + HFIXEDSZ;
+	aptr = ev_ares_wire_skip(aptr, end) + QFIXEDSZ;
+	if (ev_ares_wbuf_header(&wb, terminal, type, found)) goto out;
+	for (i = 0; i < ancount; i++) {
+		if (!(aptr = ev_ares_wire_skip(aptr, end)) || aptr + RRFIXEDSZ > end) goto out;
+		rr_type = DNS_RR_TYPE(aptr);
+		rr_len  = DNS_RR_LEN(aptr);
+		if (DNS_RR_CLASS(aptr) == C_IN && rr_type == type) {
+			if (ev_ares_wbuf_rr(&wb, terminal, type, DNS_RR_TTL(aptr), aptr + RRFIXEDSZ, rr_len)) goto out;
+		}
+		aptr += RRFIXEDSZ + rr_len;
+	}
+	ev_ares_cache_put(cache, terminal, type, wb.buf, wb.len, min_ttl, now);
+
+	out:
+	free(wb.buf);
+	free(qname);
+	free(rr_name);
+	free(rr_data);
+	free(fqdn);
+	free(terminal);
+}
+
+static int ev_ares_cache_walk(ev_ares *resolver, const char *key, int type, unsigned char **out, int *outlen, char **terminal) {
+	struct ev_ares_cache *cache = resolver->cache;
+	ev_tstamp now = ev_now(resolver->loop);
+	struct ev_ares_cache_entry *e = NULL, *link;
+	const char *cur = key, *owner[EV_ARES_CACHE_HOPS];
+	const char *target[EV_ARES_CACHE_HOPS];
+	int ttl[EV_ARES_CACHE_HOPS];
+	int hops, n = 0, i, count = 0;
+	const unsigned char *aptr, *end;
+	ev_ares_wbuf wb = { NULL, 0, 0 };
+
+	for (hops = 0; hops < EV_ARES_CACHE_HOPS; hops++) {
+		if ((e = ev_ares_cache_get(cache, cur, type, now))) break;
+		if ((type != T_A && type != T_AAAA) || !(link = ev_ares_cache_get(cache, cur, T_CNAME, now))) break;
+		// links from a relative name are only a shortcut to the name c-ares found
+		if (cur[ strlen(cur) - 1 ] == '.') {
+			owner[n]  = cur;
+			target[n] = (const char *) ev_ares_entry_data(link);
+			ttl[n]    = (int) (link->expires - now);
+			n++;
+		}
+		cur = (const char *) ev_ares_entry_data(link);
+	}
+	if (!e) {
+		if (!hops || hops == EV_ARES_CACHE_HOPS || !(*terminal = strdup(cur))) return -1;
+		return 0;
+	}
+
+	if (!n) {
+		if (!(*out = malloc(e->len))) return -1;
+		memcpy(*out, ev_ares_entry_data(e), e->len);
+		*outlen = e->len;
+		ev_ares_wire_age(*out, e->len, (int) (now - e->stored));
+		return 1;
+	}
+
+	// CNAME chain, then the terminal records with their remaining TTLs
+	end  = ev_ares_entry_data(e) + e->len;
+	aptr = ev_ares_wire_skip(ev_ares_entry_data(e) + HFIXEDSZ, end);
+	if (!aptr) return -1;
+	aptr += QFIXEDSZ;
+	for (i = 0; i < (int) DNS_HEADER_ANCOUNT(ev_ares_entry_data(e)); i++) {
+		if (!(aptr = ev_ares_wire_skip(aptr, end)) || aptr + RRFIXEDSZ > end) return -1;
+		if (DNS_RR_TYPE(aptr) == type) count++;
+		aptr += RRFIXEDSZ + DNS_RR_LEN(aptr);
+	}
+	if (ev_ares_wbuf_header(&wb, owner[0], type, n + count)) goto fail;
+	for (i = 0; i < n; i++) {
+		ev_ares_wbuf t = { NULL, 0, 0 };
+		int bad = ev_ares_wbuf_name(&t, target[i]) || ev_ares_wbuf_rr(&wb, owner[i], T_CNAME, ttl[i], t.buf, t.len);
+		free(t.buf);
+		if (bad) goto fail;
+	}
+	aptr = ev_ares_wire_skip(ev_ares_entry_data(e) + HFIXEDSZ, end) + QFIXEDSZ;
+	for (i = 0; i < (int) DNS_HEADER_ANCOUNT(ev_ares_entry_data(e)); i++) {
+		aptr = ev_ares_wire_skip(aptr, end);
+		if (DNS_RR_TYPE(aptr) == type) {
+			if (ev_ares_wbuf_rr(&wb, cur, type, DNS_RR_TTL(aptr) - (int) (now - e->stored), aptr + RRFIXEDSZ, DNS_RR_LEN(aptr))) goto fail;
+		}
+		aptr += RRFIXEDSZ + DNS_RR_LEN(aptr);
+	}
+	*out = wb.buf;
+	*outlen = wb.len;
+	return 1;
+
+	fail:
+	free(wb.buf);
+	return -1;
+}
+
+/*
+ * Builds the answer for key from the cache.
+ * 1 - hit, *out holds a message to free; 0 - the CNAME links are cached
+ * but the terminal records are not, *terminal names what to query;
+ * -1 - miss.
+ * Entries taken in from a snapshot during the walk are only trimmed once it
+ * is over, and those lent by another process only freed: the walk holds
+ * the links it went through.
+ */
+static int ev_ares_cache_lookup(ev_ares *resolver, const char *key, int type, unsigned char **out, int *outlen, char **terminal) {
+	int hit = ev_ares_cache_walk(resolver, key, type, out, outlen, terminal);
+	ev_ares_cache_trim(resolver->cache);
+	if (resolver->cache->shm) ev_ares_shm_return(resolver->cache);
+	return hit;
+}
+
+/* Lookup layer between the ev_ares_* calls and the scheduler */
+
+struct ev_ares_hit {
+	struct ev_ares_hit *next;
+	ares_callback  callback;
+	void          *arg;
+	unsigned char *buf;       // the hit's, charged to stats.mem_pending
+	int            len;
+};
+
+// Takes buf on success; -1 leaves it to the caller
+static int ev_ares_hit_defer(ev_ares *resolver, ares_callback callback, void *arg, unsigned char *buf, int len) {
+	struct ev_ares_hit *hit = malloc(sizeof(struct ev_ares_hit));
+	if (!hit) return -1;
+	hit->next     = NULL;
+	hit->callback = callback;
+	hit->arg      = arg;
+	hit->buf      = buf;
+	hit->len      = len;
+	resolver->stats.mem_pending += sizeof(struct ev_ares_hit) + len;
+	if (resolver->hits.tail) resolver->hits.tail->next = hit;
+	else resolver->hits.head = hit;
+	resolver->hits.tail = hit;
+	if (!ev_is_active(&resolver->hits.timer)) {
+		ev_timer_set(&resolver->hits.timer, 0., 0.);
+		ev_timer_start(resolver->loop, &resolver->hits.timer);
+	}
+	return 0;
+}
+
+// Hits deferred by these callbacks wait for the next run
+static void ev_ares_hits_run(ev_ares *resolver, int status) {
+	struct ev_ares_hit *hit, *next;
+	hit = resolver->hits.head;
+	resolver->hits.head = resolver->hits.tail = NULL;
+	for (; hit; hit = next) {
+		next = hit->next;
+		resolver->stats.mem_pending -= sizeof(struct ev_ares_hit) + hit->len;
+		if (status == ARES_SUCCESS) hit->callback(hit->arg, ARES_SUCCESS, 0, hit->buf, hit->len);
+		else hit->callback(hit->arg, status, 0, NULL, 0);
+		free(hit->buf);
+		free(hit);
+	}
+}
+
+static void hits_cb (EV_P_ ev_timer *w, int revents) {
+	ev_ares * resolver = (ev_ares *) ( (char *) w - (ptrdiff_t) &((ev_ares *) 0)->hits.timer );
+	ev_ares_hits_run(resolver, ARES_SUCCESS);
+}
+
+// Hits not delivered yet fail with ARES_EDESTRUCTION, as queued queries do
+static void ev_ares_hits_cleanup(ev_ares *resolver) {
+	while (resolver->hits.head) ev_ares_hits_run(resolver, ARES_EDESTRUCTION);
+	if (ev_is_active(&resolver->hits.timer)) {
+		ev_timer_stop(resolver->loop, &resolver->hits.timer);
+	}
+}
+
+typedef struct {
+	ev_ares       *resolver;
+	const char    *key;
+	char          *terminal;  // set when only the end of a CNAME chain is queried
+	char          *fqdn;      // set when the learned FQDN is queried
+	int            type;
+	int            flags;
+	ares_callback  callback;
+	void          *arg;
+} ev_ares_lookup_ctx;
+
+// Remembers the FQDN in the question of a reply found through the search list
+static void ev_ares_cache_learn(ev_ares *resolver, const char *key, const unsigned char *abuf, int alen) {
+	char *qname = NULL, *fqdn;
+	long len;
+	if (alen < HFIXEDSZ || ares_expand_name(abuf + HFIXEDSZ, abuf, alen, &qname, &len) != ARES_SUCCESS) return;
+	if ((fqdn = ev_ares_cache_fqdn(qname))) {
+		ev_ares_cache_put(resolver->cache, key, EV_ARES_T_SEARCH, fqdn, strlen(fqdn) + 1, EV_ARES_SEARCH_HOLD, ev_now(resolver->loop));
+	}
+	free(fqdn);
+	free(qname);
+}
+
+static inline int ev_ares_searched(ev_ares *resolver, const char *name, int flags) {
+	return *name && name[ strlen(name) - 1 ] != '.' && !ev_ares_absolute(resolver, name, flags);
+}
+
+static void ev_ares_lookup_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
+	ev_ares_lookup_ctx *ctx = (ev_ares_lookup_ctx *) arg;
+	ev_ares *resolver = ctx->resolver;
+	unsigned char *buf = NULL;
+	char *terminal = NULL;
+	int len;
+
+	if (ctx->fqdn && status == ARES_ENOTFOUND) {
+		// the learned FQDN is gone, walk the search list again
+		ev_ares_cache_drop(resolver->cache, ctx->key, EV_ARES_T_SEARCH);
+		free(ctx->fqdn);
+		ctx->fqdn = NULL;
+		ev_ares_search(resolver, ctx->key, C_IN, ctx->type, ctx->flags, ev_ares_lookup_cb, ctx);
+		return;
+	}
+	if (status == ARES_SUCCESS && resolver->cache) {
+		if (!ctx->terminal && !ctx->fqdn && ev_ares_searched(resolver, ctx->key, ctx->flags)) {
+			ev_ares_cache_learn(resolver, ctx->key, abuf, alen);
+		}
+		ev_ares_cache_store(resolver, ctx->terminal ? ctx->terminal : ctx->key, ctx->type, abuf, alen);
+		// rebuild the alias answer around the fresh terminal records
+		if (ctx->terminal && ev_ares_cache_lookup(resolver, ctx->key, ctx->type, &buf, &len, &terminal) == 1) {
+			abuf = buf;
+			alen = len;
+		}
+	}
+	ctx->callback(ctx->arg, status, timeouts, abuf, alen);
+	free(buf);
+	free(terminal);
+	free(ctx->terminal);
+	free(ctx->fqdn);
+	free(ctx);
+}
+
+static void ev_ares_lookup(ev_ares *resolver, const char *name, int dnsclass, int type, int flags, ares_callback callback, void *arg) {
+	ev_ares_lookup_ctx *ctx;
+	struct ev_ares_cache_entry *e;
+	unsigned char *buf = NULL;
+	char *terminal = NULL;
+	int len, hit;
+
+	if (!resolver->cache || dnsclass != C_IN || (flags & EV_ARES_Q_NOCACHE)) {
+		ev_ares_search(resolver, name, dnsclass, type, flags, callback, arg);
+		return;
+	}
+	hit = ev_ares_cache_lookup(resolver, name, type, &buf, &len, &terminal);
+	if (hit == 1) {
+		resolver->stats.cache_hits++;
+		if (ev_ares_hit_defer(resolver, callback, arg, buf, len) < 0) {
+			free(buf);
+			callback(arg, ARES_ENOMEM, 0, NULL, 0);
+		}
+		return;
+	}
+	if (!(ctx = calloc(1, sizeof(ev_ares_lookup_ctx)))) {
+		free(terminal);
+		callback(arg, ARES_ENOMEM, 0, NULL, 0);
+		return;
+	}
+	ctx->resolver = resolver;
+	ctx->key      = name;
+	ctx->terminal = terminal;
+	ctx->type     = type;
+	ctx->flags    = flags;
+	ctx->callback = callback;
+	ctx->arg      = arg;
+	if (terminal) {
+		resolver->stats.cache_chains++;
+		ev_ares_search(resolver, terminal, dnsclass, type, flags, ev_ares_lookup_cb, ctx);
+		return;
+	}
+	resolver->stats.cache_misses++;
+	if (ev_ares_searched(resolver, name, flags)
+	    && (e = ev_ares_cache_get(resolver->cache, name, EV_ARES_T_SEARCH, ev_now(resolver->loop)))
+	    && (ctx->fqdn = strdup((char *) ev_ares_entry_data(e)))) {
+		resolver->stats.cache_suffix++;
+		ev_ares_search(resolver, ctx->fqdn, dnsclass, type, flags | EV_ARES_Q_ABSOLUTE, ev_ares_lookup_cb, ctx);
+		return;
+	}
+	ev_ares_search(resolver, name, dnsclass, type, flags, ev_ares_lookup_cb, ctx);
+}
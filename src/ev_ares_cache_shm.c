@@ -0,0 +1,217 @@
+/*
+ * Answer cache shared by the processes of a host.
+ *
+ * With opts.shm_cache every resolver maps the same POSIX shared memory
+ * object: a table of fixed 512-byte slots, 8-way set associative, a 4 KB
+ * set per hash. An entry stored in any process is written there too, and a
+ * miss in a process's own table looks there before asking upstream. An
+ * entry found there is only lent out: a copy of its slot, freed when the
+ * lookup is over (ev_ares_shm_return()) and never taken into the local
+ * table, which so holds just what its own process stored. Each answer is
+ * then kept once in the segment rather than once more per process. The
+ * segment counts in full against the budget of every process mapping it
+ * (stats.mem_shm).
+ *
+ * Slots are seqlocks. A writer takes one by moving its sequence from even
+ * to odd with a compare-and-swap, and gives up storing if another writer
+ * holds it; readers copy the slot and keep the copy only if the sequence
+ * was even and unchanged around it. Nobody waits on anybody. A process
+ * dying in the middle of a write leaves that one slot odd for good.
+ *
+ * Only record types are shared: the EV_ARES_T_SEARCH hints depend on the
+ * search list of each process. Relative names are shared as they are, so
+ * processes using one segment should share the resolver configuration, as
+ * those of one host do. Entries too large for a slot stay local.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EV_ARES_SHM_MAGIC   0x65767363u   // "evsc", written last by the creator
+#define EV_ARES_SHM_VERSION 1
+#define EV_ARES_SHM_SLOT    512
+#define EV_ARES_SHM_WAYS    8
+#define EV_ARES_SHM_SIZE    (16 << 20)    // default segment size
+#define EV_ARES_SHM_WAIT    1000          // ms to wait for the creator to set the segment up
+
+struct ev_ares_shm_hdr {
+	uint32_t       magic;
+	uint32_t       version;
+	uint64_t       size;
+	uint64_t       sets;                      // a power of 2
+	unsigned char  pad[EV_ARES_SHM_SLOT - 24];
+};
+
+struct ev_ares_shm_slot {
+	uint32_t       seq;                       // odd while written
+	uint32_t       hash;                      // 0 - empty
+	uint16_t       type;
+	uint16_t       nlen;
+	int32_t        len;
+	double         stored;                    // wall clock, as ev_now()
+	double         expires;
+	unsigned char  blob[EV_ARES_SHM_SLOT - 32];  // name, case-folded, NUL, data
+};
+
+struct ev_ares_shm {
+	struct ev_ares_shm_hdr  *hdr;
+	struct ev_ares_shm_slot *slots;
+	size_t         size;
+	uint64_t       mask;                      // sets - 1
+};
+
+#define ev_ares_shm_shared(type) ((type) != EV_ARES_T_SEARCH)
+
+static int ev_ares_shm_attach(struct ev_ares_cache *cache, const char *name, size_t size) {
+	struct ev_ares_shm_hdr *hdr;
+	struct ev_ares_shm *shm;
+	struct stat st;
+	uint64_t sets;
+	void *map;
+	int fd, created = 1, wait;
+
+	if (!size) size = EV_ARES_SHM_SIZE;
+	for (sets = 1; (1 + 2 * sets * EV_ARES_SHM_WAYS) * EV_ARES_SHM_SLOT <= size; sets <<= 1);
+	size = (1 + sets * EV_ARES_SHM_WAYS) * EV_ARES_SHM_SLOT;
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+		if (errno != EEXIST || (fd = shm_open(name, O_RDWR | O_CLOEXEC, 0)) < 0) return ARES_EFILE;
+		created = 0;
+	}
+	if (created && ftruncate(fd, size)) {
+		close(fd);
+		shm_unlink(name);
+		return ARES_EFILE;
+	}
+	// the creator may not have sized it yet
+	for (wait = 0; !created; wait++) {
+		if (fstat(fd, &st) || wait == EV_ARES_SHM_WAIT) {
+			close(fd);
+			return ARES_EFILE;
+		}
+		if ((size = st.st_size) >= sizeof(struct ev_ares_shm_hdr)) break;
+		usleep(1000);
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return ARES_EFILE;
+
+	hdr = map;
+	if (created) {
+		hdr->version = EV_ARES_SHM_VERSION;
+		hdr->size    = size;
+		hdr->sets    = sets;
+		__atomic_store_n(&hdr->magic, EV_ARES_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+	else {
+		for (wait = 0; __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != EV_ARES_SHM_MAGIC && wait < EV_ARES_SHM_WAIT; wait++) usleep(1000);
+		if (hdr->magic != EV_ARES_SHM_MAGIC || hdr->version != EV_ARES_SHM_VERSION || hdr->size != size
+		    || !hdr->sets || (hdr->sets & (hdr->sets - 1)) || (1 + hdr->sets * EV_ARES_SHM_WAYS) * EV_ARES_SHM_SLOT > size) {
+			munmap(map, size);
+			return ARES_EFILE;
+		}
+	}
+	if (!(shm = malloc(sizeof(struct ev_ares_shm)))) {
+		munmap(map, size);
+		return ARES_ENOMEM;
+	}
+	shm->hdr   = hdr;
+	shm->slots = (struct ev_ares_shm_slot *) (hdr + 1);
+	shm->size  = size;
+	shm->mask  = hdr->sets - 1;
+	cache->shm = shm;
+	cache->stats->mem_shm += size;
+	return ARES_SUCCESS;
+}
+
+// Frees the entries lent out by ev_ares_shm_get() since the last call
+static void ev_ares_shm_return(struct ev_ares_cache *cache) {
+	struct ev_ares_cache_entry *e, *next;
+	for (e = cache->lent; e; e = next) {
+		next = e->lru_next;
+		free(e);
+	}
+	cache->lent = NULL;
+}
+
+static void ev_ares_shm_free(struct ev_ares_cache *cache) {
+	if (!cache->shm) return;
+	ev_ares_shm_return(cache);
+	cache->stats->mem_shm -= cache->shm->size;
+	munmap(cache->shm->hdr, cache->shm->size);
+	free(cache->shm);
+	cache->shm = NULL;
+}
+
+// A consistent copy of the slot, 0 if it is being written or holds nothing sane
+static int ev_ares_shm_read(struct ev_ares_shm_slot *slot, struct ev_ares_shm_slot *copy) {
+	uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1) return 0;
+	memcpy(copy, slot, sizeof(struct ev_ares_shm_slot));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) return 0;
+	return copy->len >= 0 && copy->nlen + 1 + copy->len <= (int) sizeof(copy->blob) && !copy->blob[copy->nlen];
+}
+
+static struct ev_ares_cache_entry * ev_ares_shm_get(struct ev_ares_cache *cache, unsigned int hash, const char *name, int type, ev_tstamp now) {
+	struct ev_ares_shm_slot *set = cache->shm->slots + (hash & cache->shm->mask) * EV_ARES_SHM_WAYS, copy;
+	struct ev_ares_cache_entry *e;
+	int i;
+
+	if (!ev_ares_shm_shared(type)) return NULL;
+	for (i = 0; i < EV_ARES_SHM_WAYS; i++) {
+		if (__atomic_load_n(&set[i].hash, __ATOMIC_RELAXED) != hash || !ev_ares_shm_read(&set[i], &copy)) continue;
+		if (copy.hash != hash || copy.type != type || copy.expires <= now || strcasecmp((char *) copy.blob, name)) continue;
+		if (!(e = ev_ares_cache_alloc(copy.nlen, copy.len))) return NULL;
+		memcpy(e->blob, copy.blob, copy.nlen + 1 + copy.len);
+		e->nlen    = copy.nlen;
+		e->len     = copy.len;
+		e->hash    = hash;
+		e->type    = type;
+		e->stored  = copy.stored;
+		e->expires = copy.expires;
+		e->seg     = EV_ARES_SEG_LENT;
+		e->lru_prev = NULL;
+		e->lru_next = cache->lent;
+		cache->lent = e;
+		cache->stats->cache_shm_hits++;
+		return e;
+	}
+	return NULL;
+}
+
+// Writes a freshly stored entry over the same name, an empty or expired slot, or the one expiring first
+static void ev_ares_shm_put(struct ev_ares_cache *cache, const struct ev_ares_cache_entry *e) {
+	struct ev_ares_shm_slot *set = cache->shm->slots + (e->hash & cache->shm->mask) * EV_ARES_SHM_WAYS, *slot = NULL;
+	uint32_t seq, h;
+	int i;
+
+	if (!ev_ares_shm_shared(e->type) || e->nlen + 1 + e->len > (int) sizeof(slot->blob)) return;
+	for (i = 0; i < EV_ARES_SHM_WAYS; i++) {
+		h = __atomic_load_n(&set[i].hash, __ATOMIC_RELAXED);
+		// unlocked peeks, good enough to pick a victim
+		if (h == e->hash && set[i].type == e->type && !strncmp((char *) set[i].blob, ev_ares_entry_name(e), e->nlen + 1)) {
+			slot = &set[i];
+			break;
+		}
+		if (!h || set[i].expires <= e->stored) {
+			slot = &set[i];
+			continue;
+		}
+		if (!slot || (slot->hash && set[i].expires < slot->expires)) slot = &set[i];
+	}
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->hash, e->hash, __ATOMIC_RELAXED);
+	slot->type    = e->type;
+	slot->nlen    = e->nlen;
+	slot->len     = e->len;
+	slot->stored  = e->stored;
+	slot->expires = e->expires;
+	memcpy(slot->blob, e->blob, e->nlen + 1 + e->len);
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,281 @@
+/*
+ * Answer cache snapshots, for a warm start.
+ *
+ * ev_ares_cache_save() writes the entries still valid to a file, with the
+ * times they were stored and expire at (ev_now() is wall clock), so that a
+ * process started later serves them with whatever TTL they have left. The
+ * file is position independent: a header, an index of name hashes and file
+ * offsets, then the entries. ev_ares_cache_load() maps it read-only and
+ * checks the header, nothing more; entries are looked up in place and
+ * copied into the table on their first hit. The pages are shared by every
+ * process mapping the file.
+ *
+ * The file is written under a temporary name and renamed over the old one,
+ * which stays intact for whoever has it mapped.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EV_ARES_SNAP_MAGIC   "evaresc"      // with the NUL, 8 bytes
+#define EV_ARES_SNAP_VERSION 1
+#define EV_ARES_SNAP_ORDER   0x01020304u    // reads otherwise on a host of the other byte order
+
+struct ev_ares_snap_hdr {
+	char           magic[8];
+	uint32_t       version;
+	uint32_t       order;
+	uint64_t       size;                    // of the whole file
+	uint64_t       slots;                   // index size, a power of 2 from 16
+	uint64_t       count;
+	// uint32_t hashes[slots], uint64_t offsets[slots] (0 - empty), then the entries
+};
+
+struct ev_ares_snap_rec {
+	double         stored;
+	double         expires;
+	uint32_t       hash;                    // ev_ares_cache_hash()
+	uint16_t       type;
+	uint16_t       nlen;
+	int32_t        len;
+	uint32_t       pad;
+	unsigned char  blob[];                  // name, case-folded, NUL, data; padded to 8 bytes
+};
+
+#define ev_ares_snap_rec_size(nlen, len) ((sizeof(struct ev_ares_snap_rec) + (nlen) + 1 + (len) + 7) & ~(uint64_t) 7)
+
+struct ev_ares_snap {
+	const unsigned char *map;
+	size_t          size;
+	uint64_t        mask;
+	uint64_t        first;                  // offset of the first entry
+	const uint32_t *hashes;
+	const uint64_t *offsets;
+	unsigned char  *taken;                  // a bit per slot: copied in, replaced or dropped
+};
+
+#define ev_ares_snap_taken(snap, pos) ((snap)->taken[(pos) >> 3] & (1 << ((pos) & 7)))
+#define ev_ares_snap_mark(snap, pos)  ((snap)->taken[(pos) >> 3] |= 1 << ((pos) & 7))
+
+// The entry of a slot, NULL for an empty slot or one pointing off the file
+static const struct ev_ares_snap_rec * ev_ares_snap_rec_at(const struct ev_ares_snap *snap, uint64_t pos) {
+	uint64_t off = snap->offsets[pos];
+	const struct ev_ares_snap_rec *r;
+	if (off < snap->first || off % 8 || off > snap->size - sizeof(struct ev_ares_snap_rec)) return NULL;
+	r = (const struct ev_ares_snap_rec *) (snap->map + off);
+	if (r->len < 0 || ev_ares_snap_rec_size(r->nlen, r->len) > snap->size - off || r->blob[r->nlen]) return NULL;
+	return r;
+}
+
+static long ev_ares_snap_find(const struct ev_ares_snap *snap, unsigned int hash, const char *name, int type) {
+	uint64_t pos = hash & snap->mask, n;
+	const struct ev_ares_snap_rec *r;
+	for (n = 0; n <= snap->mask && snap->offsets[pos]; n++, pos = (pos + 1) & snap->mask) {
+		if (snap->hashes[pos] != hash || !(r = ev_ares_snap_rec_at(snap, pos))) continue;
+		if (r->type == type && !strcasecmp((const char *) r->blob, name)) return pos;
+	}
+	return -1;
+}
+
+// Copies the snapshot entry for name into the table, once
+static struct ev_ares_cache_entry * ev_ares_snap_take(struct ev_ares_cache *cache, unsigned int hash, const char *name, int type, ev_tstamp now) {
+	struct ev_ares_snap *snap = cache->snap;
+	const struct ev_ares_snap_rec *r;
+	struct ev_ares_cache_entry *e;
+	long pos = ev_ares_snap_find(snap, hash, name, type);
+
+	if (pos < 0 || ev_ares_snap_taken(snap, pos)) return NULL;
+	ev_ares_snap_mark(snap, pos);
+	r = ev_ares_snap_rec_at(snap, pos);
+	if (r->expires <= now || !(e = ev_ares_cache_alloc(r->nlen, r->len))) return NULL;
+	memcpy(e->blob, r->blob, r->nlen + 1 + r->len);
+	e->nlen    = r->nlen;
+	e->len     = r->len;
+	e->hash    = hash;
+	e->type    = type;
+	e->stored  = r->stored;
+	e->expires = r->expires;
+	ev_ares_cache_adopt(cache, e);
+	cache->stats->cache_snap_hits++;
+	return e;
+}
+
+static void ev_ares_snap_drop(struct ev_ares_cache *cache, unsigned int hash, const char *name, int type) {
+	long pos = ev_ares_snap_find(cache->snap, hash, name, type);
+	if (pos >= 0) ev_ares_snap_mark(cache->snap, pos);
+}
+
+static void ev_ares_snap_forget(struct ev_ares_cache *cache, int type) {
+	struct ev_ares_snap *snap = cache->snap;
+	const struct ev_ares_snap_rec *r;
+	uint64_t pos;
+	for (pos = 0; pos <= snap->mask; pos++) {
+		if ((r = ev_ares_snap_rec_at(snap, pos)) && r->type == type) ev_ares_snap_mark(snap, pos);
+	}
+}
+
+static void ev_ares_snap_free(struct ev_ares_cache *cache) {
+	struct ev_ares_snap *snap = cache->snap;
+	if (!snap) return;
+	ev_ares_cache_charge(cache, -(long) (sizeof(struct ev_ares_snap) + (snap->mask + 8) / 8));
+	munmap((void *) snap->map, snap->size);
+	free(snap->taken);
+	free(snap);
+	cache->snap = NULL;
+}
+
+int ev_ares_cache_load(ev_ares *resolver, const char *path) {
+	struct ev_ares_cache *cache = resolver->cache;
+	const struct ev_ares_snap_hdr *hdr;
+	struct ev_ares_snap *snap;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (!cache) return ARES_ENOTINITIALIZED;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return ARES_EFILE;
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(struct ev_ares_snap_hdr)
+	    || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return ARES_EFILE;
+	}
+	close(fd);
+
+	hdr = map;
+	if (memcmp(hdr->magic, EV_ARES_SNAP_MAGIC, 8) || hdr->version != EV_ARES_SNAP_VERSION || hdr->order != EV_ARES_SNAP_ORDER
+	    || hdr->size != (uint64_t) st.st_size || hdr->slots < 16 || (hdr->slots & (hdr->slots - 1))
+	    || hdr->slots > (st.st_size - sizeof(struct ev_ares_snap_hdr)) / (sizeof(uint32_t) + sizeof(uint64_t))) {
+		munmap(map, st.st_size);
+		return ARES_EFILE;
+	}
+	if (!(snap = calloc(1, sizeof(struct ev_ares_snap))) || !(snap->taken = calloc(hdr->slots / 8, 1))) {
+		free(snap);
+		munmap(map, st.st_size);
+		return ARES_ENOMEM;
+	}
+	snap->map     = map;
+	snap->size    = st.st_size;
+	snap->mask    = hdr->slots - 1;
+	snap->hashes  = (const uint32_t *) (hdr + 1);
+	snap->offsets = (const uint64_t *) (snap->hashes + hdr->slots);
+	snap->first   = (const unsigned char *) (snap->offsets + hdr->slots) - snap->map;
+
+	ev_ares_snap_free(cache);
+	cache->snap = snap;
+	ev_ares_cache_charge(cache, sizeof(struct ev_ares_snap) + hdr->slots / 8);
+	return ARES_SUCCESS;
+}
+
+// An entry to save, from the table or from the snapshot in use
+typedef struct {
+	struct ev_ares_snap_rec rec;
+	const unsigned char *blob;
+} ev_ares_snap_item;
+
+static int ev_ares_snap_write(const char *path, ev_ares_snap_item *items, uint64_t count) {
+	static const unsigned char zero[8];
+	struct ev_ares_snap_hdr hdr;
+	uint32_t *hashes;
+	uint64_t *offsets, slots = 16, off, pos, i, size, pad;
+	char *tmp = NULL;
+	FILE *f = NULL;
+	int fd, status = ARES_ENOMEM;
+
+	while (slots < 2 * count) slots <<= 1;
+	hashes  = calloc(slots, sizeof(uint32_t));
+	offsets = calloc(slots, sizeof(uint64_t));
+	if (!hashes || !offsets || !(tmp = malloc(strlen(path) + 8))) goto out;
+	sprintf(tmp, "%s.XXXXXX", path);
+
+	off = sizeof(struct ev_ares_snap_hdr) + slots * (sizeof(uint32_t) + sizeof(uint64_t));
+	for (i = 0; i < count; i++) {
+		for (pos = items[i].rec.hash & (slots - 1); offsets[pos]; pos = (pos + 1) & (slots - 1));
+		hashes[pos]  = items[i].rec.hash;
+		offsets[pos] = off;
+		off += ev_ares_snap_rec_size(items[i].rec.nlen, items[i].rec.len);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, EV_ARES_SNAP_MAGIC, 8);
+	hdr.version = EV_ARES_SNAP_VERSION;
+	hdr.order   = EV_ARES_SNAP_ORDER;
+	hdr.size    = off;
+	hdr.slots   = slots;
+	hdr.count   = count;
+
+	status = ARES_EFILE;
+	if ((fd = mkstemp(tmp)) < 0) goto out;
+	if (!(f = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fwrite(hashes, sizeof(uint32_t), slots, f) != slots
+	    || fwrite(offsets, sizeof(uint64_t), slots, f) != slots) goto out;
+
+	for (i = 0; i < count; i++) {
+		size = items[i].rec.nlen + 1 + items[i].rec.len;
+		pad  = ev_ares_snap_rec_size(items[i].rec.nlen, items[i].rec.len) - sizeof(struct ev_ares_snap_rec) - size;
+		if (fwrite(&items[i].rec, sizeof(struct ev_ares_snap_rec), 1, f) != 1
+		    || fwrite(items[i].blob, 1, size, f) != size || fwrite(zero, 1, pad, f) != pad) break;
+	}
+	if (fclose(f) == 0 && i == count && !rename(tmp, path)) status = ARES_SUCCESS;
+	else unlink(tmp);
+	f = NULL;
+
+	out:
+	if (f) {
+		fclose(f);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(hashes);
+	free(offsets);
+	return status;
+}
+
+int ev_ares_cache_save(ev_ares *resolver, const char *path) {
+	struct ev_ares_cache *cache = resolver->cache;
+	struct ev_ares_snap *snap;
+	struct ev_ares_cache_entry *e;
+	const struct ev_ares_snap_rec *r;
+	ev_ares_snap_item *items;
+	ev_tstamp now;
+	uint64_t count = 0, pos;
+	int seg, status;
+
+	if (!cache) return ARES_ENOTINITIALIZED;
+	now = resolver->loop ? ev_now(resolver->loop) : ev_time();
+	snap = cache->snap;
+	if (!(items = malloc((cache->count + (snap ? snap->mask + 1 : 0) + 1) * sizeof(ev_ares_snap_item)))) return ARES_ENOMEM;
+
+	for (seg = 0; seg < 3; seg++) {
+		for (e = cache->lru[seg].head; e; e = e->lru_next) {
+			if (e->expires <= now) continue;
+			memset(&items[count].rec, 0, sizeof(struct ev_ares_snap_rec));
+			items[count].rec.stored  = e->stored;
+			items[count].rec.expires = e->expires;
+			items[count].rec.hash    = e->hash;
+			items[count].rec.type    = e->type;
+			items[count].rec.nlen    = e->nlen;
+			items[count].rec.len     = e->len;
+			items[count].blob        = e->blob;
+			count++;
+		}
+	}
+	// what the loaded snapshot still holds goes on into the next one
+	for (pos = 0; snap && pos <= snap->mask; pos++) {
+		if (ev_ares_snap_taken(snap, pos) || !(r = ev_ares_snap_rec_at(snap, pos)) || r->expires <= now) continue;
+		if (ev_ares_cache_find(cache, r->hash, (const char *) r->blob, r->type) >= 0) continue;
+		items[count].rec  = *r;
+		items[count].blob = r->blob;
+		count++;
+	}
+
+	status = ev_ares_snap_write(path, items, count);
+	free(items);
+	return status;
+}
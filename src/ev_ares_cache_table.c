@@ -0,0 +1,440 @@
+/*
+ * Storage engine of the answer cache.
+ *
+ * The index is an open-addressing Robin Hood table of two parallel arrays:
+ * name hashes, which probing reads almost exclusively, and entry pointers.
+ * A zero hash marks an empty slot. Removal shifts the following run back,
+ * so there are no tombstones and probe lengths stay short up to the 7/8
+ * load the table is sized for. The sizing leaves room for the entries a
+ * lookup takes in over size before its trim (ev_ares_cache_adopt()), so
+ * there is always an empty slot to end a probe.
+ *
+ * Each entry is a single allocation: a small header followed by the
+ * case-folded name and the data (a DNS message in wire format, where the
+ * records sit back to back, addresses inline and names compressed against
+ * each other). Entries never move, so the LRU lists link them directly.
+ *
+ * Eviction is plain LRU, or with EV_ARES_CACHE_TINYLFU scan resistant
+ * W-TinyLFU: new entries go to a small LRU window (1%), and the window's
+ * victim gets into the main cache only when a count-min sketch of recent
+ * access frequencies rates it above the main cache's own victim. The main
+ * cache is a segmented LRU: entries hit while on probation are promoted to
+ * the protected segment (80%), whose overflow goes back to probation. One-off
+ * names then only ever churn the window.
+ *
+ * A snapshot loaded with ev_ares_cache_load() (ev_ares_cache_snap.c) stays
+ * mapped behind the table: a miss looks there, and an entry still valid is
+ * copied in as if just stored. Each snapshot entry is taken at most once,
+ * so what the table evicts, replaces or drops does not come back from it.
+ * Behind that may come the segment shared with other processes
+ * (ev_ares_cache_shm.c), which also gets every entry stored here; what a
+ * miss finds there is lent out for the lookup, not copied in.
+ */
+
+#define EV_ARES_SEG_WINDOW    0   // all entries with plain LRU
+#define EV_ARES_SEG_PROBATION 1
+#define EV_ARES_SEG_PROTECTED 2
+#define EV_ARES_SEG_LENT      3   // a copy from the shared segment, on cache->lent only
+#define EV_ARES_SKETCH_ROWS   4
+#define EV_ARES_SKETCH_MAX    15  // counters saturate here; halved every 10 * size samples
+#define EV_ARES_CACHE_SLACK   16  // entries over size between trims: a CNAME walk (EV_ARES_CACHE_HOPS), its terminal and FQDN
+
+struct ev_ares_cache_entry {
+	struct ev_ares_cache_entry *lru_prev;  // towards most recently used
+	struct ev_ares_cache_entry *lru_next;
+	ev_tstamp      stored;
+	ev_tstamp      expires;
+	unsigned int   hash;
+	unsigned short type;
+	unsigned short nlen;                   // name length, without the NUL
+	int            len;                    // data length
+	unsigned char  seg;                    // EV_ARES_SEG_*
+	unsigned char  blob[];                 // name, NUL, data
+};
+
+#define ev_ares_entry_name(e) ((char *) (e)->blob)
+#define ev_ares_entry_data(e) ((e)->blob + (e)->nlen + 1)
+#define ev_ares_entry_size(e) (sizeof(struct ev_ares_cache_entry) + (e)->nlen + 1 + (e)->len)
+
+struct ev_ares_snap;
+struct ev_ares_shm;
+
+struct ev_ares_cache_lru {
+	struct ev_ares_cache_entry *head;
+	struct ev_ares_cache_entry *tail;
+	int            count;
+	int            cap;                    // window and protected only; probation takes the rest
+};
+
+struct ev_ares_cache {
+	unsigned int  *hashes;
+	struct ev_ares_cache_entry **entries;
+	unsigned int   mask;
+	int            count;
+	int            size;
+	int            policy;
+	struct ev_ares_cache_lru lru[3];       // by EV_ARES_SEG_*
+	unsigned char *sketch;                 // EV_ARES_SKETCH_ROWS rows of smask + 1 counters
+	unsigned int   smask;
+	int            samples;                // since the last halving
+	size_t         bytes;                  // all of the above, also in stats->mem_cache
+	ev_ares_stats *stats;
+	struct ev_ares_snap *snap;             // from ev_ares_cache_load(), NULL without
+	struct ev_ares_shm  *shm;              // opts.shm_cache, NULL without
+	struct ev_ares_cache_entry *lent;      // shm hits of the lookup under way, through lru_next
+};
+
+static struct ev_ares_cache_entry * ev_ares_snap_take(struct ev_ares_cache *cache, unsigned int hash, const char *name, int type, ev_tstamp now);
+static void ev_ares_snap_drop(struct ev_ares_cache *cache, unsigned int hash, const char *name, int type);
+static void ev_ares_snap_forget(struct ev_ares_cache *cache, int type);
+static void ev_ares_snap_free(struct ev_ares_cache *cache);
+static struct ev_ares_cache_entry * ev_ares_shm_get(struct ev_ares_cache *cache, unsigned int hash, const char *name, int type, ev_tstamp now);
+static void ev_ares_shm_put(struct ev_ares_cache *cache, const struct ev_ares_cache_entry *e);
+static void ev_ares_shm_return(struct ev_ares_cache *cache);
+static void ev_ares_shm_free(struct ev_ares_cache *cache);
+
+static inline void ev_ares_cache_charge(struct ev_ares_cache *cache, long bytes) {
+	cache->bytes += bytes;
+	cache->stats->mem_cache += bytes;
+}
+
+static struct ev_ares_cache * ev_ares_cache_new(int size, int policy, ev_ares_stats *stats) {
+	struct ev_ares_cache *cache = calloc(1, sizeof(struct ev_ares_cache));
+	unsigned int n = 16;
+	if (!cache) return NULL;
+	while (n / 8 * 7 < (unsigned int) size + EV_ARES_CACHE_SLACK) n <<= 1;
+	cache->hashes  = calloc(n, sizeof(unsigned int));
+	cache->entries = calloc(n, sizeof(struct ev_ares_cache_entry *));
+	cache->mask   = n - 1;
+	cache->size   = size;
+	cache->policy = policy;
+	cache->stats  = stats;
+	if (policy == EV_ARES_CACHE_TINYLFU && size >= 3) {
+		cache->lru[EV_ARES_SEG_WINDOW].cap    = size / 100 > 1 ? size / 100 : 1;
+		cache->lru[EV_ARES_SEG_PROTECTED].cap = (size - cache->lru[EV_ARES_SEG_WINDOW].cap) * 8 / 10;
+		for (n = 16; n < (unsigned int) size; n <<= 1);
+		cache->smask  = n - 1;
+		cache->sketch = calloc(EV_ARES_SKETCH_ROWS, n);
+	}
+	else {
+		cache->policy = EV_ARES_CACHE_LRU;
+		cache->lru[EV_ARES_SEG_WINDOW].cap = size;
+	}
+	if (!cache->hashes || !cache->entries || (cache->policy == EV_ARES_CACHE_TINYLFU && !cache->sketch)) {
+		free(cache->hashes);
+		free(cache->entries);
+		free(cache->sketch);
+		free(cache);
+		return NULL;
+	}
+	ev_ares_cache_charge(cache, sizeof(struct ev_ares_cache) + (cache->mask + 1) * (sizeof(unsigned int) + sizeof(struct ev_ares_cache_entry *))
+		+ (cache->sketch ? EV_ARES_SKETCH_ROWS * (cache->smask + 1) : 0));
+	return cache;
+}
+
+static void ev_ares_cache_free(struct ev_ares_cache *cache) {
+	struct ev_ares_cache_entry *e, *next;
+	int seg;
+	if (!cache) return;
+	for (seg = 0; seg < 3; seg++) {
+		for (e = cache->lru[seg].head; e; e = next) {
+			next = e->lru_next;
+			free(e);
+		}
+	}
+	ev_ares_snap_free(cache);
+	ev_ares_shm_free(cache);
+	cache->stats->mem_cache -= cache->bytes;
+	free(cache->hashes);
+	free(cache->entries);
+	free(cache->sketch);
+	free(cache);
+}
+
+// FNV-1a over the case-folded name, salted with the type; never 0
+static unsigned int ev_ares_cache_hash(const char *name, int type) {
+	unsigned int h = 2166136261u ^ (unsigned int) type;
+	for (; *name; name++) {
+		h ^= (unsigned char) tolower((unsigned char) *name);
+		h *= 16777619u;
+	}
+	return h ? h : 1;
+}
+
+static int ev_ares_cache_find(struct ev_ares_cache *cache, unsigned int hash, const char *name, int type) {
+	unsigned int pos = hash & cache->mask, dist, h;
+	for (dist = 0; dist <= cache->mask; dist++, pos = (pos + 1) & cache->mask) {
+		if (!(h = cache->hashes[pos])) return -1;
+		// a richer slot than us: we would have been placed before it
+		if (((pos - (h & cache->mask)) & cache->mask) < dist) return -1;
+		if (h == hash && cache->entries[pos]->type == type && !strcasecmp(ev_ares_entry_name(cache->entries[pos]), name)) return pos;
+	}
+	return -1;
+}
+
+static void ev_ares_cache_slot_add(struct ev_ares_cache *cache, struct ev_ares_cache_entry *e) {
+	unsigned int pos = e->hash & cache->mask, dist = 0, d, h = e->hash, th;
+	struct ev_ares_cache_entry *te;
+	for (;; dist++, pos = (pos + 1) & cache->mask) {
+		if (!cache->hashes[pos]) {
+			cache->hashes[pos]  = h;
+			cache->entries[pos] = e;
+			return;
+		}
+		d = (pos - (cache->hashes[pos] & cache->mask)) & cache->mask;
+		if (d < dist) {
+			th = cache->hashes[pos];  cache->hashes[pos]  = h; h = th;
+			te = cache->entries[pos]; cache->entries[pos] = e; e = te;
+			dist = d;
+		}
+	}
+}
+
+static void ev_ares_cache_slot_del(struct ev_ares_cache *cache, struct ev_ares_cache_entry *e) {
+	unsigned int pos = e->hash & cache->mask, next;
+	while (cache->entries[pos] != e) pos = (pos + 1) & cache->mask;
+	for (next = (pos + 1) & cache->mask;
+	     cache->hashes[next] && ((next - (cache->hashes[next] & cache->mask)) & cache->mask);
+	     pos = next, next = (next + 1) & cache->mask) {
+		cache->hashes[pos]  = cache->hashes[next];
+		cache->entries[pos] = cache->entries[next];
+	}
+	cache->hashes[pos]  = 0;
+	cache->entries[pos] = NULL;
+}
+
+static inline unsigned int ev_ares_sketch_slot(struct ev_ares_cache *cache, unsigned int hash, int row) {
+	static const unsigned int seeds[EV_ARES_SKETCH_ROWS] = { 0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu };
+	unsigned int x = hash * seeds[row];
+	x ^= x >> 15;
+	return row * (cache->smask + 1) + (x & cache->smask);
+}
+
+// Conservative update: only the counters at the current minimum grow
+static void ev_ares_sketch_add(struct ev_ares_cache *cache, unsigned int hash) {
+	unsigned int slot[EV_ARES_SKETCH_ROWS], i;
+	unsigned char min = EV_ARES_SKETCH_MAX;
+	for (i = 0; i < EV_ARES_SKETCH_ROWS; i++) {
+		slot[i] = ev_ares_sketch_slot(cache, hash, i);
+		if (cache->sketch[ slot[i] ] < min) min = cache->sketch[ slot[i] ];
+	}
+	if (min < EV_ARES_SKETCH_MAX) {
+		for (i = 0; i < EV_ARES_SKETCH_ROWS; i++) if (cache->sketch[ slot[i] ] == min) cache->sketch[ slot[i] ]++;
+	}
+	// aging, so that what was popular long ago fades out
+	if (++cache->samples >= 10 * cache->size) {
+		for (i = 0; i < EV_ARES_SKETCH_ROWS * (cache->smask + 1); i++) cache->sketch[i] >>= 1;
+		cache->samples = 0;
+	}
+}
+
+static int ev_ares_sketch_get(struct ev_ares_cache *cache, unsigned int hash) {
+	unsigned char min = EV_ARES_SKETCH_MAX, c;
+	int i;
+	for (i = 0; i < EV_ARES_SKETCH_ROWS; i++) {
+		if ((c = cache->sketch[ ev_ares_sketch_slot(cache, hash, i) ]) < min) min = c;
+	}
+	return min;
+}
+
+static void ev_ares_cache_lru_del(struct ev_ares_cache *cache, struct ev_ares_cache_entry *e) {
+	struct ev_ares_cache_lru *lru = &cache->lru[e->seg];
+	if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+	else lru->head = e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+	else lru->tail = e->lru_prev;
+	lru->count--;
+}
+
+static void ev_ares_cache_lru_add(struct ev_ares_cache *cache, struct ev_ares_cache_entry *e, int seg) {
+	struct ev_ares_cache_lru *lru = &cache->lru[seg];
+	e->seg = seg;
+	e->lru_prev = NULL;
+	e->lru_next = lru->head;
+	if (lru->head) lru->head->lru_prev = e;
+	else lru->tail = e;
+	lru->head = e;
+	lru->count++;
+}
+
+// The caller frees e
+static void ev_ares_cache_unlink(struct ev_ares_cache *cache, struct ev_ares_cache_entry *e) {
+	ev_ares_cache_slot_del(cache, e);
+	ev_ares_cache_lru_del(cache, e);
+	cache->count--;
+	ev_ares_cache_charge(cache, -(long) ev_ares_entry_size(e));
+}
+
+static void ev_ares_cache_evict(struct ev_ares_cache *cache, struct ev_ares_cache_entry *e) {
+	ev_ares_cache_unlink(cache, e);
+	free(e);
+	cache->stats->cache_evicted++;
+}
+
+static void ev_ares_cache_touch(struct ev_ares_cache *cache, struct ev_ares_cache_entry *e) {
+	struct ev_ares_cache_lru *prot = &cache->lru[EV_ARES_SEG_PROTECTED];
+	switch (e->seg) {
+	case EV_ARES_SEG_WINDOW:    cache->stats->cache_window_hits++;    break;
+	case EV_ARES_SEG_PROBATION: cache->stats->cache_probation_hits++; break;
+	case EV_ARES_SEG_PROTECTED: cache->stats->cache_protected_hits++; break;
+	}
+	if (cache->lru[e->seg].head == e) return;
+	ev_ares_cache_lru_del(cache, e);
+	if (e->seg != EV_ARES_SEG_PROBATION) {
+		ev_ares_cache_lru_add(cache, e, e->seg);
+		return;
+	}
+	ev_ares_cache_lru_add(cache, e, EV_ARES_SEG_PROTECTED);
+	while (prot->count > prot->cap) {
+		e = prot->tail;
+		ev_ares_cache_lru_del(cache, e);
+		ev_ares_cache_lru_add(cache, e, EV_ARES_SEG_PROBATION);
+	}
+}
+
+// Brings the segments back to their capacities after an insertion
+static void ev_ares_cache_trim(struct ev_ares_cache *cache) {
+	struct ev_ares_cache_lru *win = &cache->lru[EV_ARES_SEG_WINDOW];
+	struct ev_ares_cache_entry *cand, *victim;
+
+	if (cache->policy == EV_ARES_CACHE_LRU) {
+		while (cache->count > cache->size) ev_ares_cache_evict(cache, win->tail);
+		return;
+	}
+	while (win->count > win->cap) {
+		cand = win->tail;
+		ev_ares_cache_lru_del(cache, cand);
+		ev_ares_cache_lru_add(cache, cand, EV_ARES_SEG_PROBATION);
+		if (cache->count <= cache->size) continue;
+		// the main cache is full: the rarer of the two goes
+		victim = cache->lru[EV_ARES_SEG_PROBATION].tail;
+		if (victim == cand) victim = cache->lru[EV_ARES_SEG_PROTECTED].tail;
+		if (victim && ev_ares_sketch_get(cache, cand->hash) > ev_ares_sketch_get(cache, victim->hash)) {
+			cache->stats->cache_admitted++;
+			ev_ares_cache_evict(cache, victim);
+		}
+		else {
+			cache->stats->cache_rejected++;
+			ev_ares_cache_evict(cache, cand);
+		}
+	}
+}
+
+static struct ev_ares_cache_entry * ev_ares_cache_get(struct ev_ares_cache *cache, const char *name, int type, ev_tstamp now) {
+	unsigned int hash = ev_ares_cache_hash(name, type);
+	int pos = ev_ares_cache_find(cache, hash, name, type);
+	struct ev_ares_cache_entry *e;
+	// misses count too: a name asked for again is worth admitting
+	if (cache->sketch) ev_ares_sketch_add(cache, hash);
+	if (pos >= 0) {
+		e = cache->entries[pos];
+		if (e->expires > now) {
+			ev_ares_cache_touch(cache, e);
+			return e;
+		}
+		ev_ares_cache_unlink(cache, e);
+		free(e);
+	}
+	// another process may have it fresher
+	e = NULL;
+	if (cache->snap) e = ev_ares_snap_take(cache, hash, name, type, now);
+	if (!e && cache->shm) e = ev_ares_shm_get(cache, hash, name, type, now);
+	return e;
+}
+
+static inline struct ev_ares_cache_entry * ev_ares_cache_alloc(size_t nlen, int len) {
+	return malloc(sizeof(struct ev_ares_cache_entry) + nlen + 1 + len);
+}
+
+// Links in an entry filled but for the lists
+static void ev_ares_cache_link(struct ev_ares_cache *cache, struct ev_ares_cache_entry *e, int seg) {
+	ev_ares_cache_slot_add(cache, e);
+	ev_ares_cache_lru_add(cache, e, seg);
+	cache->count++;
+	ev_ares_cache_charge(cache, ev_ares_entry_size(e));
+	ev_ares_cache_trim(cache);
+}
+
+// Same for an entry found by ev_ares_cache_get(), whose caller may still hold
+// earlier ones (a CNAME chain): the cache stays over size until the next trim
+static void ev_ares_cache_adopt(struct ev_ares_cache *cache, struct ev_ares_cache_entry *e) {
+	ev_ares_cache_slot_add(cache, e);
+	ev_ares_cache_lru_add(cache, e, EV_ARES_SEG_WINDOW);
+	cache->count++;
+	ev_ares_cache_charge(cache, ev_ares_entry_size(e));
+}
+
+static void ev_ares_cache_put(struct ev_ares_cache *cache, const char *name, int type, const void *data, int len, int ttl, ev_tstamp now) {
+	unsigned int hash = ev_ares_cache_hash(name, type);
+	size_t nlen = strlen(name), i;
+	struct ev_ares_cache_entry *e;
+	int pos, seg = EV_ARES_SEG_WINDOW;
+
+	if (ttl <= 0 || nlen > 0xffff) return;
+	// a fresher answer takes the place of the old one
+	if ((pos = ev_ares_cache_find(cache, hash, name, type)) >= 0) {
+		e = cache->entries[pos];
+		seg = e->seg;
+		ev_ares_cache_unlink(cache, e);
+		free(e);
+	}
+	else
+	if (cache->snap) {
+		ev_ares_snap_drop(cache, hash, name, type);
+	}
+
+	if (!(e = ev_ares_cache_alloc(nlen, len))) return;
+	for (i = 0; i <= nlen; i++) e->blob[i] = tolower((unsigned char) name[i]);
+	e->nlen    = nlen;
+	memcpy(ev_ares_entry_data(e), data, len);
+	e->len     = len;
+	e->hash    = hash;
+	e->type    = type;
+	e->stored  = now;
+	e->expires = now + ttl;
+	// shared first: once linked, e belongs to the table and its trims
+	if (cache->shm) ev_ares_shm_put(cache, e);
+	ev_ares_cache_link(cache, e, seg);
+}
+
+static void ev_ares_cache_drop(struct ev_ares_cache *cache, const char *name, int type) {
+	unsigned int hash = ev_ares_cache_hash(name, type);
+	int pos = ev_ares_cache_find(cache, hash, name, type);
+	struct ev_ares_cache_entry *e;
+	if (pos < 0) {
+		if (cache->snap) ev_ares_snap_drop(cache, hash, name, type);
+		return;
+	}
+	e = cache->entries[pos];
+	ev_ares_cache_unlink(cache, e);
+	free(e);
+}
+
+// Drops every entry of the type
+static void ev_ares_cache_forget(struct ev_ares_cache *cache, int type) {
+	struct ev_ares_cache_entry *e, *next;
+	int seg;
+	for (seg = 0; seg < 3; seg++) {
+		for (e = cache->lru[seg].head; e; e = next) {
+			next = e->lru_next;
+			if (e->type != type) continue;
+			ev_ares_cache_unlink(cache, e);
+			free(e);
+		}
+	}
+	if (cache->snap) ev_ares_snap_forget(cache, type);
+}
+
+// Evicts until the entries hold at most bytes less; probation goes first, protected last
+static int ev_ares_cache_shrink(struct ev_ares_cache *cache, size_t bytes) {
+	static const int order[] = { EV_ARES_SEG_PROBATION, EV_ARES_SEG_WINDOW, EV_ARES_SEG_PROTECTED };
+	size_t goal = cache->bytes > bytes ? cache->bytes - bytes : 0;
+	int i, n = 0;
+	for (i = 0; i < 3; i++) {
+		while (cache->bytes > goal && cache->lru[ order[i] ].tail) {
+			ev_ares_cache_evict(cache, cache->lru[ order[i] ].tail);
+			n++;
+		}
+	}
+	return n;
+}
@@ -0,0 +1,28 @@
+/*
+ * Memory budget.
+ *
+ * The caches, the scheduler and the reply path keep what they hold in
+ * stats.mem_*. When the sum goes over opts.mem_budget the answer cache
+ * gives up entries first (probation, window, protected), then the PTR
+ * cache; only what is still over holds back new queries in the scheduler.
+ */
+
+size_t ev_ares_mem_used(const ev_ares *resolver) {
+	const ev_ares_stats *s = &resolver->stats;
+	return s->mem_cache + s->mem_ptr_cache + s->mem_pending + s->mem_replies + s->mem_shm;
+}
+
+// Trims the caches when over the budget; 1 if it is still over
+static int ev_ares_mem_over(ev_ares *resolver) {
+	size_t used, budget = resolver->opts.mem_budget;
+	if (!budget || (used = ev_ares_mem_used(resolver)) <= budget) return 0;
+	if (resolver->cache) {
+		resolver->stats.mem_trims += ev_ares_cache_shrink(resolver->cache, used - budget);
+		if ((used = ev_ares_mem_used(resolver)) <= budget) return 0;
+	}
+	if (resolver->ptr_cache) {
+		resolver->stats.mem_trims += ev_ares_rev_shrink(resolver->ptr_cache, used - budget);
+		used = ev_ares_mem_used(resolver);
+	}
+	return used > budget;
+}
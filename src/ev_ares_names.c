@@ -0,0 +1,198 @@
+/*
+ * Interned owner names.
+ *
+ * A name is looked up straight from the packet: it is copied case-folded
+ * in wire form, compression pointers followed, and hashed; a name the
+ * resolver already holds is neither expanded nor allocated again. All the
+ * records of an answer, and of any other reply alive at the time, then
+ * share one refcounted host string, and equal names are equal pointers.
+ * Without a table (names == NULL) each call still returns a name of its
+ * own in the same format, so the free path is always ev_ares_name_unref().
+ */
+
+struct ev_ares_name {
+	struct ev_ares_names *table;   // NULL when interned nowhere
+	struct ev_ares_name  *next;    // in the table's dead stack
+	unsigned int   hash;           // over the wire form
+	int            refs;           // atomic: replies are released on any thread
+	unsigned short tlen;
+	unsigned char  wlen;
+	char           text[];         // as ares_expand_name() gives it, NUL, then the wire form
+};
+
+#define ev_ares_name_of(s) ((struct ev_ares_name *) ((char *) (s) - offsetof(struct ev_ares_name, text)))
+#define ev_ares_name_wire(n) ((unsigned char *) (n)->text + (n)->tlen + 1)
+
+// The dead stack once the table is closed: names going after that free themselves
+#define EV_ARES_NAMES_CLOSED ((struct ev_ares_name *) 1)
+
+/*
+ * Only the loop's thread touches the slots. A name whose last reference
+ * goes, on whatever thread, is pushed on the dead stack and stays in its
+ * slot, where lookups pass it over, until the loop takes it out on its
+ * next parse. Each interned name holds a reference to the table struct,
+ * so that it outlives ev_ares_names_free() for as long as names do.
+ */
+struct ev_ares_names {
+	struct ev_ares_name **slots;   // linear probing, at most half full
+	unsigned int   mask;
+	int            count;
+	int            refs;           // atomic: the resolver's and one per interned name
+	struct ev_ares_name *dead;     // pushed by any thread, taken by the loop
+};
+
+static struct ev_ares_names * ev_ares_names_new(void) {
+	struct ev_ares_names *names = calloc(1, sizeof(struct ev_ares_names));
+	if (!names) return NULL;
+	if (!(names->slots = calloc(64, sizeof(struct ev_ares_name *)))) {
+		free(names);
+		return NULL;
+	}
+	names->mask = 63;
+	names->refs = 1;
+	return names;
+}
+
+static inline void ev_ares_names_unref(struct ev_ares_names *names) {
+	if (!__atomic_sub_fetch(&names->refs, 1, __ATOMIC_ACQ_REL)) free(names);
+}
+
+static void ev_ares_names_slot_del(struct ev_ares_names *names, struct ev_ares_name *n) {
+	unsigned int i = n->hash & names->mask, j, k;
+	while (names->slots[i] != n) i = (i + 1) & names->mask;
+	names->slots[i] = NULL;
+	// shift back the entries whose probe run crossed the hole
+	for (j = (i + 1) & names->mask; names->slots[j]; j = (j + 1) & names->mask) {
+		k = names->slots[j]->hash & names->mask;
+		if (((j - k) & names->mask) < ((j - i) & names->mask)) continue;
+		names->slots[i] = names->slots[j];
+		names->slots[j] = NULL;
+		i = j;
+	}
+	names->count--;
+}
+
+// On the loop: takes the names released since the last time out of the table
+static void ev_ares_names_reap(struct ev_ares_names *names, struct ev_ares_name *stop) {
+	struct ev_ares_name *n, *next;
+	if (__atomic_load_n(&names->dead, __ATOMIC_RELAXED) == stop) return;
+	for (n = __atomic_exchange_n(&names->dead, stop, __ATOMIC_ACQUIRE); n && n != EV_ARES_NAMES_CLOSED; n = next) {
+		next = n->next;
+		ev_ares_names_slot_del(names, n);
+		free(n);
+		__atomic_sub_fetch(&names->refs, 1, __ATOMIC_RELAXED);  // the resolver's keeps it above 0
+	}
+}
+
+// Names still referenced by replies outlive the table, on their own
+static void ev_ares_names_free(struct ev_ares_names *names) {
+	if (!names) return;
+	ev_ares_names_reap(names, EV_ARES_NAMES_CLOSED);
+	free(names->slots);
+	names->slots = NULL;
+	ev_ares_names_unref(names);
+}
+
+static int ev_ares_names_grow(struct ev_ares_names *names) {
+	unsigned int size = (names->mask + 1) * 2, i, j;
+	struct ev_ares_name **slots = calloc(size, sizeof(struct ev_ares_name *));
+	if (!slots) return -1;
+	for (i = 0; i <= names->mask; i++) {
+		if (!names->slots[i]) continue;
+		for (j = names->slots[i]->hash & (size - 1); slots[j]; j = (j + 1) & (size - 1));
+		slots[j] = names->slots[i];
+	}
+	free(names->slots);
+	names->slots = slots;
+	names->mask  = size - 1;
+	return 0;
+}
+
+// One more reference to a name the caller holds
+static inline char * ev_ares_name_ref(char *s) {
+	__atomic_add_fetch(&ev_ares_name_of(s)->refs, 1, __ATOMIC_RELAXED);
+	return s;
+}
+
+// A reference to a name found in the table, unless it is already on its way out
+static inline int ev_ares_name_tryref(struct ev_ares_name *n) {
+	int refs = __atomic_load_n(&n->refs, __ATOMIC_RELAXED);
+	do {
+		if (!refs) return 0;
+	} while (!__atomic_compare_exchange_n(&n->refs, &refs, refs + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 1;
+}
+
+// Any thread
+static void ev_ares_name_unref(char *s) {
+	struct ev_ares_name *n = ev_ares_name_of(s), *top;
+	struct ev_ares_names *names = n->table;
+	if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL)) return;
+	if (!names) {
+		free(n);
+		return;
+	}
+	top = __atomic_load_n(&names->dead, __ATOMIC_RELAXED);
+	do {
+		if (top == EV_ARES_NAMES_CLOSED) {
+			free(n);
+			ev_ares_names_unref(names);
+			return;
+		}
+		n->next = top;
+	} while (!__atomic_compare_exchange_n(&names->dead, &top, n, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * ares_expand_name() through the table: *s gets a referenced interned name,
+ * released with ev_ares_name_unref().
+ */
+static int ev_ares_name_expand(struct ev_ares_names *names, const unsigned char *encoded, const unsigned char *abuf, int alen, char **s, long *enclen) {
+	unsigned char wire[EV_ARES_WIRE_BUF];
+	unsigned int hash = 2166136261u, i;
+	struct ev_ares_name *n;
+	char *text;
+	long tlen;
+	int wlen, status;
+
+	if ((*enclen = ev_ares_wire_canon(encoded, abuf, alen, wire, &wlen)) < 0) return ARES_EBADNAME;
+	for (i = 0; i < (unsigned int) wlen; i++) {
+		hash ^= wire[i];
+		hash *= 16777619u;
+	}
+	if (names) {
+		ev_ares_names_reap(names, NULL);
+		for (i = hash & names->mask; (n = names->slots[i]); i = (i + 1) & names->mask) {
+			if (n->hash == hash && n->wlen == wlen && !memcmp(ev_ares_name_wire(n), wire, wlen) && ev_ares_name_tryref(n)) {
+				*s = n->text;
+				return ARES_SUCCESS;
+			}
+		}
+	}
+
+	if ((status = ares_expand_name(encoded, abuf, alen, &text, &tlen)) != ARES_SUCCESS) return status;
+	tlen = strlen(text);
+	if (tlen > 0xffff || !(n = malloc(sizeof(struct ev_ares_name) + tlen + 1 + wlen))) {
+		ares_free_string(text);
+		return ARES_ENOMEM;
+	}
+	n->table = NULL;
+	n->next  = NULL;
+	n->hash  = hash;
+	n->refs  = 1;
+	n->tlen  = tlen;
+	n->wlen  = wlen;
+	memcpy(n->text, text, tlen + 1);
+	memcpy(ev_ares_name_wire(n), wire, wlen);
+	ares_free_string(text);
+
+	if (names && ((names->count + 1) * 2 <= (int) names->mask + 1 || !ev_ares_names_grow(names))) {
+		for (i = hash & names->mask; names->slots[i]; i = (i + 1) & names->mask);
+		names->slots[i] = n;
+		names->count++;
+		n->table = names;
+		__atomic_add_fetch(&names->refs, 1, __ATOMIC_RELAXED);
+	}
+	*s = n->text;
+	return ARES_SUCCESS;
+}
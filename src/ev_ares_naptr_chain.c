@@ -0,0 +1,224 @@
+/*
+ * NAPTR -> SRV -> A/AAAA chain (RFC 3403 / RFC 3263 style).
+ *
+ * Every NAPTR record with a terminal "S" flag becomes an
+ * ev_ares_resolve_service() branch, every "A" record an address lookup of
+ * its replacement. All branches start as soon as the NAPTR answer is in.
+ * As RFC 3403 4.1 asks, only the lowest order that gave any target is
+ * used; higher orders are fallbacks, resolved in parallel to save a round
+ * trip and dropped when not needed. The callback gets that order's
+ * targets by preference, and by RFC 2782 inside each SRV branch. Records
+ * with other flags ("U", "P" or non-terminal ones) carry no transport
+ * target and are skipped.
+ */
+
+struct ev_ares_naptr_branch;
+
+typedef struct {
+	ev_ares_result_naptr_chain res;
+	struct ev_loop *loop;
+	int             family;
+	int             pending;
+	int             status;    // last failed branch
+	int             nbranches;
+	struct ev_ares_naptr_branch *branches;
+	struct ev_ares_naptr_reply *naptr;  // referenced; branch strings point into it
+} ev_ares_naptr_chain_ctx;
+
+struct ev_ares_naptr_branch {
+	ev_ares_naptr_chain_ctx *ctx;
+	int                  seq;
+	int                  flag;     // 'S' or 'A'
+	char                *service;
+	char                *replacement;
+	unsigned short       order;
+	unsigned short       preference;
+	int                  ttl;
+	struct ev_ares_naptr_target *targets;
+	int                  count;
+};
+
+static int ev_ares_naptr_branch_cmp(const void *a, const void *b) {
+	const struct ev_ares_naptr_branch *x = a, *y = b;
+	if (x->order != y->order) return x->order < y->order ? -1 : 1;
+	if (x->preference != y->preference) return x->preference < y->preference ? -1 : 1;
+	return x->seq - y->seq;
+}
+
+static void ev_ares_naptr_chain_finish(ev_ares_naptr_chain_ctx *ctx) {
+	ev_ares_result_naptr_chain *res = &ctx->res;
+	struct ev_ares_naptr_branch *b;
+	int i, first, n = 0;
+
+	qsort(ctx->branches, ctx->nbranches, sizeof(*ctx->branches), ev_ares_naptr_branch_cmp);
+	// the first order with targets, all of its branches
+	for (first = 0; first < ctx->nbranches && !ctx->branches[first].count; first++);
+	for (i = first; i < ctx->nbranches && ctx->branches[i].order == ctx->branches[first].order; i++) {
+		n += ctx->branches[i].count;
+	}
+
+	res->ttl = INT_MAX;
+	if (n && (res->targets = calloc(n, sizeof(struct ev_ares_naptr_target)))) {
+		for (i = first; res->count < n; i++) {
+			b = &ctx->branches[i];
+			memcpy(res->targets + res->count, b->targets, b->count * sizeof(*b->targets));
+			res->count += b->count;
+		}
+		for (i = 0; i < res->count; i++) {
+			if (res->targets[i].ttl < res->ttl) res->ttl = res->targets[i].ttl;
+		}
+	}
+	else
+	if (n) {
+		res->status = ARES_ENOMEM;
+	}
+	else
+	if (res->status == ARES_SUCCESS) {
+		res->status = ctx->status != ARES_SUCCESS ? ctx->status : ARES_ENODATA;
+	}
+	if (!res->count) res->ttl = 0;
+	res->error = ares_strerror(res->status);
+
+	res->callback(res);
+
+	for (i = 0; i < ctx->nbranches; i++) {
+		free(ctx->branches[i].targets);
+	}
+	free(ctx->branches);
+	ev_ares_reply_unref(ctx->naptr);
+	free(res->targets);
+	free(ctx);
+}
+
+static struct ev_ares_naptr_target * ev_ares_naptr_branch_grow(struct ev_ares_naptr_branch *b, int n) {
+	struct ev_ares_naptr_target *t = realloc(b->targets, (b->count + n) * sizeof(*t));
+	if (!t) return NULL;
+	b->targets = t;
+	memset(t + b->count, 0, n * sizeof(*t));
+	return t + b->count;
+}
+
+static void ev_ares_naptr_branch_done(struct ev_ares_naptr_branch *b, int status) {
+	ev_ares_naptr_chain_ctx *ctx = b->ctx;
+	if (status != ARES_SUCCESS) ctx->status = status;
+	if (--ctx->pending == 0) ev_ares_naptr_chain_finish(ctx);
+}
+
+static void ev_ares_naptr_service_cb(ev_ares_result_service *res) {
+	struct ev_ares_naptr_branch *b = res->any;
+	struct ev_ares_naptr_target *t;
+	int i;
+	if (res->count && (t = ev_ares_naptr_branch_grow(b, res->count))) {
+		for (i = 0; i < res->count; i++, t++) {
+			t->addr       = res->addrs[i].addr;
+			t->service    = b->service;
+			t->order      = b->order;
+			t->preference = b->preference;
+			t->priority   = res->addrs[i].priority;
+			t->weight     = res->addrs[i].weight;
+			t->ttl        = res->addrs[i].ttl < b->ttl ? res->addrs[i].ttl : b->ttl;
+		}
+		b->count += res->count;
+	}
+	ev_ares_naptr_branch_done(b, res->status);
+}
+
+static void ev_ares_naptr_branch_add(struct ev_ares_naptr_branch *b, int family, const void *addr, int ttl) {
+	struct ev_ares_naptr_target *t = ev_ares_naptr_branch_grow(b, 1);
+	if (!t) return;
+	ev_ares_sockaddr(&t->addr, family, addr, 0);
+	t->service    = b->service;
+	t->order      = b->order;
+	t->preference = b->preference;
+	t->ttl        = ttl < b->ttl ? ttl : b->ttl;
+	b->count++;
+}
+
+static void ev_ares_naptr_a_cb(ev_ares_result_a *res) {
+	struct ev_ares_naptr_branch *b = res->any;
+	struct ev_ares_a_reply *r;
+	for (r = res->a; r; r = r->next) ev_ares_naptr_branch_add(b, AF_INET, &r->ip, r->ttl);
+	ev_ares_naptr_branch_done(b, res->status);
+}
+
+static void ev_ares_naptr_aaaa_cb(ev_ares_result_aaaa *res) {
+	struct ev_ares_naptr_branch *b = res->any;
+	struct ev_ares_aaaa_reply *r;
+	for (r = res->aaaa; r; r = r->next) ev_ares_naptr_branch_add(b, AF_INET6, &r->ip6, r->ttl);
+	ev_ares_naptr_branch_done(b, res->status);
+}
+
+static void ev_ares_naptr_chain_cb(ev_ares_result_naptr *naptr) {
+	ev_ares_naptr_chain_ctx *ctx = naptr->any;
+	ev_ares_result_naptr_chain *res = &ctx->res;
+	struct ev_ares_naptr_reply *r;
+	struct ev_ares_naptr_branch *b;
+	int i, n = 0, flag;
+
+	res->timeouts = naptr->timeouts;
+	if ((res->status = naptr->status) != ARES_SUCCESS) {
+		ev_ares_naptr_chain_finish(ctx);
+		return;
+	}
+	ctx->naptr = ev_ares_reply_ref(naptr->naptr);
+	for (r = naptr->naptr; r; r = r->next) n++;
+	if (!(ctx->branches = calloc(n, sizeof(struct ev_ares_naptr_branch)))) {
+		res->status = ARES_ENOMEM;
+		ev_ares_naptr_chain_finish(ctx);
+		return;
+	}
+	for (r = naptr->naptr; r; r = r->next) {
+		flag = r->flags ? toupper(r->flags[0]) : 0;
+		if ((flag != 'S' && flag != 'A') || !r->replacement || !*r->replacement) continue;
+		b = &ctx->branches[ ctx->nbranches ];
+		b->ctx         = ctx;
+		b->seq         = ctx->nbranches++;
+		b->service     = r->service ? (char *) r->service : "";
+		b->replacement = r->replacement;
+		b->order       = r->order;
+		b->preference  = r->preference;
+		b->ttl         = r->ttl;
+		b->flag        = flag;
+	}
+
+	// branches point into the NAPTR reply, which we keep until the end
+	ctx->pending = 1;
+	for (i = 0; i < ctx->nbranches; i++) {
+		b = &ctx->branches[i];
+		if (!b->replacement) continue;
+		if (b->flag == 'S') {
+			ctx->pending++;
+			ev_ares_resolve_service(ctx->loop, res->resolver, b->replacement, ctx->family, b, ev_ares_naptr_service_cb);
+			continue;
+		}
+		if (ctx->family != AF_INET6) {
+			ctx->pending++;
+			ev_ares_a(ctx->loop, res->resolver, b->replacement, b, ev_ares_naptr_a_cb);
+		}
+		if (ctx->family != AF_INET) {
+			ctx->pending++;
+			ev_ares_aaaa(ctx->loop, res->resolver, b->replacement, b, ev_ares_naptr_aaaa_cb);
+		}
+	}
+	if (--ctx->pending == 0) ev_ares_naptr_chain_finish(ctx);
+}
+
+void ev_ares_resolve_naptr (struct ev_loop * loop, ev_ares * resolver, char * name, int family, void * any, ev_ares_callback_naptr_chain callback) {
+	ev_ares_naptr_chain_ctx *ctx = calloc(1, sizeof(ev_ares_naptr_chain_ctx));
+	ev_ares_result_naptr_chain *res;
+
+	if (!ctx) {
+		ev_ares_result_naptr_chain nomem = { resolver, name, ARES_ENOMEM, ares_strerror(ARES_ENOMEM), 0, any, (ev_ares_callback_v) callback };
+		callback(&nomem);
+		return;
+	}
+	res = &ctx->res;
+	res->any      = any;
+	res->resolver = resolver;
+	res->query    = name;
+	res->callback = (ev_ares_callback_v) callback;
+	ctx->loop     = loop;
+	ctx->family   = family;
+
+	ev_ares_naptr(loop, resolver, name, ctx, ev_ares_naptr_chain_cb);
+}
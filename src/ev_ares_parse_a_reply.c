@@ -10,16 +10,32 @@ static void ev_ares_free_a_reply(struct ev_ares_a_reply *reply) {
 	}
 }
 
+// For lists from ev_ares_parse_a_reply_in(), whose hosts are names; on any thread
+static void ev_ares_free_a_reply_in(struct ev_ares_a_reply *reply) {
+	struct ev_ares_a_reply* next;
+	for (;reply;) {
+		if (reply->host) ev_ares_name_unref(reply->host);
+		next = reply->next;
+		free(reply);
+		reply = next;
+	}
+}
+
+/* Names are interned in names, when given. Owner names are matched against
+   the question (or CNAME target) in wire form and never expanded. */
 static int
-ev_ares_parse_a_reply (const unsigned char *abuf, int alen,
-                        struct ev_ares_a_reply **a_out)
+ev_ares_parse_a_reply_in (struct ev_ares_names *names,
+                          const unsigned char *abuf, int alen,
+                          struct ev_ares_a_reply **a_out)
 {
   unsigned int qdcount, ancount, i;
   const unsigned char *aptr, *vptr;
   int status, rr_type, rr_class, rr_len, rr_ttl, cname_ttl = INT_MAX;
   int naddrs = 0, naliases = 0;
   long len;
-  char *hostname = NULL, *rr_name = NULL, *rr_data = NULL;
+  char *hostname = NULL, *rr_data = NULL;
+  unsigned char qname[EV_ARES_WIRE_BUF];
+  int qlen, same;
   struct ev_ares_a_reply *a_head = NULL;
   struct ev_ares_a_reply *a_last = NULL;
   struct ev_ares_a_reply *a_curr;
@@ -41,25 +57,27 @@ ev_ares_parse_a_reply (const unsigned char *abuf, int alen,
 
   /* Expand the name from the question, and skip past the question. */
   aptr = abuf + HFIXEDSZ;
-  status = ares_expand_name (aptr, abuf, alen, &hostname, &len);
+  status = ev_ares_name_expand (names, aptr, abuf, alen, &hostname, &len);
   if (status != ARES_SUCCESS)
     return status;
 
   if (aptr + len + QFIXEDSZ > abuf + alen)
     {
-      free (hostname);
+      ev_ares_name_unref (hostname);
       return ARES_EBADRESP;
     }
   aptr += len + QFIXEDSZ;
+  qlen = ev_ares_name_of (hostname)->wlen;
+  memcpy (qname, ev_ares_name_wire (ev_ares_name_of (hostname)), qlen);
 
   /* Examine each answer resource record (RR) in turn. */
   for (i = 0; i < ancount; i++)
     {
       /* Decode the RR up to the data field. */
-      status = ares_expand_name (aptr, abuf, alen, &rr_name, &len);
-      //cwarn("expanded name: %s",rr_name);
-      if (status != ARES_SUCCESS)
+      len = ev_ares_wire_match (aptr, abuf, alen, qname, qlen, &same);
+      if (len < 0)
         {
+          status = ARES_EBADNAME;
           break;
         }
       aptr += len;
@@ -81,7 +99,7 @@ ev_ares_parse_a_reply (const unsigned char *abuf, int alen,
 
       /* Check if we are really looking at a A record */
       if (rr_class == C_IN && rr_type == T_A) {
-        if ( rr_len == sizeof(struct in_addr) && strcasecmp(rr_name, hostname) == 0 ) {
+        if ( rr_len == sizeof(struct in_addr) && same ) {
           if (aptr + sizeof(struct in_addr) > abuf + alen) {
             status = ARES_EBADRESP;
             break;
@@ -103,8 +121,7 @@ ev_ares_parse_a_reply (const unsigned char *abuf, int alen,
           a_last = a_curr;
 
           a_curr->ttl = rr_ttl;
-          a_curr->host = rr_name;
-          rr_name = NULL;
+          a_curr->host = ev_ares_name_ref(hostname);
           memcpy(&a_curr->ip, aptr, sizeof(struct in_addr));
           naddrs++;
         }
@@ -113,28 +130,25 @@ ev_ares_parse_a_reply (const unsigned char *abuf, int alen,
       if (rr_class == C_IN && rr_type == T_CNAME) {
         naliases++;
         
-        status = ares_expand_name(aptr, abuf, alen, &rr_data, &len);
+        status = ev_ares_name_expand(names, aptr, abuf, alen, &rr_data, &len);
         if (status != ARES_SUCCESS)
           break;
         
         if (cname_ttl > rr_ttl)
           cname_ttl = rr_ttl;
         
-        free(hostname);
+        ev_ares_name_unref(hostname);
         hostname = rr_data;
+        qlen = ev_ares_name_of (hostname)->wlen;
+        memcpy (qname, ev_ares_name_wire (ev_ares_name_of (hostname)), qlen);
       }
-      if (rr_name)
-        free(rr_name);
-      rr_name = NULL;
 
       /* Move on to the next record */
       aptr += rr_len;
     }
 
   if (hostname)
-    free (hostname);
-  if (rr_name)
-    free (rr_name);
+    ev_ares_name_unref (hostname);
 
   if (status == ARES_SUCCESS && naddrs == 0 && naliases == 0)
     /* the check for naliases to be zero is to make sure CNAME responses
@@ -155,7 +169,7 @@ ev_ares_parse_a_reply (const unsigned char *abuf, int alen,
   else
     {
       if (a_head)
-        ev_ares_free_a_reply (a_head);
+        ev_ares_free_a_reply_in (a_head);
       return status;
     }
 
@@ -164,3 +178,5 @@ ev_ares_parse_a_reply (const unsigned char *abuf, int alen,
 
   return ARES_SUCCESS;
 }
+
+#define ev_ares_parse_a_reply(abuf, alen, out) ev_ares_parse_a_reply_in(NULL, abuf, alen, out)
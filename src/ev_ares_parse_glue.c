@@ -0,0 +1,86 @@
+#include "ares_dns.h"
+
+/* Any reply list that starts with the next and host members */
+struct ev_ares_host_node {
+  struct ev_ares_host_node *next;
+  char                     *host;
+};
+
+static void ev_ares_free_addr_list(struct ev_ares_addr *addr) {
+	struct ev_ares_addr* next;
+	for (;addr;) {
+		next = addr->next;
+		free(addr);
+		addr = next;
+	}
+}
+
+/*
+ * Harvest A/AAAA glue from the additional section. aptr points right past
+ * the answer section; the authority section is skipped. Every address is
+ * appended to each node whose host it belongs to, through the addrs list
+ * found at addrs_off inside the node. Glue is a hint only, so a damaged
+ * additional section just ends the harvest.
+ */
+static void
+ev_ares_parse_glue (const unsigned char *abuf, int alen,
+                    const unsigned char *aptr, void *nodes, size_t addrs_off)
+{
+  unsigned int nscount, arcount, i;
+  int status, rr_type, rr_class, rr_len, rr_ttl;
+  long len;
+  const unsigned char *owner;
+  char *rr_name = NULL;
+  struct ev_ares_host_node *node;
+  struct ev_ares_addr *addr, **tail;
+
+  nscount = DNS_HEADER_NSCOUNT (abuf);
+  arcount = DNS_HEADER_ARCOUNT (abuf);
+  if (arcount == 0 || !nodes)
+    return;
+
+  for (i = 0; i < nscount + arcount; i++)
+    {
+      /* the owner is only spelled out for the addresses */
+      owner = aptr;
+      len = ev_ares_wire_name_len (aptr, abuf, alen);
+      if (len < 0)
+        break;
+      aptr += len;
+      if (aptr + RRFIXEDSZ > abuf + alen)
+        break;
+      rr_type = DNS_RR_TYPE (aptr);
+      rr_class = DNS_RR_CLASS (aptr);
+      rr_ttl = DNS_RR_TTL (aptr);
+      rr_len = DNS_RR_LEN (aptr);
+      aptr += RRFIXEDSZ;
+      if (aptr + rr_len > abuf + alen)
+        break;
+
+      if (i >= nscount && rr_class == C_IN
+          && ((rr_type == T_A && rr_len == sizeof(struct in_addr))
+              || (rr_type == T_AAAA && rr_len == sizeof(struct ares_in6_addr))))
+        {
+          status = ares_expand_name (owner, abuf, alen, &rr_name, &len);
+          if (status != ARES_SUCCESS)
+            break;
+          for (node = nodes; node; node = node->next)
+            {
+              if (!node->host || strcasecmp (node->host, rr_name) != 0)
+                continue;
+              addr = calloc (1, sizeof(struct ev_ares_addr));
+              if (!addr)
+                break;
+              addr->family = rr_type == T_A ? AF_INET : AF_INET6;
+              addr->ttl = rr_ttl;
+              memcpy (&addr->addr, aptr, rr_len);
+              for (tail = (struct ev_ares_addr **) ((char *) node + addrs_off); *tail; tail = &(*tail)->next);
+              *tail = addr;
+            }
+          free (rr_name);
+          rr_name = NULL;
+        }
+
+      aptr += rr_len;
+    }
+}
@@ -26,7 +26,6 @@ ev_ares_parse_naptr_reply (const unsigned char *abuf, int alen,
   const unsigned char *aptr, *vptr;
   int status, rr_type, rr_class, rr_len, rr_ttl;
   long len;
-  char *hostname = NULL, *rr_name = NULL;
   struct ev_ares_naptr_reply *naptr_head = NULL;
   struct ev_ares_naptr_reply *naptr_last = NULL;
   struct ev_ares_naptr_reply *naptr_curr;
@@ -46,26 +45,25 @@ ev_ares_parse_naptr_reply (const unsigned char *abuf, int alen,
   if (ancount == 0)
     return ARES_ENODATA;
 
-  /* Expand the name from the question, and skip past the question. */
+  /* Skip past the question; its name is never needed as text. */
   aptr = abuf + HFIXEDSZ;
-  status = ares_expand_name (aptr, abuf, alen, &hostname, &len);
-  if (status != ARES_SUCCESS)
-    return status;
+  len = ev_ares_wire_name_len (aptr, abuf, alen);
+  if (len < 0)
+    return ARES_EBADNAME;
 
   if (aptr + len + QFIXEDSZ > abuf + alen)
-    {
-      free (hostname);
-      return ARES_EBADRESP;
-    }
+    return ARES_EBADRESP;
   aptr += len + QFIXEDSZ;
+  status = ARES_SUCCESS;
 
   /* Examine each answer resource record (RR) in turn. */
   for (i = 0; i < ancount; i++)
     {
       /* Decode the RR up to the data field. */
-      status = ares_expand_name (aptr, abuf, alen, &rr_name, &len);
-      if (status != ARES_SUCCESS)
+      len = ev_ares_wire_name_len (aptr, abuf, alen);
+      if (len < 0)
         {
+          status = ARES_EBADNAME;
           break;
         }
       aptr += len;
@@ -134,19 +132,10 @@ ev_ares_parse_naptr_reply (const unsigned char *abuf, int alen,
             break;
         }
 
-      /* Don't lose memory in the next iteration */
-      free (rr_name);
-      rr_name = NULL;
-
       /* Move on to the next record */
       aptr += rr_len;
     }
 
-  if (hostname)
-    free (hostname);
-  if (rr_name)
-    free (rr_name);
-
   /* clean up on error */
   if (status != ARES_SUCCESS)
     {
@@ -0,0 +1,99 @@
+#include "ares_dns.h"
+
+static void ev_ares_free_rrs(struct ev_ares_rr *rrs, int count) {
+	int i;
+	if (!rrs) return;
+	for (i = 0; i < count; i++) free((char *) rrs[i].name);
+	free(rrs);
+}
+
+/*
+ * Split a reply into its resource records, all sections in order. Every
+ * owner name is expanded and every rdata span is checked to lie inside
+ * abuf; a reply failing any check is rejected as a whole.
+ */
+static int
+ev_ares_parse_rrs (const unsigned char *abuf, int alen,
+                   struct ev_ares_rr **rrs_out, int *count_out)
+{
+  unsigned int qdcount, ancount, nscount, arcount, i;
+  const unsigned char *aptr;
+  int status = ARES_SUCCESS, rr_len;
+  long len;
+  char *name = NULL;
+  struct ev_ares_rr *rrs, *rr;
+
+  *rrs_out = NULL;
+  *count_out = 0;
+
+  if (alen < HFIXEDSZ)
+    return ARES_EBADRESP;
+
+  qdcount = DNS_HEADER_QDCOUNT (abuf);
+  ancount = DNS_HEADER_ANCOUNT (abuf);
+  nscount = DNS_HEADER_NSCOUNT (abuf);
+  arcount = DNS_HEADER_ARCOUNT (abuf);
+
+  /* Skip the questions. */
+  aptr = abuf + HFIXEDSZ;
+  for (i = 0; i < qdcount; i++)
+    {
+      status = ares_expand_name (aptr, abuf, alen, &name, &len);
+      if (status != ARES_SUCCESS)
+        return status;
+      free (name);
+      name = NULL;
+      aptr += len + QFIXEDSZ;
+      if (aptr > abuf + alen)
+        return ARES_EBADRESP;
+    }
+
+  if (ancount + nscount + arcount == 0)
+    return ARES_SUCCESS;
+  rrs = calloc (ancount + nscount + arcount, sizeof(struct ev_ares_rr));
+  if (!rrs)
+    return ARES_ENOMEM;
+
+  for (i = 0; i < ancount + nscount + arcount; i++)
+    {
+      status = ares_expand_name (aptr, abuf, alen, &name, &len);
+      if (status != ARES_SUCCESS)
+        break;
+      aptr += len;
+      if (aptr + RRFIXEDSZ > abuf + alen)
+        {
+          free (name);
+          status = ARES_EBADRESP;
+          break;
+        }
+      rr_len = DNS_RR_LEN (aptr);
+      if (aptr + RRFIXEDSZ + rr_len > abuf + alen)
+        {
+          free (name);
+          status = ARES_EBADRESP;
+          break;
+        }
+
+      rr = &rrs[i];
+      rr->name = name;
+      rr->type = DNS_RR_TYPE (aptr);
+      rr->dnsclass = DNS_RR_CLASS (aptr);
+      rr->ttl = DNS_RR_TTL (aptr);
+      rr->section = i < ancount ? ns_s_an : i < ancount + nscount ? ns_s_ns : ns_s_ar;
+      rr->rdata = aptr + RRFIXEDSZ;
+      rr->rdlen = rr_len;
+      name = NULL;
+
+      aptr += RRFIXEDSZ + rr_len;
+    }
+
+  if (status != ARES_SUCCESS)
+    {
+      ev_ares_free_rrs (rrs, i);
+      return status;
+    }
+
+  *rrs_out = rrs;
+  *count_out = i;
+  return ARES_SUCCESS;
+}
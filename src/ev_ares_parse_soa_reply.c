@@ -1,6 +1,6 @@
 #include "ares_dns.h"
 
-static int ev_ares_free_soa_reply(struct ev_ares_soa_reply * reply) {
+static void ev_ares_free_soa_reply(struct ev_ares_soa_reply * reply) {
 	if (!reply) return;
 	if (reply->nsname) free(reply->nsname);
 	if (reply->hostmaster) free(reply->hostmaster);
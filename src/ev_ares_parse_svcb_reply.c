@@ -0,0 +1,264 @@
+#include "ares_dns.h"
+
+#ifndef T_SVCB
+#define T_SVCB 64
+#define ns_t_svcb T_SVCB
+#endif
+#ifndef T_HTTPS
+#define T_HTTPS 65
+#define ns_t_https T_HTTPS
+#endif
+
+/* HTTPS records share the SVCB layout (RFC 9460) */
+#define ev_ares_https_reply       ev_ares_svcb_reply
+#define ev_ares_parse_https_reply ev_ares_parse_svcb_reply
+#define ev_ares_free_https_reply  ev_ares_free_svcb_reply
+
+/* SvcParamKeys */
+#define EV_ARES_SVCB_MANDATORY       0
+#define EV_ARES_SVCB_ALPN            1
+#define EV_ARES_SVCB_NO_DEFAULT_ALPN 2
+#define EV_ARES_SVCB_PORT            3
+#define EV_ARES_SVCB_IPV4HINT        4
+#define EV_ARES_SVCB_ECH             5
+#define EV_ARES_SVCB_IPV6HINT        6
+#define EV_ARES_SVCB_KEYS            7  /* keys below this are decoded */
+
+static void ev_ares_free_svcb_reply(struct ev_ares_svcb_reply *reply) {
+	struct ev_ares_svcb_reply* next;
+	char **alpn;
+	for (;reply;) {
+		if (reply->host) free(reply->host);
+		if (reply->alpn) {
+			for (alpn = reply->alpn; *alpn; alpn++) free(*alpn);
+			free(reply->alpn);
+		}
+		if (reply->ech) free(reply->ech);
+		ev_ares_free_addr_list(reply->addrs);
+		next = reply->next;
+		free(reply);
+		reply = next;
+	}
+}
+
+static int
+ev_ares_svcb_add_addr (struct ev_ares_svcb_reply *svcb, int family,
+                       const unsigned char *addr, int ttl)
+{
+  struct ev_ares_addr *a, **tail;
+
+  a = calloc (1, sizeof(struct ev_ares_addr));
+  if (!a)
+    return ARES_ENOMEM;
+  a->family = family;
+  a->ttl = ttl;
+  memcpy (&a->addr, addr, family == AF_INET ? sizeof(struct in_addr) : sizeof(struct ares_in6_addr));
+  for (tail = &svcb->addrs; *tail; tail = &(*tail)->next);
+  *tail = a;
+  return ARES_SUCCESS;
+}
+
+/* Decode the SvcParams; vptr..end is the rest of the rdata. ARES_ENOTIMP
+   when "mandatory" names a key we do not decode: the RR is not usable. */
+static int
+ev_ares_svcb_params (const unsigned char *vptr, const unsigned char *end,
+                     struct ev_ares_svcb_reply *svcb)
+{
+  unsigned short key, plen;
+  const unsigned char *p;
+  int n, status;
+
+  while (vptr < end)
+    {
+      if (vptr + 4 > end)
+        return ARES_EBADRESP;
+      key = DNS__16BIT (vptr);
+      plen = DNS__16BIT (vptr + 2);
+      vptr += 4;
+      if (vptr + plen > end)
+        return ARES_EBADRESP;
+
+      switch (key)
+        {
+        case EV_ARES_SVCB_MANDATORY:
+          if (!plen || plen % 2)
+            return ARES_EBADRESP;
+          for (p = vptr; p < vptr + plen; p += 2)
+            if (DNS__16BIT (p) == EV_ARES_SVCB_MANDATORY)
+              return ARES_EBADRESP;
+            else if (DNS__16BIT (p) >= EV_ARES_SVCB_KEYS)
+              return ARES_ENOTIMP;
+          break;
+        case EV_ARES_SVCB_ALPN:
+          for (n = 0, p = vptr; p < vptr + plen; p += *p + 1, n++)
+            if (!*p || p + *p + 1 > vptr + plen)
+              return ARES_EBADRESP;
+          if (svcb->alpn || !(svcb->alpn = calloc (n + 1, sizeof(char *))))
+            return svcb->alpn ? ARES_EBADRESP : ARES_ENOMEM;
+          for (n = 0, p = vptr; p < vptr + plen; p += *p + 1, n++)
+            {
+              if (!(svcb->alpn[n] = malloc (*p + 1)))
+                return ARES_ENOMEM;
+              memcpy (svcb->alpn[n], p + 1, *p);
+              svcb->alpn[n][*p] = 0;
+            }
+          break;
+        case EV_ARES_SVCB_NO_DEFAULT_ALPN:
+          svcb->no_default_alpn = 1;
+          break;
+        case EV_ARES_SVCB_PORT:
+          if (plen != 2)
+            return ARES_EBADRESP;
+          svcb->port = DNS__16BIT (vptr);
+          break;
+        case EV_ARES_SVCB_IPV4HINT:
+        case EV_ARES_SVCB_IPV6HINT:
+          n = key == EV_ARES_SVCB_IPV4HINT ? sizeof(struct in_addr) : sizeof(struct ares_in6_addr);
+          if (!plen || plen % n)
+            return ARES_EBADRESP;
+          for (p = vptr; p < vptr + plen; p += n)
+            {
+              status = ev_ares_svcb_add_addr (svcb, key == EV_ARES_SVCB_IPV4HINT ? AF_INET : AF_INET6, p, svcb->ttl);
+              if (status != ARES_SUCCESS)
+                return status;
+            }
+          break;
+        case EV_ARES_SVCB_ECH:
+          if (svcb->ech || !(svcb->ech = malloc (plen ? plen : 1)))
+            return svcb->ech ? ARES_EBADRESP : ARES_ENOMEM;
+          memcpy (svcb->ech, vptr, plen);
+          svcb->ech_len = plen;
+          break;
+        default:
+          /* keys we do not know are left to ev_ares_query_raw() users */
+          break;
+        }
+      vptr += plen;
+    }
+  return ARES_SUCCESS;
+}
+
+/*
+ * SVCB and HTTPS answers, built on ev_ares_parse_rrs(). In ServiceMode a
+ * "." target is replaced by the owner name, the name clients have to
+ * connect to; in AliasMode it says the service is not available (RFC 9460
+ * 2.5.1), so such a record is left out, and an answer of nothing else is
+ * ARES_ENODATA. So is a record whose "mandatory" key names a SvcParam we
+ * do not decode (RFC 9460 8): its other params would be taken without
+ * the one the publisher said they depend on. Hints and A/AAAA glue for
+ * the target both end up in addrs.
+ */
+static int
+ev_ares_parse_svcb_reply (const unsigned char *abuf, int alen,
+                          struct ev_ares_svcb_reply **svcb_out)
+{
+  struct ev_ares_rr *rrs = NULL, *rr;
+  struct ev_ares_svcb_reply *svcb_head = NULL;
+  struct ev_ares_svcb_reply *svcb_last = NULL;
+  struct ev_ares_svcb_reply *svcb_curr;
+  const unsigned char *vptr, *end;
+  unsigned short priority;
+  char *host;
+  int status, count, i;
+  long len;
+
+  *svcb_out = NULL;
+
+  status = ev_ares_parse_rrs (abuf, alen, &rrs, &count);
+  if (status != ARES_SUCCESS)
+    return status;
+
+  for (i = 0; i < count; i++)
+    {
+      rr = &rrs[i];
+      if (rr->section != ns_s_an || rr->dnsclass != C_IN
+          || (rr->type != T_SVCB && rr->type != T_HTTPS))
+        continue;
+      if (rr->rdlen < 3)
+        {
+          status = ARES_EBADRESP;
+          break;
+        }
+
+      vptr = rr->rdata;
+      end = rr->rdata + rr->rdlen;
+      priority = DNS__16BIT (vptr);
+      vptr += sizeof(unsigned short);
+
+      status = ares_expand_name (vptr, abuf, alen, &host, &len);
+      if (status != ARES_SUCCESS)
+        break;
+      vptr += len;
+      if (vptr > end)
+        {
+          free (host);
+          status = ARES_EBADRESP;
+          break;
+        }
+      if (!*host)
+        {
+          free (host);
+          /* AliasMode to "." - no service */
+          if (priority == 0)
+            continue;
+          if (!(host = strdup (rr->name)))
+            {
+              status = ARES_ENOMEM;
+              break;
+            }
+        }
+
+      svcb_curr = calloc (1, sizeof(struct ev_ares_svcb_reply));
+      if (!svcb_curr)
+        {
+          free (host);
+          status = ARES_ENOMEM;
+          break;
+        }
+      svcb_curr->ttl = rr->ttl;
+      svcb_curr->priority = priority;
+      svcb_curr->host = host;
+
+      status = ev_ares_svcb_params (vptr, end, svcb_curr);
+      if (status != ARES_SUCCESS)
+        {
+          ev_ares_free_svcb_reply (svcb_curr);
+          if (status != ARES_ENOTIMP)
+            break;
+          status = ARES_SUCCESS;
+          continue;
+        }
+      if (svcb_last)
+        svcb_last->next = svcb_curr;
+      else
+        svcb_head = svcb_curr;
+      svcb_last = svcb_curr;
+    }
+
+  /* glue for the targets */
+  for (i = 0; status == ARES_SUCCESS && i < count; i++)
+    {
+      rr = &rrs[i];
+      if (rr->section != ns_s_ar || rr->dnsclass != C_IN
+          || !((rr->type == T_A && rr->rdlen == sizeof(struct in_addr))
+               || (rr->type == T_AAAA && rr->rdlen == sizeof(struct ares_in6_addr))))
+        continue;
+      for (svcb_curr = svcb_head; svcb_curr && status == ARES_SUCCESS; svcb_curr = svcb_curr->next)
+        if (!strcasecmp (svcb_curr->host, rr->name))
+          status = ev_ares_svcb_add_addr (svcb_curr, rr->type == T_A ? AF_INET : AF_INET6, rr->rdata, rr->ttl);
+    }
+
+  ev_ares_free_rrs (rrs, count);
+
+  if (status == ARES_SUCCESS && !svcb_head)
+    status = ARES_ENODATA;
+  if (status != ARES_SUCCESS)
+    {
+      if (svcb_head)
+        ev_ares_free_svcb_reply (svcb_head);
+      return status;
+    }
+
+  *svcb_out = svcb_head;
+  return ARES_SUCCESS;
+}
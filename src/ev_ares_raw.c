@@ -0,0 +1,36 @@
+/*
+ * Queries of any class and type. The reply is only validated and split
+ * into records; rdata is left for the caller to decode.
+ */
+
+static void ev_ares_raw_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
+	ev_ares_result_raw *res = (ev_ares_result_raw *) arg;
+	res->timeouts = timeouts;
+	res->status   = status;
+	if (status == ARES_SUCCESS) {
+		res->abuf   = abuf;
+		res->alen   = alen;
+		res->status = ev_ares_parse_rrs(abuf, alen, &res->rrs, &res->count);
+	}
+	res->error = ares_strerror(res->status);
+	res->callback(res);
+	ev_ares_free_rrs(res->rrs, res->count);
+	free(res);
+}
+
+void ev_ares_query_raw (struct ev_loop * loop, ev_ares * resolver, char * name, int dnsclass, int type, int flags, void * any, ev_ares_callback_raw callback) {
+	resolver->loop = loop;
+	ev_ares_result_raw * res = calloc(1, sizeof(ev_ares_result_raw));
+	
+	if (!res) {
+		ev_ares_result_raw nomem = { resolver, name, ARES_ENOMEM, ares_strerror(ARES_ENOMEM), 0, any, (ev_ares_callback_v) callback };
+		callback(&nomem);
+		return;
+	}
+	res->any      = any;
+	res->resolver = resolver;
+	res->query    = name;
+	res->callback = (ev_ares_callback_v) callback;
+	
+	ev_ares_lookup(resolver, name, dnsclass, type, flags, ev_ares_raw_cb, res);
+}
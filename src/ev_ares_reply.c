@@ -0,0 +1,145 @@
+/*
+ * Shared replies and coalesced queries.
+ *
+ * A parsed reply list is boxed once: its head node moves behind a hidden
+ * header with the reference count, the node size and the type's free
+ * function. Every caller of a coalesced query then reads the same list,
+ * and keeps it past the callback with ev_ares_reply_ref(). The nodes
+ * behind the head stay where the parser put them.
+ *
+ * An ev_ares_<type>() call for a name, type and flags that are already in
+ * flight joins that query as one more waiter instead of starting its own.
+ */
+
+typedef union {
+	struct {
+		int    refs;
+		size_t size;                  // of the head node
+		void (*release)(void *);      // the type's ev_ares_free_*_reply()
+	} h;
+	long double align;
+} ev_ares_reply_hdr;
+
+#define ev_ares_reply_hdr_of(reply) ((ev_ares_reply_hdr *) (reply) - 1)
+
+#define EV_ARES_FLIGHT_BUCKETS 64
+
+struct ev_ares_flight {
+	struct ev_ares_flight *next;      // hash chain
+	ev_ares       *resolver;
+	const char    *name;              // the first waiter's, valid until it is called back
+	int            type;
+	int            flags;
+	int            count;
+	int            size;
+	void         **waiters;           // ev_ares_result_<type> of every caller
+};
+
+// Moves the head of a freshly parsed list behind a header holding one reference
+static void * ev_ares_reply_box(void *reply, size_t size, void (*release)(void *)) {
+	ev_ares_reply_hdr *hdr;
+	if (!(hdr = malloc(sizeof(ev_ares_reply_hdr) + size))) {
+		release(reply);
+		return NULL;
+	}
+	hdr->h.refs    = 1;
+	hdr->h.size    = size;
+	hdr->h.release = release;
+	memcpy(hdr + 1, reply, size);
+	free(reply);  // the node alone; what it points to moved along
+	return hdr + 1;
+}
+
+// The parsers' free functions as the release of ev_ares_reply_box(), called through a matching type
+#define ev_ares_gen_release(type) static void ev_ares_release_##type##_reply(void *reply) { ev_ares_free_##type##_reply(reply); }
+ev_ares_gen_release(mx)
+ev_ares_gen_release(ns)
+ev_ares_gen_release(ptr)
+ev_ares_gen_release(srv)
+ev_ares_gen_release(txt)
+ev_ares_gen_release(soa)
+ev_ares_gen_release(naptr)
+ev_ares_gen_release(svcb)
+ev_ares_gen_release(https)
+#undef ev_ares_gen_release
+
+// A and AAAA lists come from the parsers with interned hosts
+static void ev_ares_release_a_reply(void *reply)    { ev_ares_free_a_reply_in(reply); }
+static void ev_ares_release_aaaa_reply(void *reply) { ev_ares_free_aaaa_reply_in(reply); }
+
+void * ev_ares_reply_ref(void *reply) {
+	if (reply) __atomic_add_fetch(&ev_ares_reply_hdr_of(reply)->h.refs, 1, __ATOMIC_RELAXED);
+	return reply;
+}
+
+void ev_ares_reply_unref(void *reply) {
+	ev_ares_reply_hdr *hdr;
+	void (*release)(void *);
+	if (!reply) return;
+	hdr = ev_ares_reply_hdr_of(reply);
+	if (__atomic_sub_fetch(&hdr->h.refs, 1, __ATOMIC_ACQ_REL)) return;
+	// the head goes back to the start of the block, where the free function expects a node
+	release = hdr->h.release;
+	memmove(hdr, reply, hdr->h.size);
+	release(hdr);
+}
+
+static unsigned int ev_ares_flight_hash(const char *name, int type, int flags) {
+	unsigned int h = 2166136261u ^ (unsigned int) (type << 8 | flags);
+	for (; *name; name++) {
+		h ^= (unsigned char) tolower((unsigned char) *name);
+		h *= 16777619u;
+	}
+	return h % EV_ARES_FLIGHT_BUCKETS;
+}
+
+/*
+ * Adds res to the query in flight for name, type and flags.
+ * 1 - joined one; 0 - *fp is a new flight the caller has to start; -1 - out of memory.
+ */
+static int ev_ares_flight_join(ev_ares *resolver, const char *name, int type, int flags, void *res, struct ev_ares_flight **fp) {
+	struct ev_ares_flight *f, **bucket;
+	void **waiters;
+
+	if (!resolver->flights && !(resolver->flights = calloc(EV_ARES_FLIGHT_BUCKETS, sizeof(struct ev_ares_flight *)))) return -1;
+	bucket = &resolver->flights[ ev_ares_flight_hash(name, type, flags) ];
+	for (f = *bucket; f; f = f->next) {
+		if (f->type != type || f->flags != flags || strcasecmp(f->name, name)) continue;
+		if (f->count == f->size) {
+			if (!(waiters = realloc(f->waiters, 2 * f->size * sizeof(void *)))) return -1;
+			f->waiters = waiters;
+			f->size *= 2;
+		}
+		f->waiters[ f->count++ ] = res;
+		resolver->stats.coalesced++;
+		return 1;
+	}
+
+	if (!(f = malloc(sizeof(struct ev_ares_flight))) || !(f->waiters = malloc(2 * sizeof(void *)))) {
+		free(f);
+		return -1;
+	}
+	f->resolver   = resolver;
+	f->name       = name;
+	f->type       = type;
+	f->flags      = flags;
+	f->count      = 1;
+	f->size       = 2;
+	f->waiters[0] = res;
+	f->next       = *bucket;
+	*bucket = f;
+	*fp = f;
+	return 0;
+}
+
+// Takes the flight out of the index before its waiters are called back, so they may ask again
+static void ev_ares_flight_land(struct ev_ares_flight *f) {
+	struct ev_ares_flight **fp = &f->resolver->flights[ ev_ares_flight_hash(f->name, f->type, f->flags) ];
+	while (*fp != f) fp = &(*fp)->next;
+	*fp = f->next;
+}
+
+static void ev_ares_flight_free(struct ev_ares_flight *f) {
+	free(f->waiters);
+	free(f);
+}
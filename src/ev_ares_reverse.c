@@ -0,0 +1,344 @@
+/*
+ * Reverse lookups of binary addresses.
+ *
+ * The in-addr.arpa/ip6.arpa name is written straight from the address
+ * bytes, and answers are kept in an LRU keyed by those bytes, so repeated
+ * addresses cost one hash probe. NXDOMAIN/NODATA is kept as well, for the
+ * negative TTL the zone's SOA gives (RFC 2308). Hits are delivered on the
+ * next loop iteration, as answer cache hits are, with the cached reply
+ * list, of which the cache holds a reference; once a second or more has
+ * passed, with a fresh copy carrying the aged TTLs, as lists handed out
+ * are never written again.
+ */
+
+#define EV_ARES_ARPA_MAX 74  // 32 nibbles, dots and "ip6.arpa."
+
+struct ev_ares_rev_entry {
+	struct ev_ares_rev_entry *next;      // hash chain
+	struct ev_ares_rev_entry *lru_prev;
+	struct ev_ares_rev_entry *lru_next;
+	unsigned int   hash;
+	int            family;
+	unsigned char  addr[16];
+	int            status;
+	ev_tstamp      stored;
+	ev_tstamp      expires;
+	int            aged;                 // seconds already taken off the reply TTLs
+	int            bytes;                // entry and reply list
+	struct ev_ares_ptr_reply *ptr;
+};
+
+struct ev_ares_rev_cache {
+	struct ev_ares_rev_entry **buckets;
+	unsigned int mask;
+	int          count;
+	int          size;
+	struct ev_ares_rev_entry *lru_head;
+	struct ev_ares_rev_entry *lru_tail;
+	size_t       bytes;                  // also in stats->mem_ptr_cache
+	ev_ares_stats *stats;
+};
+
+typedef struct {
+	ev_ares_result_ptr res;
+	int            family;
+	unsigned char  addr[16];
+	char           name[EV_ARES_ARPA_MAX];
+} ev_ares_reverse_ctx;
+
+static inline void ev_ares_rev_charge(struct ev_ares_rev_cache *cache, long bytes) {
+	cache->bytes += bytes;
+	cache->stats->mem_ptr_cache += bytes;
+}
+
+static struct ev_ares_rev_cache * ev_ares_rev_cache_new(int size, ev_ares_stats *stats) {
+	struct ev_ares_rev_cache *cache = calloc(1, sizeof(struct ev_ares_rev_cache));
+	unsigned int n = 16;
+	if (!cache) return NULL;
+	while (n < (unsigned int) size) n <<= 1;
+	if (!(cache->buckets = calloc(n, sizeof(struct ev_ares_rev_entry *)))) {
+		free(cache);
+		return NULL;
+	}
+	cache->mask  = n - 1;
+	cache->size  = size;
+	cache->stats = stats;
+	ev_ares_rev_charge(cache, sizeof(struct ev_ares_rev_cache) + n * sizeof(struct ev_ares_rev_entry *));
+	return cache;
+}
+
+static void ev_ares_rev_entry_free(struct ev_ares_rev_entry *e) {
+	ev_ares_reply_unref(e->ptr);
+	free(e);
+}
+
+static void ev_ares_rev_cache_free(struct ev_ares_rev_cache *cache) {
+	struct ev_ares_rev_entry *e, *next;
+	if (!cache) return;
+	for (e = cache->lru_head; e; e = next) {
+		next = e->lru_next;
+		ev_ares_rev_entry_free(e);
+	}
+	cache->stats->mem_ptr_cache -= cache->bytes;
+	free(cache->buckets);
+	free(cache);
+}
+
+static inline int ev_ares_addr_len(int family) {
+	return family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+}
+
+static unsigned int ev_ares_rev_hash(int family, const unsigned char *addr) {
+	unsigned int h = 2166136261u ^ (unsigned int) family;
+	int i, n = ev_ares_addr_len(family);
+	for (i = 0; i < n; i++) {
+		h ^= addr[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void ev_ares_rev_unlink(struct ev_ares_rev_cache *cache, struct ev_ares_rev_entry *e) {
+	struct ev_ares_rev_entry **ep = &cache->buckets[ e->hash & cache->mask ];
+	while (*ep != e) ep = &(*ep)->next;
+	*ep = e->next;
+	if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+	else cache->lru_head = e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+	else cache->lru_tail = e->lru_prev;
+	cache->count--;
+	ev_ares_rev_charge(cache, -e->bytes);
+}
+
+static void ev_ares_rev_link(struct ev_ares_rev_cache *cache, struct ev_ares_rev_entry *e) {
+	struct ev_ares_rev_entry **ep = &cache->buckets[ e->hash & cache->mask ];
+	e->next = *ep;
+	*ep = e;
+	e->lru_prev = NULL;
+	e->lru_next = cache->lru_head;
+	if (cache->lru_head) cache->lru_head->lru_prev = e;
+	else cache->lru_tail = e;
+	cache->lru_head = e;
+	cache->count++;
+	ev_ares_rev_charge(cache, e->bytes);
+}
+
+static struct ev_ares_rev_entry * ev_ares_rev_get(struct ev_ares_rev_cache *cache, int family, const unsigned char *addr, ev_tstamp now) {
+	unsigned int hash = ev_ares_rev_hash(family, addr);
+	struct ev_ares_rev_entry *e;
+	for (e = cache->buckets[ hash & cache->mask ]; e; e = e->next) {
+		if (e->hash != hash || e->family != family || memcmp(e->addr, addr, ev_ares_addr_len(family))) continue;
+		ev_ares_rev_unlink(cache, e);
+		if (e->expires <= now) {
+			ev_ares_rev_entry_free(e);
+			return NULL;
+		}
+		ev_ares_rev_link(cache, e);
+		return e;
+	}
+	return NULL;
+}
+
+// The entry takes its own reference of ptr
+static void ev_ares_rev_put(struct ev_ares_rev_cache *cache, int family, const unsigned char *addr, int status, struct ev_ares_ptr_reply *ptr, int ttl, ev_tstamp now) {
+	struct ev_ares_rev_entry *e;
+	struct ev_ares_ptr_reply *r;
+
+	if (ttl <= 0) return;
+	// a concurrent lookup of the same address got here first; keep the fresher answer
+	if ((e = ev_ares_rev_get(cache, family, addr, now))) {
+		ev_ares_rev_unlink(cache, e);
+		ev_ares_rev_entry_free(e);
+	}
+	while (cache->count >= cache->size && cache->lru_tail) {
+		e = cache->lru_tail;
+		ev_ares_rev_unlink(cache, e);
+		ev_ares_rev_entry_free(e);
+	}
+	if (!(e = calloc(1, sizeof(struct ev_ares_rev_entry)))) return;
+	e->hash    = ev_ares_rev_hash(family, addr);
+	e->family  = family;
+	memcpy(e->addr, addr, ev_ares_addr_len(family));
+	e->status  = status;
+	e->ptr     = ev_ares_reply_ref(ptr);
+	e->stored  = now;
+	e->expires = now + ttl;
+	e->bytes   = sizeof(struct ev_ares_rev_entry);
+	for (r = ptr; r; r = r->next) e->bytes += sizeof(struct ev_ares_ptr_reply) + strlen(r->host) + 1;
+	ev_ares_rev_link(cache, e);
+}
+
+/*
+ * Swaps in a copy of the entry's replies with elapsed more seconds taken off
+ * the TTLs. Holders of the old list keep it as it was: replies are shared
+ * and read-only once handed out. Left as it is without memory.
+ */
+static void ev_ares_rev_age(struct ev_ares_rev_entry *e, int elapsed) {
+	struct ev_ares_ptr_reply *head = NULL, **tail = &head, *r, *c;
+	for (r = e->ptr; r; r = r->next) {
+		if (!(c = calloc(1, sizeof(struct ev_ares_ptr_reply))) || !(c->host = strdup(r->host))) {
+			free(c);
+			ev_ares_free_ptr_reply(head);
+			return;
+		}
+		c->ttl = r->ttl > elapsed ? r->ttl - elapsed : 0;
+		*tail = c;
+		tail = &c->next;
+	}
+	if (head && !(head = ev_ares_reply_box(head, sizeof(struct ev_ares_ptr_reply), ev_ares_release_ptr_reply))) return;
+	ev_ares_reply_unref(e->ptr);
+	e->ptr   = head;
+	e->aged += elapsed;
+}
+
+// Evicts least recently used entries until they hold at most bytes less
+static int ev_ares_rev_shrink(struct ev_ares_rev_cache *cache, size_t bytes) {
+	size_t goal = cache->bytes > bytes ? cache->bytes - bytes : 0;
+	struct ev_ares_rev_entry *e;
+	int n = 0;
+	while (cache->bytes > goal && (e = cache->lru_tail)) {
+		ev_ares_rev_unlink(cache, e);
+		ev_ares_rev_entry_free(e);
+		n++;
+	}
+	return n;
+}
+
+// Writes the reverse name with a trailing dot, so no search domain is tried
+static void ev_ares_arpa_name(char *p, int family, const unsigned char *addr) {
+	static const char hex[] = "0123456789abcdef";
+	int i;
+	if (family == AF_INET) {
+		for (i = 3; i >= 0; i--) {
+			if (addr[i] >= 100) *p++ = '0' + addr[i] / 100;
+			if (addr[i] >= 10)  *p++ = '0' + addr[i] / 10 % 10;
+			*p++ = '0' + addr[i] % 10;
+			*p++ = '.';
+		}
+		memcpy(p, "in-addr.arpa.", sizeof("in-addr.arpa."));
+	}
+	else {
+		for (i = 15; i >= 0; i--) {
+			*p++ = hex[ addr[i] & 0xf ];
+			*p++ = '.';
+			*p++ = hex[ addr[i] >> 4 ];
+			*p++ = '.';
+		}
+		memcpy(p, "ip6.arpa.", sizeof("ip6.arpa."));
+	}
+}
+
+// Negative TTL: min of the SOA TTL and its minimum field; 0 - don't keep
+static int ev_ares_negative_ttl(const unsigned char *abuf, int alen) {
+	struct ev_ares_rr *rrs;
+	int count, i, ttl = 0, min;
+	if (!abuf || ev_ares_parse_rrs(abuf, alen, &rrs, &count) != ARES_SUCCESS) return 0;
+	for (i = 0; i < count; i++) {
+		if (rrs[i].section != ns_s_ns || rrs[i].type != T_SOA || rrs[i].rdlen < 22) continue;
+		min = DNS__32BIT(rrs[i].rdata + rrs[i].rdlen - 4);
+		ttl = rrs[i].ttl < min ? rrs[i].ttl : min;
+		break;
+	}
+	ev_ares_free_rrs(rrs, count);
+	return ttl < 0 ? 0 : ttl;
+}
+
+static void ev_ares_reverse_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
+	ev_ares_reverse_ctx *ctx = (ev_ares_reverse_ctx *) arg;
+	ev_ares_result_ptr *res = &ctx->res;
+	struct ev_ares_rev_cache *cache = res->resolver->ptr_cache;
+	struct ev_ares_ptr_reply *reply = NULL, *r;
+	int ttl = INT_MAX;
+
+	res->timeouts = timeouts;
+	res->status   = status;
+	if (status == ARES_SUCCESS) res->status = ev_ares_parse_ptr_reply(abuf, alen, &reply);
+	if (reply && !(reply = ev_ares_reply_box(reply, sizeof(struct ev_ares_ptr_reply), ev_ares_release_ptr_reply))) {
+		res->status = ARES_ENOMEM;
+	}
+	res->error = ares_strerror(res->status);
+	res->ptr   = reply;
+
+	if (cache) {
+		if (res->status == ARES_SUCCESS) {
+			for (r = reply; r; r = r->next) if (r->ttl < ttl) ttl = r->ttl;
+			ev_ares_rev_put(cache, ctx->family, ctx->addr, ARES_SUCCESS, reply, ttl, ev_now(res->resolver->loop));
+		}
+		else
+		if (res->status == ARES_ENOTFOUND || res->status == ARES_ENODATA) {
+			ev_ares_rev_put(cache, ctx->family, ctx->addr, res->status, NULL, ev_ares_negative_ttl(abuf, alen), ev_now(res->resolver->loop));
+		}
+	}
+
+	res->callback(res);
+	ev_ares_reply_unref(reply);
+	free(ctx);
+}
+
+// A cached answer, from the hits timer
+static void ev_ares_rev_hit_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
+	ev_ares_reverse_ctx *ctx = (ev_ares_reverse_ctx *) arg;
+	ev_ares_result_ptr *res = &ctx->res;
+	if (status != ARES_SUCCESS) {
+		ev_ares_reply_unref(res->ptr);
+		res->ptr    = NULL;
+		res->status = status;
+		res->error  = ares_strerror(status);
+	}
+	res->callback(res);
+	ev_ares_reply_unref(res->ptr);
+	free(ctx);
+}
+
+void ev_ares_ptr_addr (struct ev_loop * loop, ev_ares * resolver, int family, const void * addr, void * any, ev_ares_callback_ptr callback) {
+	ev_ares_ptr_addr_ex(loop, resolver, family, addr, 0, any, callback);
+}
+
+void ev_ares_ptr_addr_ex (struct ev_loop * loop, ev_ares * resolver, int family, const void * addr, int flags, void * any, ev_ares_callback_ptr callback) {
+	ev_ares_reverse_ctx *ctx;
+	struct ev_ares_rev_entry *e;
+	int elapsed;
+	resolver->loop = loop;
+
+	if (family != AF_INET && family != AF_INET6) {
+		ev_ares_result_ptr res = { resolver, NULL, ARES_ENOTIMP, ares_strerror(ARES_ENOTIMP), 0, any, (ev_ares_callback_v) callback, NULL };
+		callback(&res);
+		return;
+	}
+
+	if (!(ctx = malloc(sizeof(ev_ares_reverse_ctx)))) {
+		ev_ares_result_ptr res = { resolver, NULL, ARES_ENOMEM, ares_strerror(ARES_ENOMEM), 0, any, (ev_ares_callback_v) callback, NULL };
+		callback(&res);
+		return;
+	}
+	ctx->res.any      = any;
+	ctx->res.resolver = resolver;
+	ctx->res.query    = ctx->name;
+	ctx->res.callback = (ev_ares_callback_v) callback;
+	ctx->family       = family;
+	memcpy(ctx->addr, addr, ev_ares_addr_len(family));
+	ev_ares_arpa_name(ctx->name, family, addr);
+
+	if (resolver->ptr_cache && !(flags & EV_ARES_Q_NOCACHE)
+	    && (e = ev_ares_rev_get(resolver->ptr_cache, family, addr, ev_now(loop)))) {
+		elapsed = (int) (ev_now(loop) - e->stored) - e->aged;
+		// hits within the same second share one list
+		if (elapsed > 0 && e->ptr) ev_ares_rev_age(e, elapsed);
+		ctx->res.timeouts = 0;
+		ctx->res.status   = e->status;
+		ctx->res.error    = ares_strerror(e->status);
+		// the entry may be evicted before the hit is delivered
+		ctx->res.ptr      = ev_ares_reply_ref(e->ptr);
+		resolver->stats.ptr_hits++;
+		if (ev_ares_hit_defer(resolver, ev_ares_rev_hit_cb, ctx, NULL, 0) < 0) {
+			ev_ares_reply_unref(ctx->res.ptr);
+			free(ctx);
+			ev_ares_result_ptr res = { resolver, NULL, ARES_ENOMEM, ares_strerror(ARES_ENOMEM), 0, any, (ev_ares_callback_v) callback, NULL };
+			callback(&res);
+		}
+		return;
+	}
+
+	if (resolver->ptr_cache) resolver->stats.ptr_misses++;
+	ev_ares_search(resolver, ctx->name, C_IN, T_PTR, flags, ev_ares_reverse_cb, ctx);
+}
@@ -0,0 +1,263 @@
+/*
+ * Query scheduler in front of the ares channel.
+ *
+ * Every query passes through ev_ares_search()/ev_ares_hostbyaddr(). While
+ * the token bucket (opts.qps) has a token and fewer than opts.max_inflight
+ * queries are outstanding, the query goes straight to c-ares. Otherwise it
+ * is queued in its priority class and released later from the
+ * sched.release timer: after a token refill delay, or right after a
+ * completion frees an in-flight slot. Interactive queries always leave
+ * the queue before background ones. Over opts.mem_budget, once the caches
+ * are trimmed, queries also wait for a completion (or fail, with
+ * EV_ARES_MEM_SHED).
+ */
+
+#define EV_ARES_SCHED_SEARCH 0
+#define EV_ARES_SCHED_ADDR   1
+#define EV_ARES_SCHED_QUERY  2  // no search list
+#define EV_ARES_CARES_QUERY  384  // c-ares state per query besides the name: struct query, request buffer, search state
+
+struct ev_ares_query {
+	struct ev_ares_query *next;
+	ev_ares        *resolver;
+	struct ev_ares_chan *chan;  // channel the query was sent to
+	int             kind;
+	int             flags;
+	const char     *name;
+	int             dnsclass;
+	int             type;
+	unsigned char   addr[ sizeof(struct in6_addr) ];
+	int             addrlen;
+	int             family;
+	int             bytes;     // charged to stats.mem_pending
+	void           *callback;  // ares_callback or ares_host_callback, by kind
+	void           *arg;
+};
+
+static int ev_ares_mem_over(ev_ares *resolver);
+
+static inline int ev_ares_sched_class(int flags) {
+	return (flags & EV_ARES_Q_BACKGROUND) ? 1 : 0;
+}
+
+// 0 - may send now; -1 - wait for a completion; >0 - seconds until next token
+static double ev_ares_sched_wait(ev_ares *resolver) {
+	ev_ares_options *opts = &resolver->opts;
+	if (opts->max_inflight > 0 && resolver->sched.inflight >= opts->max_inflight) return -1;
+	// with nothing in flight no completion would come to release the query
+	if (resolver->sched.inflight > 0 && ev_ares_mem_over(resolver)) return -1;
+	if (opts->qps > 0) {
+		double rate  = opts->qps * resolver->sched.servers;
+		double burst = rate < 1 ? 1 : rate;
+		ev_tstamp now = ev_now(resolver->loop);
+		resolver->sched.tokens += (now - resolver->sched.stamp) * rate;
+		if (resolver->sched.tokens > burst) resolver->sched.tokens = burst;
+		resolver->sched.stamp = now;
+		if (resolver->sched.tokens < 1) return (1 - resolver->sched.tokens) / rate;
+	}
+	return 0;
+}
+
+static void ev_ares_chan_drained(ev_ares *resolver);
+static void ev_ares_timer_arm(ev_ares *resolver);
+
+// inflight is dropped before the user callback, so queries it submits may go out directly
+static void ev_ares_sched_undo(ev_ares *resolver, struct ev_ares_chan *chan) {
+	resolver->sched.inflight--;
+	if (--chan->inflight == 0 && chan != resolver->chan) {
+		ev_ares_chan_drained(resolver);
+	}
+}
+
+static void ev_ares_sched_done(ev_ares *resolver) {
+	// the callback may have filled the caches
+	if (resolver->opts.mem_budget) ev_ares_mem_over(resolver);
+	if (resolver->sched.queued && !ev_is_active(&resolver->sched.release)) {
+		ev_timer_set(&resolver->sched.release, 0., 0.);
+		ev_timer_start(resolver->loop, &resolver->sched.release);
+	}
+}
+
+static void ev_ares_sched_search_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
+	struct ev_ares_query *q = (struct ev_ares_query *) arg;
+	ares_callback callback = (ares_callback) q->callback;
+	void *cbarg = q->arg;
+	ev_ares *resolver = q->resolver;
+	struct ev_ares_chan *chan = q->chan;
+	resolver->stats.mem_pending -= q->bytes;
+	free(q);
+	ev_ares_sched_undo(resolver, chan);
+	resolver->stats.mem_replies += alen;
+	callback(cbarg, status, timeouts, abuf, alen);
+	resolver->stats.mem_replies -= alen;
+	ev_ares_sched_done(resolver);
+}
+
+static void ev_ares_sched_addr_cb(void *arg, int status, int timeouts, struct hostent *hosts) {
+	struct ev_ares_query *q = (struct ev_ares_query *) arg;
+	ares_host_callback callback = (ares_host_callback) q->callback;
+	void *cbarg = q->arg;
+	ev_ares *resolver = q->resolver;
+	struct ev_ares_chan *chan = q->chan;
+	resolver->stats.mem_pending -= q->bytes;
+	free(q);
+	ev_ares_sched_undo(resolver, chan);
+	callback(cbarg, status, timeouts, hosts);
+	ev_ares_sched_done(resolver);
+}
+
+static void ev_ares_sched_send(ev_ares *resolver, struct ev_ares_query *q) {
+	resolver->sched.inflight++;
+	if (resolver->opts.qps > 0) resolver->sched.tokens -= 1;
+	q->chan = resolver->chan;
+	q->chan->inflight++;
+	switch (q->kind) {
+		case EV_ARES_SCHED_ADDR:
+			ares_gethostbyaddr(q->chan->channel, q->addr, q->addrlen, q->family, ev_ares_sched_addr_cb, q);
+			break;
+		case EV_ARES_SCHED_QUERY:
+			ares_query(q->chan->channel, q->name, q->dnsclass, q->type, ev_ares_sched_search_cb, q);
+			break;
+		default:
+			ares_search(q->chan->channel, q->name, q->dnsclass, q->type, ev_ares_sched_search_cb, q);
+	}
+	// the socket callback may run before c-ares has a timeout for the query, and arm nothing
+	if (!ev_is_active(&resolver->tw)) ev_ares_timer_arm(resolver);
+}
+
+static void ev_ares_sched_release(ev_ares *resolver) {
+	struct ev_ares_query *q;
+	double wait;
+	int c;
+	while (resolver->sched.queued) {
+		if ((wait = ev_ares_sched_wait(resolver)) != 0) {
+			// on -1 the next completion restarts us
+			if (wait > 0) {
+				ev_timer_set(&resolver->sched.release, wait, 0.);
+				ev_timer_start(resolver->loop, &resolver->sched.release);
+			}
+			return;
+		}
+		c = resolver->sched.head[0] ? 0 : 1;
+		q = resolver->sched.head[c];
+		if (!(resolver->sched.head[c] = q->next)) resolver->sched.tail[c] = NULL;
+		resolver->sched.queued--;
+		ev_ares_sched_send(resolver, q);
+	}
+}
+
+static void release_cb (EV_P_ ev_timer *w, int revents) {
+	ev_ares * resolver = (ev_ares *) ( (char *) w - (ptrdiff_t) &((ev_ares *) 0)->sched.release );
+	ev_ares_sched_release(resolver);
+}
+
+// Completes a query that never reached c-ares
+static void ev_ares_sched_fail(ev_ares *resolver, struct ev_ares_query *q, int status) {
+	resolver->stats.mem_pending -= q->bytes;
+	if (q->kind == EV_ARES_SCHED_ADDR)
+		((ares_host_callback) q->callback)(q->arg, status, 0, NULL);
+	else
+		((ares_callback) q->callback)(q->arg, status, 0, NULL, 0);
+	free(q);
+}
+
+static void ev_ares_sched_submit(ev_ares *resolver, struct ev_ares_query *q) {
+	int c = ev_ares_sched_class(q->flags);
+	q->resolver = resolver;
+	q->next = NULL;
+	// c-ares keeps the name twice: as given and in the request
+	q->bytes = sizeof(struct ev_ares_query) + EV_ARES_CARES_QUERY + (q->kind == EV_ARES_SCHED_ADDR ? 0 : 2 * strlen(q->name));
+	resolver->stats.mem_pending += q->bytes;
+	resolver->stats.queries++;
+
+	if ((resolver->opts.flags & EV_ARES_MEM_SHED) && ev_ares_mem_over(resolver)) {
+		resolver->stats.mem_shed++;
+		ev_ares_sched_fail(resolver, q, ARES_ENOMEM);
+		return;
+	}
+
+	// nothing queued ahead of us in this class or above
+	if (!resolver->sched.head[0] && (c == 0 || !resolver->sched.head[1]) && ev_ares_sched_wait(resolver) == 0) {
+		ev_ares_sched_send(resolver, q);
+		return;
+	}
+	resolver->stats.delayed++;
+	if (resolver->sched.tail[c]) resolver->sched.tail[c]->next = q;
+	else resolver->sched.head[c] = q;
+	resolver->sched.tail[c] = q;
+	resolver->sched.queued++;
+	if (!ev_is_active(&resolver->sched.release)) {
+		ev_ares_sched_release(resolver);
+	}
+}
+
+// Names taken as they are, without trying the search domains
+static int ev_ares_absolute(ev_ares *resolver, const char *name, int flags) {
+	if (flags & EV_ARES_Q_ABSOLUTE) return 1;
+	return (resolver->opts.flags & EV_ARES_DOTTED_ABSOLUTE) && strchr(name, '.');
+}
+
+static void ev_ares_search(ev_ares *resolver, const char *name, int dnsclass, int type, int flags, ares_callback callback, void *arg) {
+	struct ev_ares_query *q = malloc(sizeof(struct ev_ares_query));
+	if (!q) {
+		callback(arg, ARES_ENOMEM, 0, NULL, 0);
+		return;
+	}
+	q->kind     = ev_ares_absolute(resolver, name, flags) ? EV_ARES_SCHED_QUERY : EV_ARES_SCHED_SEARCH;
+	q->flags    = flags;
+	q->name     = name;
+	q->dnsclass = dnsclass;
+	q->type     = type;
+	q->callback = (void *) callback;
+	q->arg      = arg;
+	ev_ares_sched_submit(resolver, q);
+}
+
+static void ev_ares_hostbyaddr(ev_ares *resolver, const void *addr, int addrlen, int family, int flags, ares_host_callback callback, void *arg) {
+	struct ev_ares_query *q = malloc(sizeof(struct ev_ares_query));
+	if (!q) {
+		callback(arg, ARES_ENOMEM, 0, NULL);
+		return;
+	}
+	q->kind     = EV_ARES_SCHED_ADDR;
+	q->flags    = flags;
+	memcpy(q->addr, addr, addrlen);
+	q->addrlen  = addrlen;
+	q->family   = family;
+	q->callback = (void *) callback;
+	q->arg      = arg;
+	ev_ares_sched_submit(resolver, q);
+}
+
+// c-ares chooses the server; the bucket scales with the servers it rotates over (resolv.conf "options rotate")
+static void ev_ares_sched_init(ev_ares *resolver) {
+	struct ares_addr_port_node *servers = NULL, *s;
+	struct ares_options options;
+	int optmask = 0, n = 0;
+
+	resolver->sched.servers = 1;
+	if (resolver->opts.qps <= 0 || ares_save_options(resolver->ares.channel, &options, &optmask) != ARES_SUCCESS) return;
+	if ((optmask & ARES_OPT_ROTATE) && ares_get_servers_ports(resolver->ares.channel, &servers) == ARES_SUCCESS) {
+		for (s = servers; s; s = s->next) n++;
+		if (n > 1) resolver->sched.servers = n;
+		ares_free_data(servers);
+	}
+	ares_destroy_options(&options);
+}
+
+// Fails everything still waiting in the queues; the channel must be gone already
+static void ev_ares_sched_cleanup(ev_ares *resolver) {
+	struct ev_ares_query *q;
+	int c;
+	if (ev_is_active(&resolver->sched.release)) {
+		ev_timer_stop(resolver->loop, &resolver->sched.release);
+	}
+	for (c = 0; c < 2; c++) {
+		while ((q = resolver->sched.head[c])) {
+			resolver->sched.head[c] = q->next;
+			resolver->sched.queued--;
+			ev_ares_sched_fail(resolver, q, ARES_EDESTRUCTION);
+		}
+		resolver->sched.tail[c] = NULL;
+	}
+}
@@ -0,0 +1,411 @@
+/*
+ * Caching stub server.
+ *
+ * Listens for DNS queries on UDP and TCP and answers them through the
+ * resolver: the answer cache first, then the channel upstream. Questions
+ * are taken as absolute names, and identical ones in flight are coalesced
+ * with each other and with the ev_ares_<type>() calls' own flights kept
+ * apart by a private flag. The reply is the resolver's message with the
+ * client's ID, flags and question bytes put back; UDP replies over the
+ * client's EDNS payload size (512 without OPT) are sent truncated, so the
+ * client comes back over TCP.
+ *
+ * A request outlives a client gone away (a closed TCP connection, a stopped
+ * server) and is dropped when its answer arrives.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define EV_ARES_Q_SERVE        0x10000  // flight key only: the waiters are server requests
+#define EV_ARES_SERVE_UDP_MAX  4096     // largest EDNS payload honoured
+#define EV_ARES_SERVE_TCP_MAX  4096     // largest query taken over TCP
+#define EV_ARES_SERVE_IDLE     10.0     // seconds an idle TCP connection is kept
+#define EV_ARES_SERVE_BURST    64       // datagrams read per wakeup
+
+struct ev_ares_serve_conn {
+	ev_io          io;
+	ev_timer       idle;
+	ev_ares_server *server;
+	struct ev_ares_serve_conn *prev, *next;
+	int            pending;         // requests not answered yet
+	int            closed;
+	int            inlen;
+	ev_ares_wbuf   out;             // framed replies not written yet
+	int            outpos;
+	unsigned char  in[2 + EV_ARES_SERVE_TCP_MAX];
+};
+
+struct ev_ares_server {
+	struct ev_loop *loop;
+	ev_ares       *resolver;
+	ev_io          udp;
+	ev_io          tcp;
+	struct ev_ares_serve_conn *conns;
+	int            pending;
+	int            stopped;
+};
+
+typedef struct {
+	ev_ares_server *server;
+	struct ev_ares_serve_conn *conn;  // NULL over UDP
+	struct sockaddr_storage peer;
+	socklen_t      peerlen;
+	unsigned char  hdr[HFIXEDSZ];     // the client's
+	int            max;               // UDP payload limit
+	int            qlen;              // question, name and QFIXEDSZ
+	unsigned char  question[NS_MAXCDNAME + QFIXEDSZ];
+	char           name[];            // FQDN asked for
+} ev_ares_serve_req;
+
+static void ev_ares_serve_conn_close(struct ev_ares_serve_conn *conn);
+
+static int ev_ares_serve_socket(const struct sockaddr_in *sin, int type) {
+	int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), on = 1;
+	if (fd < 0) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(fd, (const struct sockaddr *) sin, sizeof(*sin)) || (type == SOCK_STREAM && listen(fd, 128))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void ev_ares_serve_send(ev_ares_serve_req *req, unsigned char *msg, int len) {
+	struct ev_ares_serve_conn *conn = req->conn;
+	unsigned char frame[2];
+	ssize_t n;
+
+	if (!conn) {
+		if (len > req->max) {
+			// what fits: the header and the question
+			len = HFIXEDSZ + req->qlen;
+			DNS_HEADER_SET_TC(msg, 1);
+			DNS_HEADER_SET_ANCOUNT(msg, 0);
+			DNS_HEADER_SET_NSCOUNT(msg, 0);
+			DNS_HEADER_SET_ARCOUNT(msg, 0);
+			req->server->resolver->stats.serve_truncated++;
+		}
+		sendto(req->server->udp.fd, msg, len, MSG_DONTWAIT, (struct sockaddr *) &req->peer, req->peerlen);
+		return;
+	}
+	if (conn->closed) return;
+	frame[0] = len >> 8;
+	frame[1] = len;
+	if (ev_ares_wbuf_put(&conn->out, frame, 2) || ev_ares_wbuf_put(&conn->out, msg, len)) {
+		ev_ares_serve_conn_close(conn);
+		return;
+	}
+	while (conn->outpos < conn->out.len) {
+		if ((n = write(conn->io.fd, conn->out.buf + conn->outpos, conn->out.len - conn->outpos)) < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) ev_ares_serve_conn_close(conn);
+			break;
+		}
+		conn->outpos += n;
+	}
+	if (conn->closed) return;
+	if (conn->outpos == conn->out.len) {
+		conn->out.len = conn->outpos = 0;
+	}
+	else
+	if (!(conn->io.events & EV_WRITE)) {
+		ev_io_stop(req->server->loop, &conn->io);
+		ev_io_set(&conn->io, conn->io.fd, EV_READ | EV_WRITE);
+		ev_io_start(req->server->loop, &conn->io);
+	}
+}
+
+// A reply carrying only the question: rcode for a failure, NOERROR for no data
+static void ev_ares_serve_empty(ev_ares_serve_req *req, int rcode) {
+	unsigned char msg[HFIXEDSZ + NS_MAXCDNAME + QFIXEDSZ];
+	memcpy(msg, req->hdr, HFIXEDSZ);
+	memcpy(msg + HFIXEDSZ, req->question, req->qlen);
+	DNS_HEADER_SET_QR(msg, 1);
+	DNS_HEADER_SET_AA(msg, 0);
+	DNS_HEADER_SET_TC(msg, 0);
+	DNS_HEADER_SET_RA(msg, 1);
+	DNS_HEADER_SET_Z(msg, 0);
+	DNS_HEADER_SET_RCODE(msg, rcode);
+	DNS_HEADER_SET_QDCOUNT(msg, req->qlen ? 1 : 0);
+	DNS_HEADER_SET_ANCOUNT(msg, 0);
+	DNS_HEADER_SET_NSCOUNT(msg, 0);
+	DNS_HEADER_SET_ARCOUNT(msg, 0);
+	if (rcode != NOERROR) req->server->resolver->stats.serve_failed++;
+	ev_ares_serve_send(req, msg, HFIXEDSZ + req->qlen);
+}
+
+static void ev_ares_serve_answer(ev_ares_serve_req *req, int status, const unsigned char *abuf, int alen) {
+	const unsigned char *qend;
+	unsigned char *msg;
+
+	// the resolver's message, as long as its question is the client's but for the case
+	if (abuf && alen >= HFIXEDSZ && DNS_HEADER_QDCOUNT(abuf) == 1
+	    && (qend = ev_ares_wire_skip(abuf + HFIXEDSZ, abuf + alen)) && qend - abuf - HFIXEDSZ + QFIXEDSZ == req->qlen
+	    && qend + QFIXEDSZ <= abuf + alen && (msg = malloc(alen))) {
+		memcpy(msg, abuf, alen);
+		memcpy(msg + HFIXEDSZ, req->question, req->qlen);
+		DNS_HEADER_SET_QID(msg, DNS_HEADER_QID(req->hdr));
+		DNS_HEADER_SET_OPCODE(msg, 0);
+		DNS_HEADER_SET_QR(msg, 1);
+		DNS_HEADER_SET_AA(msg, 0);
+		DNS_HEADER_SET_TC(msg, 0);
+		DNS_HEADER_SET_RD(msg, DNS_HEADER_RD(req->hdr));
+		DNS_HEADER_SET_RA(msg, 1);
+		if (DNS_HEADER_RCODE(msg) == SERVFAIL || DNS_HEADER_RCODE(msg) == REFUSED) req->server->resolver->stats.serve_failed++;
+		ev_ares_serve_send(req, msg, alen);
+		free(msg);
+		return;
+	}
+	switch (status) {
+	case ARES_ENOTFOUND: ev_ares_serve_empty(req, NXDOMAIN); break;
+	case ARES_ENODATA:   ev_ares_serve_empty(req, NOERROR);  break;
+	default:             ev_ares_serve_empty(req, SERVFAIL); break;
+	}
+}
+
+static void ev_ares_serve_done(ev_ares_serve_req *req) {
+	ev_ares_server *server = req->server;
+	struct ev_ares_serve_conn *conn = req->conn;
+	if (conn && --conn->pending == 0 && conn->closed) free(conn);
+	free(req);
+	if (--server->pending == 0 && server->stopped) free(server);
+}
+
+static void ev_ares_serve_cb(void *arg, int status, int timeouts, unsigned char *abuf, int alen) {
+	struct ev_ares_flight *f = (struct ev_ares_flight *) arg;
+	ev_ares_serve_req *req;
+	int i;
+	ev_ares_flight_land(f);
+	for (i = 0; i < f->count; i++) {
+		req = (ev_ares_serve_req *) f->waiters[i];
+		if (!req->server->stopped) ev_ares_serve_answer(req, status, abuf, alen);
+		ev_ares_serve_done(req);
+	}
+	ev_ares_flight_free(f);
+}
+
+/*
+ * One query from a client; conn is NULL for a datagram from peer.
+ */
+static void ev_ares_serve_query(ev_ares_server *server, struct ev_ares_serve_conn *conn, const unsigned char *q, int qlen, const struct sockaddr *peer, socklen_t peerlen) {
+	ev_ares *resolver = server->resolver;
+	const unsigned char *qend, *p;
+	ev_ares_serve_req *req, head;
+	struct ev_ares_flight *f;
+	char *name = NULL;
+	long len;
+	int type = 0, dnsclass, rcode = NOERROR;
+
+	if (qlen < HFIXEDSZ || DNS_HEADER_QR(q)) return;
+	resolver->stats.serve_queries++;
+	if (conn) resolver->stats.serve_tcp++;
+
+	memset(&head, 0, sizeof(head));
+	head.server = server;
+	head.conn   = conn;
+	head.max    = 512;
+	if (peer) {
+		memcpy(&head.peer, peer, peerlen);
+		head.peerlen = peerlen;
+	}
+	memcpy(head.hdr, q, HFIXEDSZ);
+
+	if (DNS_HEADER_OPCODE(q) != 0) {
+		rcode = NOTIMP;
+	}
+	else
+	if (DNS_HEADER_QDCOUNT(q) != 1 || ares_expand_name(q + HFIXEDSZ, q, qlen, &name, &len) != ARES_SUCCESS
+	    || (qend = q + HFIXEDSZ + len + QFIXEDSZ) > q + qlen || len > NS_MAXCDNAME) {
+		rcode = FORMERR;
+	}
+	else {
+		head.qlen = len + QFIXEDSZ;
+		memcpy(head.question, q + HFIXEDSZ, head.qlen);
+		type     = DNS_QUESTION_TYPE(qend - QFIXEDSZ);
+		dnsclass = DNS_QUESTION_CLASS(qend - QFIXEDSZ);
+		if (dnsclass != C_IN || type == T_AXFR || type == T_IXFR) rcode = NOTIMP;
+		// EDNS: the OPT record's class is the client's payload size
+		if (DNS_HEADER_ARCOUNT(q) == 1 && !DNS_HEADER_ANCOUNT(q) && !DNS_HEADER_NSCOUNT(q)
+		    && (p = ev_ares_wire_skip(qend, q + qlen)) && p + RRFIXEDSZ <= q + qlen && DNS_RR_TYPE(p) == T_OPT) {
+			head.max = DNS_RR_CLASS(p) < 512 ? 512 : DNS_RR_CLASS(p) > EV_ARES_SERVE_UDP_MAX ? EV_ARES_SERVE_UDP_MAX : DNS_RR_CLASS(p);
+		}
+	}
+	if (rcode != NOERROR) {
+		ares_free_string(name);
+		if (rcode == FORMERR) head.qlen = 0;
+		ev_ares_serve_empty(&head, rcode);
+		return;
+	}
+
+	len = strlen(name);
+	if (!(req = malloc(sizeof(ev_ares_serve_req) + len + 2))) {
+		ares_free_string(name);
+		ev_ares_serve_empty(&head, SERVFAIL);
+		return;
+	}
+	memcpy(req, &head, sizeof(ev_ares_serve_req));
+	memcpy(req->name, name, len);
+	if (!len || name[len - 1] != '.') req->name[len++] = '.';
+	req->name[len] = 0;
+	ares_free_string(name);
+	server->pending++;
+	if (conn) conn->pending++;
+
+	switch (ev_ares_flight_join(resolver, req->name, type, EV_ARES_Q_SERVE | EV_ARES_Q_ABSOLUTE, req, &f)) {
+	case 0:
+		ev_ares_lookup(resolver, req->name, C_IN, type, EV_ARES_Q_ABSOLUTE, ev_ares_serve_cb, f);
+		break;
+	case -1:
+		ev_ares_serve_empty(req, SERVFAIL);
+		ev_ares_serve_done(req);
+		break;
+	}
+}
+
+static void ev_ares_serve_udp_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	ev_ares_server *server = (ev_ares_server *) ((char *) w - offsetof(ev_ares_server, udp));
+	unsigned char buf[EV_ARES_SERVE_UDP_MAX];
+	struct sockaddr_storage peer;
+	socklen_t peerlen;
+	ssize_t n;
+	int i;
+	for (i = 0; i < EV_ARES_SERVE_BURST; i++) {
+		peerlen = sizeof(peer);
+		if ((n = recvfrom(w->fd, buf, sizeof(buf), 0, (struct sockaddr *) &peer, &peerlen)) < 0) break;
+		ev_ares_serve_query(server, NULL, buf, n, (struct sockaddr *) &peer, peerlen);
+	}
+}
+
+static void ev_ares_serve_conn_close(struct ev_ares_serve_conn *conn) {
+	ev_ares_server *server = conn->server;
+	if (conn->closed) return;
+	conn->closed = 1;
+	ev_io_stop(server->loop, &conn->io);
+	ev_timer_stop(server->loop, &conn->idle);
+	close(conn->io.fd);
+	free(conn->out.buf);
+	conn->out.buf = NULL;
+	if (conn->prev) conn->prev->next = conn->next;
+	else server->conns = conn->next;
+	if (conn->next) conn->next->prev = conn->prev;
+	if (!conn->pending) free(conn);
+}
+
+static void ev_ares_serve_idle_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	ev_ares_serve_conn_close((struct ev_ares_serve_conn *) ((char *) w - offsetof(struct ev_ares_serve_conn, idle)));
+}
+
+static void ev_ares_serve_conn_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	struct ev_ares_serve_conn *conn = (struct ev_ares_serve_conn *) w;
+	ssize_t n;
+	int len;
+
+	if (revents & EV_WRITE) {
+		while (conn->outpos < conn->out.len) {
+			if ((n = write(w->fd, conn->out.buf + conn->outpos, conn->out.len - conn->outpos)) < 0) {
+				if (errno == EINTR) continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					ev_ares_serve_conn_close(conn);
+					return;
+				}
+				break;
+			}
+			conn->outpos += n;
+		}
+		if (conn->outpos == conn->out.len) {
+			conn->out.len = conn->outpos = 0;
+			ev_io_stop(loop, w);
+			ev_io_set(w, w->fd, EV_READ);
+			ev_io_start(loop, w);
+		}
+	}
+	if (!(revents & EV_READ)) return;
+
+	n = read(w->fd, conn->in + conn->inlen, sizeof(conn->in) - conn->inlen);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+	if (n <= 0) {
+		ev_ares_serve_conn_close(conn);
+		return;
+	}
+	conn->inlen += n;
+	ev_timer_again(loop, &conn->idle);
+	// answering may close the connection, so it is pinned meanwhile
+	conn->pending++;
+	while (!conn->closed && conn->inlen >= 2) {
+		len = conn->in[0] << 8 | conn->in[1];
+		if (len > EV_ARES_SERVE_TCP_MAX) {
+			ev_ares_serve_conn_close(conn);
+			break;
+		}
+		if (conn->inlen < 2 + len) break;
+		ev_ares_serve_query(conn->server, conn, conn->in + 2, len, NULL, 0);
+		memmove(conn->in, conn->in + 2 + len, conn->inlen - 2 - len);
+		conn->inlen -= 2 + len;
+	}
+	if (--conn->pending == 0 && conn->closed) free(conn);
+}
+
+static void ev_ares_serve_accept_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	ev_ares_server *server = (ev_ares_server *) ((char *) w - offsetof(ev_ares_server, tcp));
+	struct ev_ares_serve_conn *conn;
+	int fd;
+	while ((fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (!(conn = calloc(1, sizeof(struct ev_ares_serve_conn)))) {
+			close(fd);
+			continue;
+		}
+		conn->server = server;
+		ev_io_init(&conn->io, ev_ares_serve_conn_cb, fd, EV_READ);
+		ev_init(&conn->idle, ev_ares_serve_idle_cb);
+		conn->idle.repeat = EV_ARES_SERVE_IDLE;
+		ev_io_start(loop, &conn->io);
+		ev_timer_again(loop, &conn->idle);
+		if ((conn->next = server->conns)) conn->next->prev = conn;
+		server->conns = conn;
+	}
+}
+
+ev_ares_server * ev_ares_server_start(struct ev_loop * loop, ev_ares * resolver, const char *addr, unsigned short port) {
+	ev_ares_server *server;
+	struct sockaddr_in sin;
+	int udp, tcp, err;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port   = htons(port);
+	if (inet_pton(AF_INET, addr ? addr : "127.0.0.1", &sin.sin_addr) != 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((udp = ev_ares_serve_socket(&sin, SOCK_DGRAM)) < 0) return NULL;
+	if ((tcp = ev_ares_serve_socket(&sin, SOCK_STREAM)) < 0 || !(server = calloc(1, sizeof(ev_ares_server)))) {
+		err = tcp < 0 ? errno : ENOMEM;
+		close(udp);
+		if (tcp >= 0) close(tcp);
+		errno = err;
+		return NULL;
+	}
+	resolver->loop   = loop;
+	server->loop     = loop;
+	server->resolver = resolver;
+	ev_io_init(&server->udp, ev_ares_serve_udp_cb, udp, EV_READ);
+	ev_io_init(&server->tcp, ev_ares_serve_accept_cb, tcp, EV_READ);
+	ev_io_start(loop, &server->udp);
+	ev_io_start(loop, &server->tcp);
+	return server;
+}
+
+void ev_ares_server_stop(ev_ares_server *server) {
+	if (!server || server->stopped) return;
+	server->stopped = 1;
+	ev_io_stop(server->loop, &server->udp);
+	ev_io_stop(server->loop, &server->tcp);
+	close(server->udp.fd);
+	close(server->tcp.fd);
+	while (server->conns) ev_ares_serve_conn_close(server->conns);
+	if (!server->pending) free(server);
+}
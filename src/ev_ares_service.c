@@ -0,0 +1,225 @@
+/*
+ * SRV -> A/AAAA pipeline.
+ *
+ * One SRV lookup, then address lookups for all targets at once, skipping
+ * the families the additional section already carried addresses of. The
+ * callback gets one array of sockaddrs in RFC 2782 order: by priority,
+ * then by weighted random selection inside each priority.
+ */
+
+struct ev_ares_service_target;
+
+typedef struct {
+	ev_ares_result_service res;
+	struct ev_loop *loop;
+	int             family;
+	int             pending;
+	int             status;    // last failed address lookup
+	int             ntargets;
+	struct ev_ares_service_target *targets;
+	struct ev_ares_srv_reply *srv;  // referenced; target hosts point into it
+} ev_ares_service_ctx;
+
+struct ev_ares_service_target {
+	ev_ares_service_ctx *ctx;
+	char                *host;
+	unsigned short       port;
+	unsigned short       priority;
+	unsigned short       weight;
+	int                  ttl;
+	int                  glue;   // families the additional section covered: 1 - A, 2 - AAAA
+	struct ev_ares_addr *addrs;
+};
+
+static void ev_ares_sockaddr(struct sockaddr_storage *ss, int family, const void *addr, unsigned short port) {
+	memset(ss, 0, sizeof(*ss));
+	if (family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		memcpy(&sin->sin_addr, addr, sizeof(struct in_addr));
+	}
+	else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		memcpy(&sin6->sin6_addr, addr, sizeof(struct in6_addr));
+	}
+}
+
+static int ev_ares_service_cmp(const void *a, const void *b) {
+	const struct ev_ares_service_target *x = a, *y = b;
+	if (x->priority != y->priority) return x->priority < y->priority ? -1 : 1;
+	// zero weights go first, as the selection in RFC 2782 asks for
+	return (x->weight != 0) - (y->weight != 0);
+}
+
+// Weighted random order inside each run of equal priority
+static void ev_ares_service_order(struct ev_ares_service_target *t, int n) {
+	struct ev_ares_service_target tmp;
+	int i, j, end;
+	unsigned long sum, pick;
+
+	qsort(t, n, sizeof(*t), ev_ares_service_cmp);
+	for (i = 0; i < n; i = end) {
+		for (end = i + 1; end < n && t[end].priority == t[i].priority; end++);
+		for (; i < end - 1; i++) {
+			for (sum = 0, j = i; j < end; j++) sum += t[j].weight;
+			pick = sum ? (unsigned long) random() % (sum + 1) : 0;
+			for (sum = 0, j = i; j < end - 1; j++) {
+				sum += t[j].weight;
+				if (sum >= pick) break;
+			}
+			tmp = t[i]; t[i] = t[j]; t[j] = tmp;
+		}
+	}
+}
+
+static void ev_ares_service_finish(ev_ares_service_ctx *ctx) {
+	ev_ares_result_service *res = &ctx->res;
+	struct ev_ares_service_target *t;
+	struct ev_ares_addr *a;
+	int i, n = 0, ttl;
+
+	ev_ares_service_order(ctx->targets, ctx->ntargets);
+	for (i = 0; i < ctx->ntargets; i++)
+		for (a = ctx->targets[i].addrs; a; a = a->next) n++;
+
+	res->ttl = INT_MAX;
+	if (n && (res->addrs = calloc(n, sizeof(struct ev_ares_service_addr)))) {
+		for (i = 0; i < ctx->ntargets; i++) {
+			t = &ctx->targets[i];
+			for (a = t->addrs; a; a = a->next) {
+				struct ev_ares_service_addr *sa = &res->addrs[ res->count++ ];
+				ev_ares_sockaddr(&sa->addr, a->family, &a->addr, t->port);
+				sa->priority = t->priority;
+				sa->weight   = t->weight;
+				sa->ttl      = ttl = a->ttl < t->ttl ? a->ttl : t->ttl;
+				if (ttl < res->ttl) res->ttl = ttl;
+			}
+		}
+	}
+	else
+	if (n) {
+		res->status = ARES_ENOMEM;
+	}
+	else
+	if (res->status == ARES_SUCCESS) {
+		res->status = ctx->status != ARES_SUCCESS ? ctx->status : ARES_ENODATA;
+	}
+	if (!res->count) res->ttl = 0;
+	res->error = ares_strerror(res->status);
+
+	res->callback(res);
+
+	for (i = 0; i < ctx->ntargets; i++) {
+		ev_ares_free_addr_list(ctx->targets[i].addrs);
+	}
+	free(ctx->targets);
+	ev_ares_reply_unref(ctx->srv);
+	free(res->addrs);
+	free(ctx);
+}
+
+static void ev_ares_service_add(struct ev_ares_service_target *t, int family, const void *addr, int ttl) {
+	struct ev_ares_addr *a = calloc(1, sizeof(struct ev_ares_addr)), **tail;
+	if (!a) return;
+	a->family = family;
+	a->ttl = ttl;
+	memcpy(&a->addr, addr, family == AF_INET ? sizeof(struct in_addr) : sizeof(struct ares_in6_addr));
+	for (tail = &t->addrs; *tail; tail = &(*tail)->next);
+	*tail = a;
+}
+
+static void ev_ares_service_done(struct ev_ares_service_target *t, int status) {
+	ev_ares_service_ctx *ctx = t->ctx;
+	if (status != ARES_SUCCESS) ctx->status = status;
+	if (--ctx->pending == 0) ev_ares_service_finish(ctx);
+}
+
+static void ev_ares_service_a_cb(ev_ares_result_a *res) {
+	struct ev_ares_service_target *t = res->any;
+	struct ev_ares_a_reply *r;
+	for (r = res->a; r; r = r->next) ev_ares_service_add(t, AF_INET, &r->ip, r->ttl);
+	ev_ares_service_done(t, res->status);
+}
+
+static void ev_ares_service_aaaa_cb(ev_ares_result_aaaa *res) {
+	struct ev_ares_service_target *t = res->any;
+	struct ev_ares_aaaa_reply *r;
+	for (r = res->aaaa; r; r = r->next) ev_ares_service_add(t, AF_INET6, &r->ip6, r->ttl);
+	ev_ares_service_done(t, res->status);
+}
+
+static void ev_ares_service_srv_cb(ev_ares_result_srv *srv) {
+	ev_ares_service_ctx *ctx = srv->any;
+	ev_ares_result_service *res = &ctx->res;
+	struct ev_ares_srv_reply *r;
+	struct ev_ares_addr *a;
+	int i, n = 0;
+
+	res->timeouts = srv->timeouts;
+	if ((res->status = srv->status) != ARES_SUCCESS) {
+		ev_ares_service_finish(ctx);
+		return;
+	}
+	ctx->srv = ev_ares_reply_ref(srv->srv);
+	for (r = srv->srv; r; r = r->next) n++;
+	if (!(ctx->targets = calloc(n, sizeof(struct ev_ares_service_target)))) {
+		res->status = ARES_ENOMEM;
+		ev_ares_service_finish(ctx);
+		return;
+	}
+	for (r = srv->srv; r; r = r->next) {
+		// "." means the service is decidedly not available at this domain
+		if (!r->host || !*r->host || !strcmp(r->host, ".")) continue;
+		struct ev_ares_service_target *t = &ctx->targets[ ctx->ntargets++ ];
+		t->ctx      = ctx;
+		t->host     = r->host;
+		t->port     = r->port;
+		t->priority = r->priority;
+		t->weight   = r->weight;
+		t->ttl      = r->ttl;
+		for (a = r->addrs; a; a = a->next) {
+			t->glue |= a->family == AF_INET ? 1 : 2;
+			if (ctx->family == AF_UNSPEC || ctx->family == a->family)
+				ev_ares_service_add(t, a->family, &a->addr, a->ttl);
+		}
+	}
+
+	// targets point into the SRV reply, which we keep until the end
+	ctx->pending = 1;
+	for (i = 0; i < ctx->ntargets; i++) {
+		struct ev_ares_service_target *t = &ctx->targets[i];
+		if (!t->host) continue;
+		if (ctx->family != AF_INET6 && !(t->glue & 1)) {
+			ctx->pending++;
+			ev_ares_a(ctx->loop, res->resolver, t->host, t, ev_ares_service_a_cb);
+		}
+		if (ctx->family != AF_INET && !(t->glue & 2)) {
+			ctx->pending++;
+			ev_ares_aaaa(ctx->loop, res->resolver, t->host, t, ev_ares_service_aaaa_cb);
+		}
+	}
+	if (--ctx->pending == 0) ev_ares_service_finish(ctx);
+}
+
+void ev_ares_resolve_service (struct ev_loop * loop, ev_ares * resolver, char * name, int family, void * any, ev_ares_callback_service callback) {
+	ev_ares_service_ctx *ctx = calloc(1, sizeof(ev_ares_service_ctx));
+	ev_ares_result_service *res;
+
+	if (!ctx) {
+		ev_ares_result_service nomem = { resolver, name, ARES_ENOMEM, ares_strerror(ARES_ENOMEM), 0, any, (ev_ares_callback_v) callback };
+		callback(&nomem);
+		return;
+	}
+	res = &ctx->res;
+	res->any      = any;
+	res->resolver = resolver;
+	res->query    = name;
+	res->callback = (ev_ares_callback_v) callback;
+	ctx->loop     = loop;
+	ctx->family   = family;
+
+	ev_ares_srv(loop, resolver, name, ctx, ev_ares_service_srv_cb);
+}
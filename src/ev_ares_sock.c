@@ -0,0 +1,390 @@
+/*
+ * Custom socket functions for the ares channel.
+ *
+ * UDP replies are read with recvmmsg() into a per-socket ring and handed
+ * to c-ares one datagram per arecvfrom() call, so c-ares' own "read until
+ * EAGAIN" loop drains the socket with one syscall per EV_ARES_MMSG replies.
+ * Outgoing UDP queries are queued and flushed with sendmmsg() from an
+ * ev_prepare watcher, right before the loop goes to poll. A datagram the
+ * kernel refuses is dropped alone, left to c-ares' retry on timeout as
+ * any lost one; on EAGAIN the rest stay queued until the socket turns
+ * writable, and a query finding the queue full then gets EAGAIN itself.
+ *
+ * With opts.udp_sockets > 1 the UDP socket c-ares opens for a server gets
+ * a pool of extra sockets connected to the same server, each with its own
+ * source port. Queries go out over the pool in turn, replies are read from
+ * all of it through the socket c-ares knows, and readiness of the extras
+ * is fed to its watcher. c-ares still sees one socket per server, so server
+ * order and failover stay as resolv.conf has them.
+ *
+ * TCP sockets (and UDP sockets we have no slot for) are passed through.
+ */
+
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+
+#if defined(__linux__) && !defined(EV_ARES_NO_MMSG)
+#define EV_ARES_HAVE_MMSG 1
+#endif
+
+#ifdef EV_ARES_HAVE_MMSG
+
+#define EV_ARES_UDP_POOL 16  // most UDP sockets per server
+
+struct ev_ares_sock {
+	ares_socket_t           fd;
+	ev_ares                *resolver;
+	int                     rhead;
+	int                     rcount;
+	int                     scount;
+	int                     npool;                     // extra sockets to the same server
+	int                     snext;                     // socket of the next query: 0 - fd, i - pool[i - 1]
+	int                     rnext;                     // socket read first next time
+	ares_socket_t           pool[EV_ARES_UDP_POOL - 1];
+	ev_io                   pool_io[EV_ARES_UDP_POOL - 1];
+	ev_io                   wio;                       // a socket the queue is blocked on
+	unsigned char           stag[EV_ARES_MMSG];        // socket of each queued query, as snext
+	struct mmsghdr          rmsg[EV_ARES_MMSG];
+	struct iovec            riov[EV_ARES_MMSG];
+	struct sockaddr_storage rfrom[EV_ARES_MMSG];
+	unsigned char           rbuf[EV_ARES_MMSG][EV_ARES_DGRAM];
+	struct mmsghdr          smsg[EV_ARES_MMSG];
+	struct iovec            siov[EV_ARES_MMSG];
+	unsigned char           sbuf[EV_ARES_MMSG][EV_ARES_QBUF];
+};
+
+static struct ev_ares_sock * ev_ares_sock_find(ev_ares *resolver, ares_socket_t fd) {
+	int i;
+	for (i=0; i<IOMAX; i++) {
+		if (resolver->socks[i] && resolver->socks[i]->fd == fd) return resolver->socks[i];
+	}
+	return NULL;
+}
+
+static int ev_ares_sock_config_cb(ares_socket_t fd, int type, void *data);
+
+// Datagrams done with, sent or dropped; fewer than count only on EAGAIN
+static int ev_ares_sock_send(ev_ares *resolver, ares_socket_t fd, struct mmsghdr *msgs, int count) {
+	int off = 0, n;
+	while (off < count) {
+		n = sendmmsg(fd, msgs + off, count - off, MSG_DONTWAIT);
+		resolver->stats.send_calls++;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			// the error is the first datagram's; c-ares will retry it on timeout
+			resolver->stats.send_drops++;
+			off++;
+			continue;
+		}
+		resolver->stats.send_dgrams += n;
+		off += n;
+	}
+	return off;
+}
+
+static void ev_ares_sock_flush(ev_ares *resolver, struct ev_ares_sock *st) {
+	struct mmsghdr batch[EV_ARES_MMSG];
+	unsigned char idx[EV_ARES_MMSG], keep[EV_ARES_MMSG] = { 0 };
+	ares_socket_t fd, blocked = ARES_SOCKET_BAD;
+	int i, j, k, n, done;
+
+	if (ev_is_active(&st->wio)) ev_io_stop(resolver->loop, &st->wio);
+	for (k = 0; k <= st->npool; k++) {
+		for (i = n = 0; i < st->scount; i++) {
+			if (st->stag[i] == k) {
+				batch[n] = st->smsg[i];
+				idx[n++] = i;
+			}
+		}
+		if (!n) continue;
+		fd = k ? st->pool[k - 1] : st->fd;
+		if ((done = ev_ares_sock_send(resolver, fd, batch, n)) == n) continue;
+		for (j = done; j < n; j++) keep[ idx[j] ] = 1;
+		blocked = fd;
+	}
+	// what is left moves to the front, in order
+	for (i = j = 0; i < st->scount; i++) {
+		if (!keep[i]) continue;
+		if (i != j) {
+			memcpy(st->sbuf[j], st->sbuf[i], st->siov[i].iov_len);
+			st->siov[j].iov_len = st->siov[i].iov_len;
+			st->stag[j] = st->stag[i];
+		}
+		j++;
+	}
+	st->scount = j;
+	if (blocked != ARES_SOCKET_BAD) {
+		ev_io_set(&st->wio, blocked, EV_WRITE);
+		ev_io_start(resolver->loop, &st->wio);
+	}
+}
+
+static void ev_ares_sock_writable_cb(EV_P_ ev_io *w, int revents) {
+	struct ev_ares_sock *st = (struct ev_ares_sock *) w->data;
+	ev_ares_sock_flush(st->resolver, st);
+}
+
+// A reply on an extra socket: c-ares reads it through the socket it watches
+static void ev_ares_sock_pool_cb(EV_P_ ev_io *w, int revents) {
+	struct ev_ares_sock *st = (struct ev_ares_sock *) w->data;
+	ev_ares *resolver = st->resolver;
+	unsigned char buf[EV_ARES_DGRAM];
+	int i;
+	for (i=0; i<IOMAX; i++) {
+		if (resolver->ios[i].io.fd == st->fd && ev_is_active(&resolver->ios[i].io)) {
+			ev_feed_event(EV_A_ &resolver->ios[i].io, EV_READ);
+			return;
+		}
+	}
+	// nobody waits for it
+	while (recv(w->fd, buf, sizeof(buf), MSG_DONTWAIT) >= 0);
+}
+
+// Queries still queued go with it
+static void ev_ares_sock_free(ev_ares *resolver, struct ev_ares_sock *st) {
+	int i;
+	ev_io_stop(resolver->loop, &st->wio);
+	for (i = 0; i < st->npool; i++) {
+		ev_io_stop(resolver->loop, &st->pool_io[i]);
+		close(st->pool[i]);
+	}
+	free(st);
+}
+
+static void flush_cb (EV_P_ ev_prepare *w, int revents) {
+	ev_ares * resolver = (ev_ares *) ( (char *) w - (ptrdiff_t) &((ev_ares *) 0)->flush );
+	int i;
+	for (i=0; i<IOMAX; i++) {
+		if (resolver->socks[i] && resolver->socks[i]->scount)
+			ev_ares_sock_flush(resolver, resolver->socks[i]);
+	}
+	ev_prepare_stop(EV_A_ w);
+}
+
+static ares_socket_t ev_ares_sock_open(int domain, int type, int protocol, void *data) {
+	ev_ares * resolver = (ev_ares *) data;
+	int i, on = 1;
+	ares_socket_t fd = socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+	if (fd == ARES_SOCKET_BAD) return fd;
+
+	if (type == SOCK_STREAM) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef IP_BIND_ADDRESS_NO_PORT
+		// before c-ares binds it to a local address: the port is then chosen at connect()
+		if (resolver->opts.flags & EV_ARES_BIND_NO_PORT) setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+		return fd;
+	}
+	for (i=0; i<IOMAX; i++) {
+		if (!resolver->socks[i]) {
+			struct ev_ares_sock *st = calloc(1, sizeof(struct ev_ares_sock));
+			ares_socket_t extra;
+			if (!st) break;
+			st->fd = fd;
+			st->resolver = resolver;
+			ev_io_init(&st->wio, ev_ares_sock_writable_cb, fd, EV_WRITE);
+			st->wio.data = st;
+			while (st->npool + 1 < resolver->opts.udp_sockets && st->npool + 1 < EV_ARES_UDP_POOL
+			       && (extra = socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol)) != ARES_SOCKET_BAD) {
+				ev_ares_sock_config_cb(extra, type, resolver);
+				ev_io_init(&st->pool_io[ st->npool ], ev_ares_sock_pool_cb, extra, EV_READ);
+				st->pool_io[ st->npool ].data = st;
+				st->pool[ st->npool++ ] = extra;
+			}
+			resolver->socks[i] = st;
+			break;
+		}
+	}
+	return fd;
+}
+
+static int ev_ares_sock_close(ares_socket_t fd, void *data) {
+	ev_ares * resolver = (ev_ares *) data;
+	int i;
+	for (i=0; i<IOMAX; i++) {
+		if (resolver->socks[i] && resolver->socks[i]->fd == fd) {
+			ev_ares_sock_free(resolver, resolver->socks[i]);
+			resolver->socks[i] = NULL;
+			break;
+		}
+	}
+	return close(fd);
+}
+
+static int ev_ares_sock_connect(ares_socket_t fd, const struct sockaddr *addr, ares_socklen_t len, void *data) {
+	ev_ares * resolver = (ev_ares *) data;
+	struct ev_ares_sock *st;
+	int i;
+	if (connect(fd, addr, len) < 0) return -1;
+	if (!(st = ev_ares_sock_find(resolver, fd))) return 0;
+	for (i = 0; i < st->npool; i++) {
+		if (connect(st->pool[i], addr, len) == 0) {
+			ev_io_start(resolver->loop, &st->pool_io[i]);
+			continue;
+		}
+		// the pool does without it
+		close(st->pool[i]);
+		st->pool[i] = st->pool[ --st->npool ];
+		ev_io_set(&st->pool_io[i], st->pool[i], EV_READ);
+		i--;
+	}
+	return 0;
+}
+
+static ares_ssize_t ev_ares_sock_recvfrom(ares_socket_t fd, void *buf, size_t len, int flags, struct sockaddr *from, ares_socklen_t *from_len, void *data) {
+	ev_ares * resolver = (ev_ares *) data;
+	struct ev_ares_sock *st;
+	struct mmsghdr *m;
+	size_t n;
+	int i, k, s;
+
+	if (!from || !(st = ev_ares_sock_find(resolver, fd))) {
+		return recvfrom(fd, buf, len, flags, from, from_len);
+	}
+	if (!st->rcount) {
+		for (i=0; i<EV_ARES_MMSG; i++) {
+			st->riov[i].iov_base = st->rbuf[i];
+			st->riov[i].iov_len  = EV_ARES_DGRAM;
+			memset(&st->rmsg[i].msg_hdr, 0, sizeof(st->rmsg[i].msg_hdr));
+			st->rmsg[i].msg_hdr.msg_iov     = &st->riov[i];
+			st->rmsg[i].msg_hdr.msg_iovlen  = 1;
+			st->rmsg[i].msg_hdr.msg_name    = &st->rfrom[i];
+			st->rmsg[i].msg_hdr.msg_namelen = sizeof(st->rfrom[i]);
+		}
+		// the pool in turn, from the socket after the one read last
+		for (k = 0, i = -1; k <= st->npool && i <= 0; k++) {
+			s = (st->rnext + k) % (st->npool + 1);
+			i = recvmmsg(s ? st->pool[s - 1] : fd, st->rmsg, EV_ARES_MMSG, flags | MSG_DONTWAIT, NULL);
+			resolver->stats.recv_calls++;
+			if (i < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return i;
+			st->rnext = s + 1;
+		}
+		if (i <= 0) return i;
+		resolver->stats.recv_dgrams += i;
+		st->rhead  = 0;
+		st->rcount = i;
+	}
+	m = &st->rmsg[ st->rhead++ ];
+	st->rcount--;
+
+	n = m->msg_len < len ? m->msg_len : len;
+	memcpy(buf, m->msg_hdr.msg_iov->iov_base, n);
+	memcpy(from, m->msg_hdr.msg_name, m->msg_hdr.msg_namelen < *from_len ? m->msg_hdr.msg_namelen : *from_len);
+	*from_len = m->msg_hdr.msg_namelen;
+	return n;
+}
+
+static ares_ssize_t ev_ares_sock_sendv(ares_socket_t fd, const struct iovec *vec, int len, void *data) {
+	ev_ares * resolver = (ev_ares *) data;
+	struct ev_ares_sock *st;
+	size_t total = 0;
+	unsigned char *p;
+	int i;
+
+	if (!(st = ev_ares_sock_find(resolver, fd))) {
+		return writev(fd, vec, len);
+	}
+	for (i=0; i<len; i++) total += vec[i].iov_len;
+	if (st->scount == EV_ARES_MMSG || total > EV_ARES_QBUF) {
+		ev_ares_sock_flush(resolver, st);
+	}
+	if (st->scount == EV_ARES_MMSG) {
+		// as a send straight to the socket would
+		errno = EAGAIN;
+		return -1;
+	}
+	if (total > EV_ARES_QBUF) {
+		resolver->stats.send_calls++;
+		resolver->stats.send_dgrams++;
+		return writev(fd, vec, len);
+	}
+
+	p = st->sbuf[ st->scount ];
+	for (i=0; i<len; i++) {
+		memcpy(p, vec[i].iov_base, vec[i].iov_len);
+		p += vec[i].iov_len;
+	}
+	st->siov[ st->scount ].iov_base = st->sbuf[ st->scount ];
+	st->siov[ st->scount ].iov_len  = total;
+	memset(&st->smsg[ st->scount ], 0, sizeof(st->smsg[0]));
+	st->smsg[ st->scount ].msg_hdr.msg_iov    = &st->siov[ st->scount ];
+	st->smsg[ st->scount ].msg_hdr.msg_iovlen = 1;
+	st->stag[ st->scount ] = st->snext;
+	st->snext = (st->snext + 1) % (st->npool + 1);
+	st->scount++;
+
+	if (!ev_is_active(&resolver->flush)) {
+		ev_prepare_start(resolver->loop, &resolver->flush);
+	}
+	return total;
+}
+
+static const struct ares_socket_functions ev_ares_sock_funcs = {
+	ev_ares_sock_open,
+	ev_ares_sock_close,
+	ev_ares_sock_connect,
+	ev_ares_sock_recvfrom,
+	ev_ares_sock_sendv,
+};
+
+static void ev_ares_sock_setup(ev_ares *resolver, ares_channel channel) {
+	ares_set_socket_functions(channel, &ev_ares_sock_funcs, resolver);
+}
+
+static void ev_ares_sock_cleanup(ev_ares *resolver) {
+	int i;
+	if (ev_is_active(&resolver->flush)) {
+		ev_prepare_stop(resolver->loop, &resolver->flush);
+	}
+	for (i=0; i<IOMAX; i++) {
+		if (resolver->socks[i]) {
+			ev_ares_sock_free(resolver, resolver->socks[i]);
+			resolver->socks[i] = NULL;
+		}
+	}
+}
+
+#else
+
+static void flush_cb (EV_P_ ev_prepare *w, int revents) {
+	ev_prepare_stop(EV_A_ w);
+}
+
+static void ev_ares_sock_setup(ev_ares *resolver, ares_channel channel) {}
+static void ev_ares_sock_cleanup(ev_ares *resolver) {}
+
+#endif
+
+/*
+ * Socket tuning, applied by c-ares to every socket it opens.
+ * Failures are not fatal: the socket is used with whatever the kernel allowed.
+ */
+
+static void ev_ares_sock_setbuf(ares_socket_t fd, int opt, int force, int size) {
+#ifdef SO_RCVBUFFORCE
+	// FORCE variants ignore rmem_max/wmem_max, but need CAP_NET_ADMIN
+	if (setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)) == 0) return;
+#endif
+	setsockopt(fd, SOL_SOCKET, opt, &size, sizeof(size));
+}
+
+static int ev_ares_sock_config_cb(ares_socket_t fd, int type, void *data) {
+	ev_ares * resolver = (ev_ares *) data;
+	ev_ares_options *opts = &resolver->opts;
+	
+	if (type == SOCK_DGRAM) {
+#ifdef SO_RCVBUFFORCE
+		if (opts->rcvbuf) ev_ares_sock_setbuf(fd, SO_RCVBUF, SO_RCVBUFFORCE, opts->rcvbuf);
+		if (opts->sndbuf) ev_ares_sock_setbuf(fd, SO_SNDBUF, SO_SNDBUFFORCE, opts->sndbuf);
+#else
+		if (opts->rcvbuf) ev_ares_sock_setbuf(fd, SO_RCVBUF, 0, opts->rcvbuf);
+		if (opts->sndbuf) ev_ares_sock_setbuf(fd, SO_SNDBUF, 0, opts->sndbuf);
+#endif
+#ifdef SO_BUSY_POLL
+		if (opts->busy_poll) setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opts->busy_poll, sizeof(opts->busy_poll));
+#endif
+	}
+	return 0;
+}
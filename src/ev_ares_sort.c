@@ -0,0 +1,365 @@
+/*
+ * Destination address ordering for ev_ares_resolve_addrs().
+ *
+ * Every policy scores an address, higher is better; the first policy
+ * added decides first, later ones break ties, and wire order breaks the
+ * rest. Addresses are brought to one 16 byte form (IPv4 as ::ffff:a.b.c.d,
+ * as in RFC 6724) and all scores are packed into one key per address
+ * before the sort, so the policies run once per address.
+ *
+ * EV_ARES_ROTATE and EV_ARES_P2C then spread load over the best scoring
+ * run: the former rotates it by one on every call, the latter puts the
+ * cheaper of two random members first. Cost is the EWMA latency times the
+ * requests in flight, as reported with ev_ares_addr_start()/_done().
+ */
+
+#include <ifaddrs.h>
+
+#define EV_ARES_SORT_MAX     4    // policies
+#define EV_ARES_SORT_FAILED  64   // remembered failed addresses
+#define EV_ARES_SORT_HOLD    30.  // seconds a failed address stays demoted
+#define EV_ARES_SORT_IFRESH  60.  // seconds between interface rescans
+#define EV_ARES_SORT_PEERS   256  // addresses with load feedback; colliding ones replace each other
+#define EV_ARES_SORT_DECAY   0.3  // weight of a new latency sample
+
+struct ev_ares_prefix {
+	unsigned char  addr[16];
+	int            len;         // bits
+	int            value;
+};
+
+struct ev_ares_sort {
+	struct {
+		ev_ares_sort_policy policy;
+		void               *data;
+	} policies[EV_ARES_SORT_MAX];
+	int            npolicies;
+	struct ev_ares_prefix *table;   // ev_ares_sort_prefer() entries, NULL - RFC 6724 defaults
+	int            ntable;
+	struct ev_ares_prefix *local;   // subnets of the local interfaces
+	int            nlocal;
+	ev_tstamp      local_stamp;
+	struct {
+		unsigned char addr[16];
+		ev_tstamp     until;
+	} failed[EV_ARES_SORT_FAILED];
+	unsigned int   rotor;
+	unsigned int   rng;
+	struct {
+		unsigned char  addr[16];
+		unsigned short port;
+		int            inflight;
+		double         latency;     // EWMA, seconds; 0 - no sample yet
+	} peers[EV_ARES_SORT_PEERS];
+};
+
+// RFC 6724 section 2.1 default policy table, precedence column
+static const struct ev_ares_prefix ev_ares_sort_default[] = {
+	{ { 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,1 },          128, 50 },  // ::1/128
+	{ { 0 },                                            0,   40 },  // ::/0
+	{ { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff },             96,  35 },  // ::ffff:0:0/96
+	{ { 0x20,0x02 },                                   16,  30 },  // 2002::/16
+	{ { 0x20,0x01,0,0 },                               32,   5 },  // 2001::/32
+	{ { 0xfc },                                         7,   3 },  // fc00::/7
+	{ { 0 },                                           96,   1 },  // ::/96
+	{ { 0xfe,0xc0 },                                   10,   1 },  // fec0::/10
+	{ { 0x3f,0xfe },                                   16,   1 },  // 3ffe::/16
+};
+
+static struct ev_ares_sort * ev_ares_sort_get(ev_ares *resolver) {
+	if (!resolver->sort && (resolver->sort = calloc(1, sizeof(struct ev_ares_sort)))) {
+		// processes sharing a start time still have to start on different addresses
+		resolver->sort->rng = (unsigned int) getpid() * 2654435761u ^ (unsigned int) (ev_time() * 1e6);
+		if (!resolver->sort->rng) resolver->sort->rng = 1;
+		resolver->sort->rotor = resolver->sort->rng;
+	}
+	return resolver->sort;
+}
+
+static void ev_ares_sort_cleanup(ev_ares *resolver) {
+	if (!resolver->sort) return;
+	free(resolver->sort->table);
+	free(resolver->sort->local);
+	free(resolver->sort);
+	resolver->sort = NULL;
+}
+
+static ev_tstamp ev_ares_sort_now(ev_ares *resolver) {
+	return resolver->loop ? ev_now(resolver->loop) : ev_time();
+}
+
+// IPv4 as IPv4-mapped IPv6; 0 for other families
+static int ev_ares_addr16(const struct sockaddr *sa, unsigned char *out) {
+	if (sa->sa_family == AF_INET) {
+		memset(out, 0, 10);
+		out[10] = out[11] = 0xff;
+		memcpy(out + 12, &((const struct sockaddr_in *) sa)->sin_addr, 4);
+		return 1;
+	}
+	if (sa->sa_family == AF_INET6) {
+		memcpy(out, &((const struct sockaddr_in6 *) sa)->sin6_addr, 16);
+		return 1;
+	}
+	return 0;
+}
+
+static int ev_ares_prefix_match(const struct ev_ares_prefix *p, const unsigned char *addr) {
+	int bytes = p->len / 8, bits = p->len % 8;
+	if (memcmp(p->addr, addr, bytes)) return 0;
+	return !bits || !((p->addr[bytes] ^ addr[bytes]) & (0xff << (8 - bits)));
+}
+
+static const struct ev_ares_prefix * ev_ares_prefix_lookup(const struct ev_ares_prefix *table, int n, const unsigned char *addr) {
+	const struct ev_ares_prefix *best = NULL;
+	int i;
+	for (i = 0; i < n; i++) {
+		if ((!best || table[i].len > best->len) && ev_ares_prefix_match(&table[i], addr)) best = &table[i];
+	}
+	return best;
+}
+
+static int ev_ares_prefix_parse(const char *text, struct ev_ares_prefix *p) {
+	char buf[INET6_ADDRSTRLEN + 5], *slash;
+	struct in_addr in;
+	int len = -1;
+
+	if (strlen(text) >= sizeof(buf)) return -1;
+	strcpy(buf, text);
+	if ((slash = strchr(buf, '/'))) {
+		*slash++ = 0;
+		len = atoi(slash);
+	}
+	memset(p, 0, sizeof(*p));
+	if (inet_pton(AF_INET, buf, &in) == 1) {
+		if (len < 0 || len > 32) len = 32;
+		p->addr[10] = p->addr[11] = 0xff;
+		memcpy(p->addr + 12, &in, 4);
+		p->len = 96 + len;
+		return 0;
+	}
+	if (inet_pton(AF_INET6, buf, p->addr) == 1) {
+		p->len = len < 0 || len > 128 ? 128 : len;
+		return 0;
+	}
+	return -1;
+}
+
+static int ev_ares_netmask_len(const struct sockaddr *mask) {
+	unsigned char m[16];
+	int i, len = 0;
+	if (!mask || !ev_ares_addr16(mask, m)) return -1;
+	for (i = mask->sa_family == AF_INET ? 12 : 0; i < 16; i++) {
+		unsigned char b = m[i];
+		while (b & 0x80) {
+			len++;
+			b <<= 1;
+		}
+		if (m[i] != 0xff) break;
+	}
+	return mask->sa_family == AF_INET ? 96 + len : len;
+}
+
+static void ev_ares_sort_scan_local(struct ev_ares_sort *sort) {
+	struct ifaddrs *ifs, *ifa;
+	struct ev_ares_prefix *local;
+	int n = 0;
+
+	if (getifaddrs(&ifs) != 0) return;
+	for (ifa = ifs; ifa; ifa = ifa->ifa_next) n++;
+	if ((local = calloc(n ? n : 1, sizeof(struct ev_ares_prefix)))) {
+		n = 0;
+		for (ifa = ifs; ifa; ifa = ifa->ifa_next) {
+			if (!ifa->ifa_addr || !ev_ares_addr16(ifa->ifa_addr, local[n].addr)) continue;
+			if ((local[n].len = ev_ares_netmask_len(ifa->ifa_netmask)) < 0) continue;
+			local[n].value = 1;
+			n++;
+		}
+		free(sort->local);
+		sort->local  = local;
+		sort->nlocal = n;
+	}
+	freeifaddrs(ifs);
+}
+
+int ev_ares_sort_local(ev_ares *resolver, const struct sockaddr *addr, void *data) {
+	struct ev_ares_sort *sort = resolver->sort;
+	ev_tstamp now = ev_ares_sort_now(resolver);
+	unsigned char a[16];
+	if (!sort || !ev_ares_addr16(addr, a)) return 0;
+	// local_stamp starts at 0; a failed scan waits for the next refresh like a good one
+	if (now - sort->local_stamp >= EV_ARES_SORT_IFRESH) {
+		sort->local_stamp = now;
+		ev_ares_sort_scan_local(sort);
+	}
+	return ev_ares_prefix_lookup(sort->local, sort->nlocal, a) != NULL;
+}
+
+int ev_ares_sort_precedence(ev_ares *resolver, const struct sockaddr *addr, void *data) {
+	struct ev_ares_sort *sort = resolver->sort;
+	const struct ev_ares_prefix *p;
+	unsigned char a[16];
+	if (!ev_ares_addr16(addr, a)) return 0;
+	if (sort && sort->table) p = ev_ares_prefix_lookup(sort->table, sort->ntable, a);
+	else p = ev_ares_prefix_lookup(ev_ares_sort_default, sizeof(ev_ares_sort_default) / sizeof(*ev_ares_sort_default), a);
+	return p ? p->value : 0;
+}
+
+static unsigned int ev_ares_sort_hash(const unsigned char *a) {
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < 16; i++) {
+		h ^= a[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int ev_ares_sort_failed(ev_ares *resolver, const struct sockaddr *addr, void *data) {
+	struct ev_ares_sort *sort = resolver->sort;
+	unsigned char a[16];
+	unsigned int slot;
+	if (!sort || !ev_ares_addr16(addr, a)) return 1;
+	slot = ev_ares_sort_hash(a) % EV_ARES_SORT_FAILED;
+	return !(sort->failed[slot].until > ev_ares_sort_now(resolver) && !memcmp(sort->failed[slot].addr, a, 16));
+}
+
+void ev_ares_addr_failed(ev_ares *resolver, const struct sockaddr *addr) {
+	struct ev_ares_sort *sort = ev_ares_sort_get(resolver);
+	unsigned char a[16];
+	unsigned int slot;
+	if (!sort || !ev_ares_addr16(addr, a)) return;
+	slot = ev_ares_sort_hash(a) % EV_ARES_SORT_FAILED;
+	memcpy(sort->failed[slot].addr, a, 16);
+	sort->failed[slot].until = ev_ares_sort_now(resolver) + EV_ARES_SORT_HOLD;
+}
+
+int ev_ares_sort_policy_add(ev_ares *resolver, ev_ares_sort_policy policy, void *data) {
+	struct ev_ares_sort *sort = ev_ares_sort_get(resolver);
+	if (!sort) return ARES_ENOMEM;
+	if (sort->npolicies == EV_ARES_SORT_MAX) return ARES_EBADQUERY;
+	sort->policies[ sort->npolicies ].policy = policy;
+	sort->policies[ sort->npolicies ].data   = data;
+	sort->npolicies++;
+	return ARES_SUCCESS;
+}
+
+int ev_ares_sort_prefer(ev_ares *resolver, const char *prefix, int precedence) {
+	struct ev_ares_sort *sort = ev_ares_sort_get(resolver);
+	struct ev_ares_prefix p, *table;
+	if (!sort) return ARES_ENOMEM;
+	if (ev_ares_prefix_parse(prefix, &p) != 0) return ARES_EBADSTR;
+	p.value = precedence;
+	if (!(table = realloc(sort->table, (sort->ntable + 1) * sizeof(*table)))) return ARES_ENOMEM;
+	table[ sort->ntable++ ] = p;
+	sort->table = table;
+	return ARES_SUCCESS;
+}
+
+static unsigned int ev_ares_sort_random(struct ev_ares_sort *sort) {
+	// xorshift32, keeps random() of the application alone
+	sort->rng ^= sort->rng << 13;
+	sort->rng ^= sort->rng >> 17;
+	sort->rng ^= sort->rng << 5;
+	return sort->rng;
+}
+
+static unsigned short ev_ares_sockaddr_port(const struct sockaddr *sa) {
+	return ntohs(sa->sa_family == AF_INET ? ((const struct sockaddr_in *) sa)->sin_port : ((const struct sockaddr_in6 *) sa)->sin6_port);
+}
+
+// Feedback slot of addr; with create a colliding address is replaced
+static int ev_ares_sort_peer(struct ev_ares_sort *sort, const struct sockaddr *addr, int create) {
+	unsigned char a[16];
+	unsigned short port;
+	unsigned int slot;
+	if (!sort || !ev_ares_addr16(addr, a)) return -1;
+	port = ev_ares_sockaddr_port(addr);
+	slot = ((ev_ares_sort_hash(a) ^ port) * 16777619u) % EV_ARES_SORT_PEERS;
+	if (sort->peers[slot].port == port && !memcmp(sort->peers[slot].addr, a, 16)) return slot;
+	if (!create) return -1;
+	memcpy(sort->peers[slot].addr, a, 16);
+	sort->peers[slot].port     = port;
+	sort->peers[slot].inflight = 0;
+	sort->peers[slot].latency  = 0;
+	return slot;
+}
+
+void ev_ares_addr_start(ev_ares *resolver, const struct sockaddr *addr) {
+	struct ev_ares_sort *sort = ev_ares_sort_get(resolver);
+	int slot = ev_ares_sort_peer(sort, addr, 1);
+	if (slot >= 0) sort->peers[slot].inflight++;
+}
+
+void ev_ares_addr_done(ev_ares *resolver, const struct sockaddr *addr, double latency) {
+	struct ev_ares_sort *sort = resolver->sort;
+	int slot = ev_ares_sort_peer(sort, addr, 0);
+	if (slot >= 0) {
+		if (sort->peers[slot].inflight > 0) sort->peers[slot].inflight--;
+		if (latency >= 0) {
+			sort->peers[slot].latency = sort->peers[slot].latency > 0
+				? sort->peers[slot].latency + EV_ARES_SORT_DECAY * (latency - sort->peers[slot].latency)
+				: latency;
+		}
+	}
+	if (latency < 0) ev_ares_addr_failed(resolver, addr);
+}
+
+static double ev_ares_sort_cost(struct ev_ares_sort *sort, const struct sockaddr *addr) {
+	int slot = ev_ares_sort_peer(sort, addr, 0);
+	if (slot < 0) return 0;
+	return sort->peers[slot].latency * (sort->peers[slot].inflight + 1);
+}
+
+void ev_ares_sort_addrs(ev_ares *resolver, struct sockaddr_storage *addrs, int *ttls, int count) {
+	struct ev_ares_sort *sort = resolver->sort;
+	struct { unsigned long long key; int idx; } tmp, *keys;
+	struct sockaddr_storage *sa;
+	int *tt, i, j, k, score, spread, top;
+
+	if (!sort || count < 2) return;
+	spread = resolver->opts.flags & (EV_ARES_ROTATE | EV_ARES_P2C);
+	if (!sort->npolicies && !spread) return;
+	if (!(keys = malloc(count * (sizeof(*keys) + sizeof(*sa) + sizeof(int))))) return;
+	sa = (struct sockaddr_storage *) (keys + count);
+	tt = (int *) (sa + count);
+
+	for (i = 0; i < count; i++) {
+		keys[i].key = 0;
+		keys[i].idx = i;
+		for (k = 0; k < sort->npolicies; k++) {
+			score = sort->policies[k].policy(resolver, (struct sockaddr *) &addrs[i], sort->policies[k].data);
+			if (score < 0) score = 0;
+			if (score > 0xffff) score = 0xffff;
+			keys[i].key |= (unsigned long long) score << (16 * (EV_ARES_SORT_MAX - 1 - k));
+		}
+	}
+	// stable insertion sort, answers are short
+	for (i = 1; i < count; i++) {
+		tmp = keys[i];
+		for (j = i; j > 0 && keys[j - 1].key < tmp.key; j--) keys[j] = keys[j - 1];
+		keys[j] = tmp;
+	}
+	for (top = 1; top < count && keys[top].key == keys[0].key; top++);
+	if (top > 1 && (spread & EV_ARES_P2C)) {
+		i = ev_ares_sort_random(sort) % top;
+		j = ev_ares_sort_random(sort) % (top - 1);
+		if (j >= i) j++;
+		if (ev_ares_sort_cost(sort, (struct sockaddr *) &addrs[ keys[j].idx ]) < ev_ares_sort_cost(sort, (struct sockaddr *) &addrs[ keys[i].idx ])) i = j;
+		tmp = keys[i];
+		memmove(keys + 1, keys, i * sizeof(*keys));
+		keys[0] = tmp;
+	}
+	else
+	if (top > 1 && (spread & EV_ARES_ROTATE)) {
+		k = sort->rotor++ % top;
+		for (i = 0; i < top; i++) tt[i] = keys[i].idx;
+		for (i = 0; i < top; i++) keys[i].idx = tt[ (i + k) % top ];
+	}
+	for (i = 0; i < count; i++) {
+		sa[i] = addrs[ keys[i].idx ];
+		tt[i] = ttls[ keys[i].idx ];
+	}
+	memcpy(addrs, sa, count * sizeof(*sa));
+	memcpy(ttls, tt, count * sizeof(int));
+	free(keys);
+}
@@ -0,0 +1,175 @@
+/*
+ * Wire-format names without expansion.
+ *
+ * A name is copied uncompressed into a caller buffer label by label,
+ * case-folded on the way, or compared the same way against a name already
+ * in that form (the question's) without being copied at all. Labels go 32
+ * or 16 bytes at a time with AVX2 or SSE2, whichever the CPU has (picked
+ * on the first call), a byte at a time otherwise. Length bytes are all
+ * below 'A', so a label folds along with its length byte, blindly, in
+ * whole vectors. Loads from the packet stop short of its end, where the
+ * rest of the label goes a byte at a time; the buffers have room for the
+ * whole vectors. Text is only made for the names a reply hands out.
+ */
+
+#define EV_ARES_WIRE_BUF (NS_MAXCDNAME + 32)  // room for whole vectors past the name
+
+static void ev_ares_label_copy_scalar(unsigned char *dst, const unsigned char *src, int n, const unsigned char *end) {
+	(void) end;
+	for (; n > 0; n--, src++, dst++) {
+		*dst = (unsigned int) (*src - 'A') < 26 ? *src + 'a' - 'A' : *src;
+	}
+}
+
+// Non-zero if the n bytes at src, folded, differ from those at name
+static int ev_ares_label_ne_scalar(const unsigned char *src, const unsigned char *name, int n, const unsigned char *end) {
+	(void) end;
+	for (; n > 0; n--, src++, name++) {
+		if (((unsigned int) (*src - 'A') < 26 ? *src + 'a' - 'A' : *src) != *name) return 1;
+	}
+	return 0;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+
+/*
+ * x - 'A' + 128 as a signed byte is below -128 + 26 exactly for 'A'..'Z',
+ * which then get the 0x20 bit.
+ */
+#define ev_ares_fold128(v) _mm_or_si128(v, _mm_and_si128(_mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8(128 - 'A')), _mm_set1_epi8(-128 + 26)), _mm_set1_epi8(0x20)))
+#define ev_ares_fold256(v) _mm256_or_si256(v, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), _mm256_add_epi8(v, _mm256_set1_epi8(128 - 'A'))), _mm256_set1_epi8(0x20)))
+
+__attribute__((target("sse2")))
+static void ev_ares_label_copy_sse2(unsigned char *dst, const unsigned char *src, int n, const unsigned char *end) {
+	__m128i v;
+	for (; n > 0; n -= 16, src += 16, dst += 16) {
+		if (src + 16 > end) {
+			ev_ares_label_copy_scalar(dst, src, n, end);
+			return;
+		}
+		v = _mm_loadu_si128((const __m128i *) src);
+		_mm_storeu_si128((__m128i *) dst, ev_ares_fold128(v));
+	}
+}
+
+__attribute__((target("sse2")))
+static int ev_ares_label_ne_sse2(const unsigned char *src, const unsigned char *name, int n, const unsigned char *end) {
+	unsigned int eq;
+	__m128i v;
+	for (; n > 0; n -= 16, src += 16, name += 16) {
+		if (src + 16 > end) return ev_ares_label_ne_scalar(src, name, n, end);
+		v = _mm_loadu_si128((const __m128i *) src);
+		eq = _mm_movemask_epi8(_mm_cmpeq_epi8(ev_ares_fold128(v), _mm_loadu_si128((const __m128i *) name)));
+		if (n < 16) eq |= 0xffffu << n & 0xffffu;
+		if (eq != 0xffffu) return 1;
+	}
+	return 0;
+}
+
+__attribute__((target("avx2")))
+static void ev_ares_label_copy_avx2(unsigned char *dst, const unsigned char *src, int n, const unsigned char *end) {
+	__m256i v;
+	for (; n > 0; n -= 32, src += 32, dst += 32) {
+		if (src + 32 > end) {
+			ev_ares_label_copy_sse2(dst, src, n, end);
+			return;
+		}
+		v = _mm256_loadu_si256((const __m256i *) src);
+		_mm256_storeu_si256((__m256i *) dst, ev_ares_fold256(v));
+	}
+}
+
+__attribute__((target("avx2")))
+static int ev_ares_label_ne_avx2(const unsigned char *src, const unsigned char *name, int n, const unsigned char *end) {
+	unsigned int eq;
+	__m256i v;
+	for (; n > 0; n -= 32, src += 32, name += 32) {
+		if (src + 32 > end) return ev_ares_label_ne_sse2(src, name, n, end);
+		v = _mm256_loadu_si256((const __m256i *) src);
+		eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(ev_ares_fold256(v), _mm256_loadu_si256((const __m256i *) name)));
+		if (n < 32) eq |= ~0u << n;
+		if (eq != ~0u) return 1;
+	}
+	return 0;
+}
+#endif
+
+struct ev_ares_label_ops {
+	void (*copy)(unsigned char *dst, const unsigned char *src, int n, const unsigned char *end);
+	int  (*ne)(const unsigned char *src, const unsigned char *name, int n, const unsigned char *end);
+};
+
+static const struct ev_ares_label_ops ev_ares_label_scalar = { ev_ares_label_copy_scalar, ev_ares_label_ne_scalar };
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+static const struct ev_ares_label_ops ev_ares_label_sse2 = { ev_ares_label_copy_sse2, ev_ares_label_ne_sse2 };
+static const struct ev_ares_label_ops ev_ares_label_avx2 = { ev_ares_label_copy_avx2, ev_ares_label_ne_avx2 };
+#endif
+
+static const struct ev_ares_label_ops *ev_ares_label;  // NULL until the first call
+
+static const struct ev_ares_label_ops * ev_ares_label_pick(void) {
+	const struct ev_ares_label_ops *ops = __atomic_load_n(&ev_ares_label, __ATOMIC_RELAXED);
+	if (ops) return ops;
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) ops = &ev_ares_label_avx2;
+	else
+	if (__builtin_cpu_supports("sse2")) ops = &ev_ares_label_sse2;
+	else
+#endif
+	ops = &ev_ares_label_scalar;
+	// loops on other threads may pick at the same time; they pick the same
+	__atomic_store_n(&ev_ares_label, ops, __ATOMIC_RELAXED);
+	return ops;
+}
+
+/*
+ * Walks the name at p, following compression pointers. out, when given,
+ * gets the labels uncompressed and case-folded (EV_ARES_WIRE_BUF bytes)
+ * and *olen their length; name, when given instead, is compared with
+ * them (nlen bytes in the same form and an EV_ARES_WIRE_BUF buffer) and
+ * *eq tells if they are the same. Returns the length of the name at p,
+ * or -1 if it is malformed.
+ */
+static long ev_ares_wire_walk(const unsigned char *p, const unsigned char *abuf, int alen, unsigned char *out, int *olen, const unsigned char *name, int nlen, int *eq) {
+	const struct ev_ares_label_ops *ops = (out || name) ? ev_ares_label_pick() : NULL;
+	const unsigned char *start = p, *end = abuf + alen;
+	long used = -1;
+	int n = 0, hops = 0, l, same = 1;
+	for (;;) {
+		if (p >= end) return -1;
+		l = *p;
+		if ((l & 0xc0) == 0xc0) {
+			if (p + 1 >= end || ++hops > alen / 2) return -1;
+			if (used < 0) used = p + 2 - start;
+			p = abuf + ((l & 0x3f) << 8 | p[1]);
+			continue;
+		}
+		if ((l & 0xc0) || p + 1 + l > end || n + 1 + l > NS_MAXCDNAME) return -1;
+		if (out) ops->copy(out + n, p, 1 + l, end);
+		else
+		if (name && same) same = n + 1 + l <= nlen && !ops->ne(p, name + n, 1 + l, end);
+		n += 1 + l;
+		if (!l) break;
+		p += 1 + l;
+	}
+	if (olen) *olen = n;
+	if (eq) *eq = same && n == nlen;
+	return used < 0 ? p + 1 - start : used;
+}
+
+// Length of the name at p in the packet, -1 if it is malformed
+static inline long ev_ares_wire_name_len(const unsigned char *p, const unsigned char *abuf, int alen) {
+	return ev_ares_wire_walk(p, abuf, alen, NULL, NULL, NULL, 0, NULL);
+}
+
+// The name at p, uncompressed and case-folded into out (EV_ARES_WIRE_BUF bytes)
+static inline long ev_ares_wire_canon(const unsigned char *p, const unsigned char *abuf, int alen, unsigned char *out, int *olen) {
+	return ev_ares_wire_walk(p, abuf, alen, out, olen, NULL, 0, NULL);
+}
+
+// Length of the name at p, with *eq telling if it is name (from ev_ares_wire_canon())
+static inline long ev_ares_wire_match(const unsigned char *p, const unsigned char *abuf, int alen, const unsigned char *name, int nlen, int *eq) {
+	return ev_ares_wire_walk(p, abuf, alen, NULL, NULL, name, nlen, eq);
+}
@@ -22,22 +22,152 @@
 
 #define IOMAX ARES_GETSOCK_MAXNUM
 
+#define EV_ARES_MMSG  16    // datagrams per recvmmsg()/sendmmsg() call
+#define EV_ARES_DGRAM 4096  // largest reply we accept (EDNS payload size)
+#define EV_ARES_QBUF  512   // largest query that is queued for sendmmsg()
+
+struct ev_ares_chan;
+
 typedef struct {
 	ev_io io;
 	int   id;
+	int   ready;  // revents collected for the deferred processing pass
+	struct ev_ares_chan *chan;  // channel owning the socket
 } io_ptr;
 
+#define EV_ARES_DEFER        0x0001  // only mark ready fds in io_cb, run one ares_process() per loop iteration
+#define EV_ARES_BIND_NO_PORT 0x0002  // IP_BIND_ADDRESS_NO_PORT on TCP sockets (Linux); a no-op without a local address set, and for UDP
+#define EV_ARES_SORT         0x0004  // order ev_ares_resolve_addrs() results by failures, precedence, local subnets
+#define EV_ARES_ROTATE       0x0008  // rotate the best ev_ares_resolve_addrs() results on every call
+#define EV_ARES_P2C          0x0010  // put the cheaper of two random best results first (ev_ares_addr_start()/_done())
+#define EV_ARES_DOTTED_ABSOLUTE 0x0020  // names with a dot are queried as they are, never with the search domains
+#define EV_ARES_MEM_SHED     0x0040  // over opts.mem_budget fail new queries with ARES_ENOMEM instead of queueing them
+
+typedef struct {
+	int flags;
+	int rcvbuf;       // SO_RCVBUF for UDP sockets, bytes; 0 keeps the system default
+	int sndbuf;       // SO_SNDBUF for UDP sockets, bytes
+	int busy_poll;    // SO_BUSY_POLL for UDP sockets, usec
+	int udp_sockets;  // UDP sockets (source ports) per nameserver, queries spread over them (Linux); 0 or 1 means one
+	double qps;       // queries per second per nameserver (token bucket); 0 - unlimited
+	int max_inflight; // queries outstanding in c-ares at once; 0 - unlimited
+	int cache_size;   // answer cache entries; 0 - no cache
+	int cache_policy; // EV_ARES_CACHE_LRU or EV_ARES_CACHE_TINYLFU
+	int ptr_cache_size; // ev_ares_ptr_addr() cache entries, keyed by address; 0 - no cache
+	int ndots;        // dots that make a name be tried as is first; 0 - from resolv.conf
+	char **domains;   // NULL-terminated search list instead of resolv.conf's; kept by reference
+	size_t mem_budget; // bytes (stats.mem_*); over it caches are trimmed, then new queries wait; 0 - unlimited
+	const char *shm_cache;  // shm_open() name of an answer cache shared with other processes; NULL - none
+	size_t shm_cache_size;  // its size when this process creates it, bytes; 0 - 16 MB; counts in mem_budget, which has to exceed it (ARES_EBADFLAGS)
+} ev_ares_options;
+
+// answer cache eviction
+#define EV_ARES_CACHE_LRU     0  // least recently used goes
+#define EV_ARES_CACHE_TINYLFU 1  // frequency-gated admission and segmented LRU, resists one-off names
+
+// per-query flags for the ev_ares_*_ex calls
+#define EV_ARES_Q_BACKGROUND 0x0001  // background class: released only when no interactive query waits
+#define EV_ARES_Q_NOCACHE    0x0002  // skip the answer cache, neither read nor fill it
+#define EV_ARES_Q_ABSOLUTE   0x0004  // query the name as it is, without the search domains
+
+typedef struct {
+	// UDP socket syscall counters; recv_dgrams / recv_calls is the batching gain
+	unsigned long recv_calls;
+	unsigned long recv_dgrams;
+	unsigned long send_calls;
+	unsigned long send_dgrams;
+	unsigned long send_drops;
+	// scheduler
+	unsigned long queries;      // submitted
+	unsigned long delayed;      // had to wait for the rate limit or in-flight cap
+	unsigned long reconfigures; // channels replaced by ev_ares_reconfigure()
+	unsigned long coalesced;    // joined an identical ev_ares_<type>() query in flight
+	// answer cache
+	unsigned long cache_hits;   // answered from the cache, without a query
+	unsigned long cache_misses;
+	unsigned long cache_chains; // CNAME chain was cached, only its terminal name was queried
+	unsigned long cache_suffix; // sent straight to the FQDN the search list gave last time
+	unsigned long cache_window_hits;    // entry hits by segment; all in the window with plain LRU
+	unsigned long cache_probation_hits;
+	unsigned long cache_protected_hits;
+	unsigned long cache_admitted; // TinyLFU window victims let into the main cache
+	unsigned long cache_rejected; // TinyLFU window victims dropped as rarer than the main cache victim
+	unsigned long cache_evicted;
+	unsigned long cache_snap_hits; // entries taken from the ev_ares_cache_load() snapshot
+	unsigned long cache_shm_hits;  // entries taken from the opts.shm_cache segment
+	unsigned long ptr_hits;     // ev_ares_ptr_addr() answered from its cache
+	unsigned long ptr_misses;
+	// memory held, bytes; their sum is checked against opts.mem_budget
+	size_t mem_cache;     // answer cache: entries, index, sketch
+	size_t mem_ptr_cache; // ev_ares_ptr_addr() cache with its reply lists
+	size_t mem_pending;   // queries queued or in flight; the c-ares share is estimated
+	size_t mem_replies;   // answers being handed to callbacks, wire size
+	size_t mem_shm;       // opts.shm_cache segment mapped, in full (it is shared with other processes)
+	unsigned long mem_trims; // cache entries dropped to get back within the budget
+	unsigned long mem_shed;  // queries failed over the budget (EV_ARES_MEM_SHED)
+	// ev_ares_server_start()
+	unsigned long serve_queries;   // from clients, UDP and TCP
+	unsigned long serve_tcp;
+	unsigned long serve_truncated; // UDP replies cut to the question, over the client's payload size
+	unsigned long serve_failed;    // answered SERVFAIL, REFUSED, FORMERR or NOTIMP
+	// ev_ares_submit(); async_jobs / async_wakeups is the batching gain
+	unsigned long async_jobs;
+	unsigned long async_wakeups;
+} ev_ares_stats;
+
+struct ev_ares_sock;
+struct ev_ares_query;
+struct ev_ares_cache;
+struct ev_ares_rev_cache;
+struct ev_ares_sort;
+struct ev_ares_flight;
+struct ev_ares_names;
+struct ev_ares_server;
+typedef struct ev_ares_server ev_ares_server;
+struct ev_ares_async;
+struct ev_ares_hit;
+
 typedef struct {
 	//ev_io    io;
 	io_ptr     ios[IOMAX];
 	int        ioc;
 	ev_timer tw;
+	ev_prepare flush;
+	ev_check   process;
+	ev_ares_options opts;
+	struct ev_ares_sock *socks[IOMAX];
+	ev_ares_stats stats;
+	struct {
+		struct ev_ares_query *head[2];  // interactive, background
+		struct ev_ares_query *tail[2];
+		int       queued;
+		int       inflight;
+		int       servers;
+		double    tokens;
+		ev_tstamp stamp;
+		ev_timer  release;
+	} sched;
+	struct {
+		struct ev_ares_hit *head;  // cache hits waiting for the next loop iteration
+		struct ev_ares_hit *tail;
+		ev_timer  timer;
+	} hits;
 	struct ev_loop * loop;
 	struct {
-		ares_channel channel;
+		ares_channel channel;  // current channel, same as chan->channel
 		struct ares_options options;
 	} ares;
 	struct timeval timeout;
+	struct ev_ares_chan *chan;  // current channel first, then the ones still draining
+	ev_timer   drain;
+	ev_stat    watch;
+	char      *resolvconf;
+	struct ev_ares_cache *cache;
+	struct ev_ares_rev_cache *ptr_cache;
+	struct ev_ares_sort *sort;
+	struct ev_ares_flight **flights;  // queries in flight by name, type and flags
+	struct ev_ares_names *names;      // interned owner names of A/AAAA replies
+	struct ev_ares_async *async;      // ev_ares_submit() queue
 } ev_ares;
 
 typedef void (*ev_ares_callback_v)(void *result);
@@ -69,10 +199,22 @@ struct ev_ares_soa_reply {
 	int          ttl;
 };
 
+// Address of a reply host, taken from the additional section (glue)
+struct ev_ares_addr {
+	struct ev_ares_addr       *next;
+	int                        family;  // AF_INET or AF_INET6
+	union {
+		struct in_addr         ip;
+		struct ares_in6_addr   ip6;
+	}                          addr;
+	int                        ttl;
+};
+
 struct ev_ares_ns_reply {
 	struct ev_ares_ns_reply   *next;
 	char                      *host;
 	int                        ttl;
+	struct ev_ares_addr       *addrs;
 };
 
 struct ev_ares_a_reply {
@@ -94,6 +236,7 @@ struct ev_ares_mx_reply {
 	char                      *host;
 	unsigned short             priority;
 	int                        ttl;
+	struct ev_ares_addr       *addrs;
 };
 
 struct ev_ares_srv_reply {
@@ -103,6 +246,7 @@ struct ev_ares_srv_reply {
 	unsigned short             weight;
 	unsigned short             port;
 	int                        ttl;
+	struct ev_ares_addr       *addrs;
 };
 
 struct ev_ares_ptr_reply {
@@ -129,6 +273,22 @@ struct ev_ares_naptr_reply {
 	int                      ttl;
 };
 
+// SVCB/HTTPS (RFC 9460); priority 0 is AliasMode, host is then the alias target.
+// AliasMode to "." (service unavailable) is left out, ARES_ENODATA when it is all there is;
+// so are records whose "mandatory" key lists a SvcParam not decoded here.
+struct ev_ares_svcb_reply {
+	struct ev_ares_svcb_reply *next;
+	char                      *host;            // TargetName, the owner name for "." in ServiceMode
+	unsigned short             priority;
+	unsigned short             port;            // 0 - not given
+	char                     **alpn;            // NULL-terminated protocol ids, NULL - not given
+	int                        no_default_alpn;
+	unsigned char             *ech;             // ECHConfigList, ech_len bytes
+	size_t                     ech_len;
+	int                        ttl;
+	struct ev_ares_addr       *addrs;           // ipv4hint, ipv6hint and glue
+};
+
 #define mktype(type,add,...)\
 typedef struct { \
 	ev_ares         *resolver;\
@@ -152,9 +312,213 @@ mktype(srv,   struct ev_ares_srv_reply     * srv);
 mktype(ptr,   struct ev_ares_ptr_reply     * ptr);
 mktype(txt,   struct ev_ares_txt_reply     * txt);
 mktype(naptr, struct ev_ares_naptr_reply   * naptr);
+mktype(svcb,  struct ev_ares_svcb_reply    * svcb);
+mktype(https, struct ev_ares_svcb_reply    * https);
 mktype(hba,   struct hostent *hosts; int family, int family);
 
 #undef mktype
 
+// Callbacks run from the loop once the call has returned, for cache hits too (on the next
+// iteration); only ARES_ENOMEM before anything is asked calls back at once.
+#define mkext(type) \
+void ev_ares_##type##_ex (struct ev_loop * loop, ev_ares * resolver, char * hostname, int flags, void *any, ev_ares_callback_##type callback)
+
+mkext(soa);
+mkext(ns);
+mkext(a);
+mkext(aaaa);
+mkext(mx);
+mkext(srv);
+mkext(ptr);
+mkext(txt);
+mkext(naptr);
+mkext(svcb);
+mkext(https);
+
+#undef mkext
+
+// Any record type; the reply is split into records but left undecoded
+struct ev_ares_rr {
+	const char                *name;      // owner name, expanded
+	unsigned short             type;
+	unsigned short             dnsclass;
+	int                        ttl;
+	int                        section;   // ns_s_an, ns_s_ns or ns_s_ar
+	const unsigned char       *rdata;     // rdlen bytes inside abuf; names in it may point into abuf
+	unsigned short             rdlen;
+};
+
+typedef struct {
+	ev_ares         *resolver;
+	char            *query;
+	int              status;
+	const char      *error;
+	int              timeouts;
+	void            *any;
+	ev_ares_callback_v callback;
+	const unsigned char *abuf;           // whole reply, for ares_expand_name() on rdata
+	int              alen;
+	struct ev_ares_rr *rrs;
+	int              count;
+} ev_ares_result_raw;
+typedef void (*ev_ares_callback_raw)(ev_ares_result_raw *result);
+
+void ev_ares_query_raw (struct ev_loop * loop, ev_ares * resolver, char * name, int dnsclass, int type, int flags, void *any, ev_ares_callback_raw callback);
+
+// SRV lookup with the targets resolved to addresses, in RFC 2782 order
+struct ev_ares_service_addr {
+	struct sockaddr_storage    addr;     // port set from the SRV record
+	unsigned short             priority;
+	unsigned short             weight;
+	int                        ttl;      // min of the SRV and address TTLs
+};
+
+typedef struct {
+	ev_ares         *resolver;
+	char            *query;
+	int              status;
+	const char      *error;
+	int              timeouts;
+	void            *any;
+	ev_ares_callback_v callback;
+	struct ev_ares_service_addr *addrs;
+	int              count;
+	int              ttl;                // min across the whole chain
+} ev_ares_result_service;
+typedef void (*ev_ares_callback_service)(ev_ares_result_service *result);
+
+// family is AF_INET, AF_INET6 or AF_UNSPEC for both
+void ev_ares_resolve_service (struct ev_loop * loop, ev_ares * resolver, char * name, int family, void *any, ev_ares_callback_service callback);
+
+// A/AAAA lookup as one block of connect-ready sockaddrs
+typedef struct {
+	ev_ares         *resolver;
+	char            *query;
+	int              status;
+	const char      *error;
+	int              timeouts;
+	void            *any;
+	ev_ares_callback_v callback;
+	struct sockaddr_storage *addrs;      // count entries, freed after the callback
+	int             *ttls;               // count entries, parallel to addrs, same allocation
+	int              count;
+} ev_ares_result_addrs;
+typedef void (*ev_ares_callback_addrs)(ev_ares_result_addrs *result);
+
+// family is AF_INET, AF_INET6 or AF_UNSPEC for both, IPv6 first; port 0 leaves the port unset.
+// Sorted by the policies of ev_ares_sort_policy_add() when there are any.
+void ev_ares_resolve_addrs (struct ev_loop * loop, ev_ares * resolver, char * name, int family, unsigned short port, void *any, ev_ares_callback_addrs callback);
+
+// Address ordering: a policy scores an address, higher goes first.
+// Earlier policies weigh more; scores are clamped to 0..65535, up to 4 policies.
+typedef int (*ev_ares_sort_policy)(ev_ares *resolver, const struct sockaddr *addr, void *data);
+int  ev_ares_sort_policy_add (ev_ares *resolver, ev_ares_sort_policy policy, void *data);
+// built-in policies, data is unused
+int  ev_ares_sort_failed     (ev_ares *resolver, const struct sockaddr *addr, void *data); // 0 if reported failed lately
+int  ev_ares_sort_precedence (ev_ares *resolver, const struct sockaddr *addr, void *data); // ev_ares_sort_prefer() table, RFC 6724 defaults without one
+int  ev_ares_sort_local      (ev_ares *resolver, const struct sockaddr *addr, void *data); // 1 on a local interface subnet
+// add "addr/len" (IPv4 or IPv6) to the precedence table
+int  ev_ares_sort_prefer     (ev_ares *resolver, const char *prefix, int precedence);
+// demote addr for a while, e.g. after connect() to it failed
+void ev_ares_addr_failed     (ev_ares *resolver, const struct sockaddr *addr);
+// load feedback for EV_ARES_P2C: a request to addr (address and port) began / ended;
+// latency in seconds, negative for a failure
+void ev_ares_addr_start      (ev_ares *resolver, const struct sockaddr *addr);
+void ev_ares_addr_done       (ev_ares *resolver, const struct sockaddr *addr, double latency);
+void ev_ares_sort_addrs      (ev_ares *resolver, struct sockaddr_storage *addrs, int *ttls, int count);
+
+// NAPTR lookup followed through "S" (SRV) and "A" flags down to addresses; only the lowest
+// NAPTR order that resolved to any address is returned (RFC 3403 4.1)
+struct ev_ares_naptr_target {
+	struct sockaddr_storage    addr;       // port from SRV, 0 for "A" records
+	const char                *service;    // NAPTR service field, e.g. "SIP+D2U"
+	unsigned short             order;
+	unsigned short             preference;
+	unsigned short             priority;   // SRV priority and weight, 0 for "A" records
+	unsigned short             weight;
+	int                        ttl;        // min along the chain
+};
+
+typedef struct {
+	ev_ares         *resolver;
+	char            *query;
+	int              status;
+	const char      *error;
+	int              timeouts;
+	void            *any;
+	ev_ares_callback_v callback;
+	struct ev_ares_naptr_target *targets;
+	int              count;
+	int              ttl;
+} ev_ares_result_naptr_chain;
+typedef void (*ev_ares_callback_naptr_chain)(ev_ares_result_naptr_chain *result);
+
+void ev_ares_resolve_naptr (struct ev_loop * loop, ev_ares * resolver, char * name, int family, void *any, ev_ares_callback_naptr_chain callback);
+
+// PTR lookup of a binary address (struct in_addr or struct in6_addr, by family)
+// Like every lookup here it calls back from the loop, after the call has returned, cache hits
+// included; only a failure before anything is asked (ARES_ENOMEM, ARES_ENOTIMP) calls back at once.
+void ev_ares_ptr_addr    (struct ev_loop * loop, ev_ares * resolver, int family, const void *addr, void *any, ev_ares_callback_ptr callback);
+void ev_ares_ptr_addr_ex (struct ev_loop * loop, ev_ares * resolver, int family, const void *addr, int flags, void *any, ev_ares_callback_ptr callback);
+
+void ev_ares_gethostbyaddr    (struct ev_loop * loop, ev_ares * resolver, char * hostname, void *any, ev_ares_callback_hba callback);
+void ev_ares_gethostbyaddr_ex (struct ev_loop * loop, ev_ares * resolver, char * hostname, int flags, void *any, ev_ares_callback_hba callback);
+
 int ev_ares_init(ev_ares *resolver, double timeout);
+int ev_ares_init_options(ev_ares *resolver, double timeout, const ev_ares_options *opts);
 int ev_ares_clean(ev_ares *resolver);
+size_t ev_ares_mem_used(const ev_ares *resolver); // sum of stats.mem_*
+
+// Answer cache snapshot for a warm start, with absolute expiry times; ARES_SUCCESS or an ARES_E* status.
+// A loaded file stays mapped and serves entries until they expire; save replaces path by rename,
+// so it may be the file in use.
+int ev_ares_cache_save(ev_ares *resolver, const char *path);
+int ev_ares_cache_load(ev_ares *resolver, const char *path);
+
+// Replies of ev_ares_<type>() and ev_ares_ptr_addr() are shared between callers and read-only.
+// The library lets go of them after the callback; take a reference to keep one longer.
+// Any thread may drop a reference, the last one too.
+void * ev_ares_reply_ref   (void *reply);  // returns reply
+void   ev_ares_reply_unref (void *reply);
+
+// Caching DNS forwarder on the loop: UDP and TCP on addr (NULL - 127.0.0.1) and port, answered
+// from the resolver's cache, misses sent upstream through its channel and coalesced. NULL with errno.
+ev_ares_server * ev_ares_server_start (struct ev_loop * loop, ev_ares * resolver, const char *addr, unsigned short port);
+void             ev_ares_server_stop  (ev_ares_server *server);
+
+// Queries from threads other than the loop's. A job is the submitter's and has to stay valid, with
+// its name, until it completes: on the loop's thread through callback, or, with cq set, by being
+// handed out of that completion queue. Either way the reply is a copy the submitter free()s.
+struct ev_ares_cq;
+typedef struct ev_ares_cq ev_ares_cq;
+typedef struct ev_ares_job ev_ares_job;
+struct ev_ares_job {
+	ev_ares_job     *next;         // the library's while queued
+	const char      *name;
+	int              type;         // ns_t_*, class IN
+	int              flags;        // EV_ARES_Q_*
+	ev_ares_cq      *cq;           // NULL - call callback on the loop's thread
+	void           (*callback)(ev_ares_job *job);
+	void            *any;
+	int              status;
+	const char      *error;
+	int              timeouts;
+	unsigned char   *abuf;         // whole reply, NULL without one; malloc()ed
+	int              alen;
+};
+
+// On the loop's thread, before any submission; lasts until ev_ares_clean(), which fails the jobs not run yet
+int           ev_ares_async_start (struct ev_loop * loop, ev_ares * resolver);
+// From any thread, without locks
+void          ev_ares_submit      (ev_ares * resolver, ev_ares_job *job);
+// Completion queue, one per consuming thread; any number of them per resolver. NULL with errno.
+ev_ares_cq  * ev_ares_cq_new      (void);
+int           ev_ares_cq_fd       (ev_ares_cq *cq);  // readable when jobs may have completed, for poll()
+// Next completed job; waits up to timeout seconds, 0 - not at all, negative - forever. NULL if none.
+ev_ares_job * ev_ares_cq_pop      (ev_ares_cq *cq, double timeout);
+void          ev_ares_cq_free     (ev_ares_cq *cq);
+
+// Switch to a freshly configured channel; the old one is destroyed once its queries finish
+int ev_ares_reconfigure(ev_ares *resolver);
+// Call ev_ares_reconfigure() whenever path (NULL - /etc/resolv.conf) changes
+void ev_ares_watch(struct ev_loop * loop, ev_ares *resolver, const char *path);
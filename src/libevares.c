@@ -1,8 +1,15 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <evares.h>
 #include <arpa/nameser.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include "ev_ares_wire.c"
+#include "ev_ares_parse_glue.c"
+#include "ev_ares_parse_rr.c"
+#include "ev_ares_names.c"
 #include "ev_ares_parse_srv_reply.c"
 #include "ev_ares_parse_mx_reply.c"
 #include "ev_ares_parse_ns_reply.c"
@@ -12,6 +19,32 @@
 #include "ev_ares_parse_a_reply.c"
 #include "ev_ares_parse_aaaa_reply.c"
 #include "ev_ares_parse_naptr_reply.c"
+#include "ev_ares_parse_svcb_reply.c"
+#include "ev_ares_reply.c"
+
+// A channel together with the count of queries it still owes answers to
+struct ev_ares_chan {
+	struct ev_ares_chan *next;  // older channels, draining
+	ev_ares     *resolver;
+	ares_channel channel;
+	int          inflight;
+};
+
+#include "ev_ares_sock.c"
+#include "ev_ares_sched.c"
+#include "ev_ares_cache_table.c"
+#include "ev_ares_cache.c"
+#include "ev_ares_cache_snap.c"
+#include "ev_ares_cache_shm.c"
+#include "ev_ares_raw.c"
+#include "ev_ares_reverse.c"
+#include "ev_ares_mem.c"
+#include "ev_ares_service.c"
+#include "ev_ares_naptr_chain.c"
+#include "ev_ares_sort.c"
+#include "ev_ares_addrs.c"
+#include "ev_ares_server.c"
+#include "ev_ares_async.c"
 
 //static const char *lookups = "fb";
 
@@ -20,18 +53,77 @@ static void io_cb (EV_P_ ev_io *w, int revents) {
 	ev_ares * resolver = (ev_ares *) ( (char *) w - (ptrdiff_t) &((ev_ares *) 0)->ios[ iop->id ] );
 	//cwarn("io %d [%d] %p",w->fd, iop->id,resolver);
 	
+	if (resolver->opts.flags & EV_ARES_DEFER) {
+		iop->ready |= revents;
+		return;
+	}
+	
 	ares_socket_t rfd = ARES_SOCKET_BAD, wfd = ARES_SOCKET_BAD;
 	
 	if (revents & EV_READ)  rfd = w->fd;
 	if (revents & EV_WRITE) wfd = w->fd;
 	
-	ares_process_fd(resolver->ares.channel, rfd, wfd);
+	ares_process_fd(iop->chan->channel, rfd, wfd);
+	
+	return;
+}
+
+// Runs at EV_MINPRI, so it is invoked after every io_cb of this iteration
+static void process_cb (EV_P_ ev_check *w, int revents) {
+	ev_ares * resolver = (ev_ares *) ( (char *) w - (ptrdiff_t) &((ev_ares *) 0)->process );
+	struct ev_ares_chan *chan, *next;
+	fd_set readers, writers;
+	int i, n;
 	
+	for (chan = resolver->chan; chan; chan = next) {
+		next = chan->next;
+		FD_ZERO(&readers);
+		FD_ZERO(&writers);
+		n = 0;
+		for (i=0; i<IOMAX; i++) {
+			io_ptr * iop = &resolver->ios[i];
+			int ready = iop->ready;
+			if (!ready || iop->chan != chan) continue;
+			iop->ready = 0;
+			if (iop->io.fd >= FD_SETSIZE) {
+				ares_process_fd(chan->channel,
+					ready & EV_READ  ? iop->io.fd : ARES_SOCKET_BAD,
+					ready & EV_WRITE ? iop->io.fd : ARES_SOCKET_BAD);
+				continue;
+			}
+			if (ready & EV_READ)  FD_SET(iop->io.fd, &readers);
+			if (ready & EV_WRITE) FD_SET(iop->io.fd, &writers);
+			n++;
+		}
+		if (n) {
+			ares_process(chan->channel, &readers, &writers);
+		}
+	}
 	return;
 }
 
+// Arms the timeout timer for the nearest timeout over all channels, the draining ones included
+static void ev_ares_timer_arm(ev_ares *resolver) {
+	struct ev_ares_chan *chan;
+	struct timeval *tvp = NULL, tv[2];
+	int i = 0;
+	for (chan = resolver->chan; chan; chan = chan->next) {
+		tvp = ares_timeout(chan->channel, tvp, &tv[ i++ & 1 ]);
+	}
+	if (tvp) {
+		double timeout = (double)tvp->tv_sec+(double)tvp->tv_usec/1.0e6;
+		//cwarn("Set timeout to %0.8lf",timeout);
+		if (timeout < 1e-3) timeout = 1e-3;
+		//resolver->tw.interval = timeout;
+		//ev_timer_again(resolver->loop, &eares->tw);
+		ev_timer_set(&resolver->tw,timeout,0.);
+		ev_timer_start(resolver->loop, &resolver->tw);
+	}
+}
+
 static void tw_cb (EV_P_ ev_timer *w, int revents) {
 	ev_ares * resolver = (ev_ares *) ( (char *) w - (ptrdiff_t) &((ev_ares *) 0)->tw );
+	struct ev_ares_chan *chan, *next;
 	fd_set readers, writers;
 	FD_ZERO(&readers);
 	FD_ZERO(&writers);
@@ -44,25 +136,24 @@ static void tw_cb (EV_P_ ev_timer *w, int revents) {
 	if (revents & EV_WRITE) wfd = w->fd;
 	
 	*/
-	ares_process(resolver->ares.channel, &readers, &writers);
+	for (chan = resolver->chan; chan; chan = next) {
+		next = chan->next;
+		ares_process(chan->channel, &readers, &writers);
+	}
+	// retries do not always change socket state, so nothing else would re-arm us
+	if (resolver->ioc > 0 && !ev_is_active( &resolver->tw )) {
+		ev_ares_timer_arm(resolver);
+	}
 	return;
 }
 
 static void ev_ares_sock_state_cb(void *data, int s, int read, int write) {
-	struct timeval *tvp, tv;
-	memset(&tv,0,sizeof(tv));
-	ev_ares * resolver = (ev_ares *) data;
-	if( !ev_is_active( &resolver->tw ) && (tvp = ares_timeout(resolver->ares.channel, NULL, &tv)) ) {
-		double timeout = (double)tvp->tv_sec+(double)tvp->tv_usec/1.0e6;
-		//cwarn("Set timeout to %0.8lf for %d",timeout, s);
-		if (timeout > 0) {
-			//resolver->tw.interval = timeout;
-			//ev_timer_again(resolver->loop, &eares->tw);
-			ev_timer_set(&resolver->tw,timeout,0.);
-			ev_timer_start(resolver->loop, &resolver->tw);
-		}
+	struct ev_ares_chan * chan = (struct ev_ares_chan *) data;
+	ev_ares * resolver = chan->resolver;
+	if( !ev_is_active( &resolver->tw ) ) {
+		ev_ares_timer_arm(resolver);
 	}
-	//cwarn("[%p] Change state fd %d read:%d write:%d; max time: %u.%u (%p) (active: %d)", data, s, read, write, tv.tv_sec, tv.tv_usec, tvp, resolver->ioc);
+	//cwarn("[%p] Change state fd %d read:%d write:%d (active: %d)", data, s, read, write, resolver->ioc);
 	int i;
 	io_ptr * iop_new = 0, * iop_old = 0, *iop;
 	for (i=0; i<IOMAX; i++) {
@@ -93,6 +184,7 @@ static void ev_ares_sock_state_cb(void *data, int s, int read, int write) {
 		if (iop->io.fd != s) {
 			resolver->ioc++;
 		}
+		iop->chan = chan;
 		ev_io_set( &iop->io, s, (read ? EV_READ : 0) | (write ? EV_WRITE : 0) );
 		ev_io_start( resolver->loop, &iop->io );
 	}
@@ -103,10 +195,19 @@ static void ev_ares_sock_state_cb(void *data, int s, int read, int write) {
 			ev_io_stop(resolver->loop, &iop->io);
 		}
 		ev_io_set( &iop->io, -1, 0);
+		iop->ready = 0;
+		iop->chan = NULL;
 		resolver->ioc--;
 	}
 	if (resolver->ioc <= 0) {
 		ev_timer_stop(resolver->loop, &resolver->tw);
+		if (ev_is_active( &resolver->process )) {
+			ev_check_stop(resolver->loop, &resolver->process);
+		}
+	}
+	else
+	if ( (resolver->opts.flags & EV_ARES_DEFER) && !ev_is_active( &resolver->process ) ) {
+		ev_check_start(resolver->loop, &resolver->process);
 	}
 	//cwarn("active: %d",resolver->ioc);
 	/*
@@ -125,11 +226,91 @@ static void ev_ares_sock_state_cb(void *data, int s, int read, int write) {
 	*/
 }
 
+// Creates a channel configured from resolver->opts and puts it in front of resolver->chan
+static int ev_ares_chan_open(ev_ares *resolver) {
+	struct ev_ares_chan *chan = calloc(1, sizeof(struct ev_ares_chan));
+	struct ares_options options;
+	int status;
+	
+	if (!chan) return ARES_ENOMEM;
+	chan->resolver = resolver;
+	
+	memcpy(&options, &resolver->ares.options, sizeof(options));
+	options.sock_state_cb_data = chan;
+	options.sock_state_cb = ev_ares_sock_state_cb;
+	
+	int optmask = ARES_OPT_SOCK_STATE_CB; //  | ARES_OPT_LOOKUPS // lookups works only for gethostbyname
+	if (resolver->resolvconf) {
+		options.resolvconf_path = resolver->resolvconf;
+		optmask |= ARES_OPT_RESOLVCONF;
+	}
+	if (resolver->opts.ndots > 0) {
+		options.ndots = resolver->opts.ndots;
+		optmask |= ARES_OPT_NDOTS;
+	}
+	if (resolver->opts.domains) {
+		options.domains = resolver->opts.domains;
+		for (options.ndomains = 0; options.domains[ options.ndomains ]; options.ndomains++);
+		optmask |= ARES_OPT_DOMAINS;
+	}
+	
+	if ((status = ares_init_options(&chan->channel, &options, optmask)) != ARES_SUCCESS) {
+		free(chan);
+		return status;
+	}
+	
+	ev_ares_sock_setup(resolver, chan->channel);
+	ares_set_socket_configure_callback(chan->channel, ev_ares_sock_config_cb, resolver);
+	
+	chan->next = resolver->chan;
+	resolver->chan = chan;
+	resolver->ares.channel = chan->channel;
+	return ARES_SUCCESS;
+}
+
+static void ev_ares_chan_destroy(struct ev_ares_chan *chan) {
+	ares_destroy(chan->channel);
+	free(chan);
+}
+
+// Destroys the replaced channels that have no queries left
+static void drain_cb (EV_P_ ev_timer *w, int revents) {
+	ev_ares * resolver = (ev_ares *) ( (char *) w - (ptrdiff_t) &((ev_ares *) 0)->drain );
+	struct ev_ares_chan **chp = &resolver->chan->next, *chan;
+	while ((chan = *chp)) {
+		if (chan->inflight > 0) {
+			chp = &chan->next;
+			continue;
+		}
+		*chp = chan->next;
+		ev_ares_chan_destroy(chan);
+	}
+}
+
+static void ev_ares_chan_drained(ev_ares *resolver) {
+	if (!ev_is_active( &resolver->drain )) {
+		ev_timer_set(&resolver->drain, 0., 0.);
+		ev_timer_start(resolver->loop, &resolver->drain);
+	}
+}
+
+static void watch_cb (EV_P_ ev_stat *w, int revents) {
+	ev_ares * resolver = (ev_ares *) ( (char *) w - (ptrdiff_t) &((ev_ares *) 0)->watch );
+	int status;
+	if (!w->attr.st_nlink) return; // removed; wait for the replacement
+	if ((status = ev_ares_reconfigure(resolver)) != ARES_SUCCESS) {
+		cwarn("Reload of %s failed: %s", w->path, ares_strerror(status));
+	}
+}
+
 int ev_ares_init(ev_ares *resolver, double timeout) {
+	return ev_ares_init_options(resolver, timeout, NULL);
+}
+
+int ev_ares_init_options(ev_ares *resolver, double timeout, const ev_ares_options *opts) {
 	memset(resolver,0,sizeof(ev_ares));
+	if (opts) resolver->opts = *opts;
 	
-	resolver->ares.options.sock_state_cb_data = resolver;
-	resolver->ares.options.sock_state_cb = ev_ares_sock_state_cb;
 	//resolver->ares.options.lookups = strdup(lookups);
 	
 	
@@ -143,13 +324,111 @@ int ev_ares_init(ev_ares *resolver, double timeout) {
 		resolver->ios[i].id = i;
 	}
 	ev_init(&resolver->tw,tw_cb);
+	ev_init(&resolver->flush,flush_cb);
+	ev_init(&resolver->process,process_cb);
+	ev_set_priority(&resolver->process,EV_MINPRI);
+	ev_init(&resolver->sched.release,release_cb);
+	ev_init(&resolver->hits.timer,hits_cb);
+	ev_init(&resolver->drain,drain_cb);
+	
+	int status = ev_ares_chan_open(resolver);
+	if (status != ARES_SUCCESS) return status;
+	
+	ev_ares_sched_init(resolver);
+	if (resolver->opts.cache_size > 0 && !(resolver->cache = ev_ares_cache_new(resolver->opts.cache_size, resolver->opts.cache_policy, &resolver->stats))) {
+		return ARES_ENOMEM;
+	}
+	if (resolver->cache && resolver->opts.shm_cache
+	    && (status = ev_ares_shm_attach(resolver->cache, resolver->opts.shm_cache, resolver->opts.shm_cache_size)) != ARES_SUCCESS) {
+		return status;
+	}
+	// a segment alone over the budget would hold back every query
+	if (resolver->opts.mem_budget && resolver->stats.mem_shm >= resolver->opts.mem_budget) return ARES_EBADFLAGS;
+	// without a table names are just not shared
+	resolver->names = ev_ares_names_new();
+	if (resolver->opts.ptr_cache_size > 0 && !(resolver->ptr_cache = ev_ares_rev_cache_new(resolver->opts.ptr_cache_size, &resolver->stats))) {
+		return ARES_ENOMEM;
+	}
+	if (resolver->opts.flags & EV_ARES_SORT) {
+		ev_ares_sort_policy_add(resolver, ev_ares_sort_failed, NULL);
+		ev_ares_sort_policy_add(resolver, ev_ares_sort_precedence, NULL);
+		ev_ares_sort_policy_add(resolver, ev_ares_sort_local, NULL);
+	}
+	if ((resolver->opts.flags & (EV_ARES_ROTATE | EV_ARES_P2C)) && !ev_ares_sort_get(resolver)) {
+		return ARES_ENOMEM;
+	}
+	return status;
+}
+
+/*
+ * Builds a fresh channel from the current system configuration and sends
+ * new queries to it. The old channel keeps serving its in-flight queries
+ * and is destroyed once they are all done.
+ */
+int ev_ares_reconfigure(ev_ares *resolver) {
+	struct ev_ares_chan *old = resolver->chan;
+	int status = ev_ares_chan_open(resolver);
+	if (status != ARES_SUCCESS) return status;
 	
-	return ares_init_options(&resolver->ares.channel, &resolver->ares.options, ARES_OPT_SOCK_STATE_CB); //  | ARES_OPT_LOOKUPS // lookups works only for gethostbyname
+	resolver->stats.reconfigures++;
+	ev_ares_sched_init(resolver);
+	// the search list may be another one now
+	if (resolver->cache) ev_ares_cache_forget(resolver->cache, EV_ARES_T_SEARCH);
+	if (!old->inflight) {
+		if (resolver->loop) {
+			ev_ares_chan_drained(resolver);
+		}
+		else {
+			resolver->chan->next = old->next;
+			ev_ares_chan_destroy(old);
+		}
+	}
+	return ARES_SUCCESS;
+}
+
+void ev_ares_watch(struct ev_loop * loop, ev_ares *resolver, const char *path) {
+	resolver->loop = loop;
+	if (ev_is_active( &resolver->watch )) {
+		ev_stat_stop(loop, &resolver->watch);
+	}
+	free(resolver->resolvconf);
+	resolver->resolvconf = path ? strdup(path) : NULL;
+	ev_stat_init(&resolver->watch, watch_cb, path ? resolver->resolvconf : "/etc/resolv.conf", 0.);
+	ev_stat_start(loop, &resolver->watch);
 }
 
 int ev_ares_clean(ev_ares *resolver) {
-	ares_destroy(resolver->ares.channel);
+	struct ev_ares_chan *chan = resolver->chan, *next;
+	ev_ares_async_cleanup(resolver);
+	if (ev_is_active( &resolver->process )) {
+		ev_check_stop(resolver->loop, &resolver->process);
+	}
+	if (ev_is_active( &resolver->watch )) {
+		ev_stat_stop(resolver->loop, &resolver->watch);
+	}
+	resolver->chan = NULL;
+	for (; chan; chan = next) {
+		next = chan->next;
+		ev_ares_chan_destroy(chan);
+	}
+	if (ev_is_active( &resolver->drain )) {
+		ev_timer_stop(resolver->loop, &resolver->drain);
+	}
 	ares_destroy_options(&resolver->ares.options);
+	ev_ares_sched_cleanup(resolver);
+	ev_ares_hits_cleanup(resolver);
+	ev_ares_sock_cleanup(resolver);
+	ev_ares_cache_free(resolver->cache);
+	resolver->cache = NULL;
+	ev_ares_rev_cache_free(resolver->ptr_cache);
+	resolver->ptr_cache = NULL;
+	free(resolver->flights);
+	resolver->flights = NULL;
+	ev_ares_names_free(resolver->names);
+	resolver->names = NULL;
+	ev_ares_sort_cleanup(resolver);
+	free(resolver->resolvconf);
+	resolver->resolvconf = NULL;
 }
 
 // methods
@@ -225,6 +504,10 @@ static void ev_ares_internal_gethostbyaddr_callback(ev_ares_result_hba * res, in
 }
 
 void ev_ares_gethostbyaddr (struct ev_loop * loop, ev_ares * resolver, char * hostname, void *any, ev_ares_callback_hba callback) {
+	ev_ares_gethostbyaddr_ex(loop, resolver, hostname, 0, any, callback);
+}
+
+void ev_ares_gethostbyaddr_ex (struct ev_loop * loop, ev_ares * resolver, char * hostname, int flags, void *any, ev_ares_callback_hba callback) {
 	resolver->loop = loop;
 	ev_ares_result_hba * res = malloc(sizeof(ev_ares_result_hba));
 	int length;
@@ -253,31 +536,52 @@ void ev_ares_gethostbyaddr (struct ev_loop * loop, ev_ares * resolver, char * ho
 		return;
 	}
 	
-	ares_gethostbyaddr(resolver->ares.channel, addr, length, res->family, (ares_host_callback) ev_ares_internal_gethostbyaddr_callback, res);
+	ev_ares_hostbyaddr(resolver, addr, length, res->family, flags, (ares_host_callback) ev_ares_internal_gethostbyaddr_callback, res);
 	return;
 }
 
+// the parsers that do not intern names ignore the table
+#define ev_ares_parse_mx_reply_in(names, abuf, alen, out)    ev_ares_parse_mx_reply(abuf, alen, out)
+#define ev_ares_parse_ns_reply_in(names, abuf, alen, out)    ev_ares_parse_ns_reply(abuf, alen, out)
+#define ev_ares_parse_ptr_reply_in(names, abuf, alen, out)   ev_ares_parse_ptr_reply(abuf, alen, out)
+#define ev_ares_parse_srv_reply_in(names, abuf, alen, out)   ev_ares_parse_srv_reply(abuf, alen, out)
+#define ev_ares_parse_txt_reply_in(names, abuf, alen, out)   ev_ares_parse_txt_reply(abuf, alen, out)
+#define ev_ares_parse_soa_reply_in(names, abuf, alen, out)   ev_ares_parse_soa_reply(abuf, alen, out)
+#define ev_ares_parse_naptr_reply_in(names, abuf, alen, out) ev_ares_parse_naptr_reply(abuf, alen, out)
+#define ev_ares_parse_svcb_reply_in(names, abuf, alen, out)  ev_ares_parse_svcb_reply(abuf, alen, out)
+#define ev_ares_parse_https_reply_in(names, abuf, alen, out) ev_ares_parse_https_reply(abuf, alen, out)
+
 #define gen_method(type,dosort)\
-static void ev_ares_internal_##type##_callback(ev_ares_result_##type * res, int status, int timeouts, unsigned char *abuf, int alen) {\
-	res->timeouts = timeouts;\
-	res->status = status;\
-	res->error = ares_strerror(status);\
+static void ev_ares_internal_##type##_callback(struct ev_ares_flight * f, int status, int timeouts, unsigned char *abuf, int alen) {\
+	ev_ares_result_##type * res;\
 	struct ev_ares_##type##_reply* reply = NULL;\
+	int i;\
+	ev_ares_flight_land(f);\
 	if (status == ARES_SUCCESS) {\
-		int pstatus = ev_ares_parse_##type##_reply(abuf, alen, &reply);\
-		if (pstatus == ARES_SUCCESS) {\
+		status = ev_ares_parse_##type##_reply_in(f->resolver->names, abuf, alen, &reply);\
+		if (status == ARES_SUCCESS && reply) {\
 			if (dosort) sort_list( (list_t **) &reply );\
-		} else {\
-			res->status = pstatus;\
-			res->error  = ares_strerror(pstatus);\
+			reply = ev_ares_reply_box(reply, sizeof(struct ev_ares_##type##_reply), ev_ares_release_##type##_reply);\
+			if (!reply) status = ARES_ENOMEM;\
 		}\
+	}\
+	/* one parsed list for every waiter; it lives on for those who take a reference */\
+	for (i = 0; i < f->count; i++) {\
+		res = f->waiters[i];\
+		res->timeouts = timeouts;\
+		res->status = status;\
+		res->error = ares_strerror(status);\
 		res->type = reply;\
+		res->callback(res);\
+		free(res);\
 	}\
-	res->callback(res);\
-	ev_ares_free_##type##_reply(reply);\
-	free(res);\
+	ev_ares_reply_unref(reply);\
+	ev_ares_flight_free(f);\
 }\
 void ev_ares_##type    (struct ev_loop * loop, ev_ares * resolver, char * hostname, void * any, ev_ares_callback_##type callback) {\
+	ev_ares_##type##_ex(loop, resolver, hostname, 0, any, callback);\
+}\
+void ev_ares_##type##_ex (struct ev_loop * loop, ev_ares * resolver, char * hostname, int flags, void * any, ev_ares_callback_##type callback) {\
 	resolver->loop = loop;\
 	ev_ares_result_##type * res = malloc(sizeof(ev_ares_result_##type));\
 	\
@@ -286,7 +590,19 @@ void ev_ares_##type    (struct ev_loop * loop, ev_ares * resolver, char * hostna
 	res->query    = hostname;\
 	res->callback = (ev_ares_callback_v) callback;\
 	\
-	ares_search(resolver->ares.channel, hostname, ns_c_in, ns_t_##type, (ares_callback) ev_ares_internal_##type##_callback, res);\
+	struct ev_ares_flight *f;\
+	switch (ev_ares_flight_join(resolver, hostname, ns_t_##type, flags, res, &f)) {\
+		case 0:\
+			ev_ares_lookup(resolver, hostname, ns_c_in, ns_t_##type, flags, (ares_callback) ev_ares_internal_##type##_callback, f);\
+			break;\
+		case -1:\
+			res->timeouts = 0;\
+			res->status = ARES_ENOMEM;\
+			res->error = ares_strerror(ARES_ENOMEM);\
+			res->type = NULL;\
+			res->callback(res);\
+			free(res);\
+	}\
 	return;\
 }
 
@@ -299,5 +615,7 @@ gen_method(srv,1);
 gen_method(txt,0);
 gen_method(soa,0);
 gen_method(naptr,1);
+gen_method(svcb,1);
+gen_method(https,1);
 
 #undef gen_metod